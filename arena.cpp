@@ -0,0 +1,55 @@
+#include "arena.h"
+
+#include <cstdlib>
+
+namespace synth {
+
+void* Arena::Allocate(size_t size, size_t align) {
+	auto aligned = (u8*)((uintptr_t(cursor) + align-1) & ~uintptr_t(align-1));
+
+	if(!cursor || aligned + size > end) {
+		// Oversized allocations get a chunk of their own
+		size_t chunkSize = std::max<size_t>(ChunkSize, sizeof(Chunk) + size + align);
+		auto chunk = (Chunk*) std::malloc(chunkSize);
+		if(!chunk) {
+			printf("Arena failed to allocate %zu bytes\n", chunkSize);
+			std::abort();
+		}
+
+		*chunk = {chunks, chunkSize};
+		chunks = chunk;
+		reserved += chunkSize;
+
+		cursor = (u8*)(chunk + 1);
+		end = (u8*)chunk + chunkSize;
+		aligned = (u8*)((uintptr_t(cursor) + align-1) & ~uintptr_t(align-1));
+	}
+
+	cursor = aligned + size;
+	return aligned;
+}
+
+const char* Arena::String(const char* s) {
+	size_t length = strlen(s) + 1;
+	auto copy = (char*) Allocate(length, 1);
+	std::memcpy(copy, s, length);
+	return copy;
+}
+
+void Arena::Reset() {
+	for(auto f = finalizers; f; f = f->next)
+		f->destroy(f->object);
+
+	while(chunks) {
+		auto next = chunks->next;
+		std::free(chunks);
+		chunks = next;
+	}
+
+	finalizers = nullptr;
+	cursor = nullptr;
+	end = nullptr;
+	reserved = 0;
+}
+
+}
@@ -0,0 +1,84 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "common.h"
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace synth {
+
+// Bump allocator for everything a synth graph owns. Nothing is freed on its own,
+//	everything goes at once on Reset or destruction, which also runs the destructors
+//	of objects made with New, newest first. Not thread safe, graphs are only built
+//	from the thread that owns the synth.
+struct Arena {
+	enum { ChunkSize = 1<<14 };
+
+	struct Chunk {
+		Chunk* next;
+		size_t size;
+	};
+
+	struct Finalizer {
+		Finalizer* next;
+		void (*destroy)(void*);
+		void* object;
+	};
+
+	Chunk* chunks = nullptr;
+	Finalizer* finalizers = nullptr;
+	u8* cursor = nullptr;
+	u8* end = nullptr;
+	size_t reserved = 0; // Bytes held in chunks
+
+	Arena() = default;
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+	~Arena() { Reset(); }
+
+	void* Allocate(size_t size, size_t align);
+	const char* String(const char*);
+	void Reset();
+
+	template<class T, class... Args>
+	T* New(Args&&... args) {
+		auto object = new(Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+
+		if(!std::is_trivially_destructible<T>::value) {
+			auto f = (Finalizer*) Allocate(sizeof(Finalizer), alignof(Finalizer));
+			*f = {finalizers, [](void* o) { ((T*)o)->~T(); }, object};
+			finalizers = f;
+		}
+
+		return object;
+	}
+};
+
+// Lets standard containers live in an arena. Deallocation is a no-op, so a vector
+//	that grows leaves its old storage behind until the arena is reset
+template<class T>
+struct ArenaAllocator {
+	using value_type = T;
+
+	Arena* arena;
+
+	ArenaAllocator(Arena* a) : arena{a} {}
+	template<class U> ArenaAllocator(const ArenaAllocator<U>& o) : arena{o.arena} {}
+
+	T* allocate(size_t n) { return (T*) arena->Allocate(n * sizeof(T), alignof(T)); }
+	void deallocate(T*, size_t) {}
+};
+
+template<class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena == b.arena; }
+template<class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.arena != b.arena; }
+
+template<class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+}
+
+#endif
@@ -0,0 +1,432 @@
+#include "convolution.h"
+#include "synth.h"
+#include "denormal.h"
+#include "rtcheck.h"
+#include "trace.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace synth {
+
+using Complex = std::complex<f32>;
+
+// Iterative radix-2 FFT, for power of two sizes. Transforms are unnormalised
+struct FFT {
+	u32 size;
+	std::vector<u32> reversed;
+	std::vector<Complex> twiddles;
+
+	void Init(u32 size_) {
+		size = size_;
+
+		u32 bits = 0;
+		while((1u<<bits) < size) bits++;
+
+		reversed.resize(size);
+		for(u32 i = 0; i < size; i++) {
+			u32 r = 0;
+			for(u32 b = 0; b < bits; b++)
+				if(i & (1u<<b)) r |= 1u<<(bits-1-b);
+
+			reversed[i] = r;
+		}
+
+		twiddles.resize(size/2);
+		for(u32 i = 0; i < size/2; i++) {
+			f64 a = -2.0*PI*i/size;
+			twiddles[i] = Complex(std::cos(a), std::sin(a));
+		}
+	}
+
+	void Transform(Complex* data, bool inverse) const {
+		for(u32 i = 0; i < size; i++)
+			if(i < reversed[i]) std::swap(data[i], data[reversed[i]]);
+
+		f32 sign = inverse? -1.f : 1.f;
+
+		for(u32 len = 2; len <= size; len <<= 1) {
+			u32 half = len/2;
+			u32 stride = size/len;
+
+			for(u32 i = 0; i < size; i += len) {
+				for(u32 j = 0; j < half; j++) {
+					// Written out to avoid the NaN handling of std::complex multiplication
+					auto w = twiddles[j*stride];
+					f32 wr = w.real(), wi = w.imag()*sign;
+
+					auto b = data[i+j+half];
+					Complex bw {b.real()*wr - b.imag()*wi, b.real()*wi + b.imag()*wr};
+
+					auto a = data[i+j];
+					data[i+j] = a + bw;
+					data[i+j+half] = a - bw;
+				}
+			}
+		}
+	}
+};
+
+// Runs the far partitions of asynchronous convolvers
+struct ConvolutionWorker {
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable released;
+	std::vector<Convolver*> convolvers;
+	Convolver* current = nullptr; // Being worked on, outside the lock
+	bool running = false;
+
+	~ConvolutionWorker() {
+		if(!thread.joinable()) return;
+
+		{
+			std::lock_guard<std::mutex> l(mutex);
+			running = false;
+		}
+
+		wake.notify_one();
+		thread.join();
+	}
+
+	void Register(Convolver* c) {
+		std::lock_guard<std::mutex> l(mutex);
+		convolvers.push_back(c);
+
+		if(!running) {
+			running = true;
+			thread = std::thread{[this]{ Run(); }};
+		}
+	}
+
+	// Waits if the worker is in the middle of c, so c is never referenced once this returns
+	void Unregister(Convolver* c) {
+		std::unique_lock<std::mutex> l(mutex);
+		convolvers.erase(std::remove(convolvers.begin(), convolvers.end(), c), convolvers.end());
+		released.wait(l, [&]{ return current != c; });
+	}
+
+	// Computes the issued far sums of c that nobody has claimed yet
+	bool Work(Convolver* c) {
+		bool worked = false;
+		u64 issued = c->farIssued.load(std::memory_order_acquire);
+		u64 claimed = c->farClaimed.load(std::memory_order_acquire);
+
+		while(claimed < issued) {
+			// The audio thread may have claimed ahead, which reloads claimed
+			if(!c->farClaimed.compare_exchange_weak(claimed, claimed+1, std::memory_order_acq_rel))
+				continue;
+
+			RealtimeSection realtime {"convolution worker"};
+			TraceScope trace {"convolve far partitions"};
+			c->ComputeFarSum(++claimed);
+			worked = true;
+		}
+
+		return worked;
+	}
+
+	void Run() {
+		EnableFlushToZero();
+		SetTraceThreadName("convolution worker");
+
+		std::unique_lock<std::mutex> l(mutex);
+
+		while(running) {
+			bool worked = false;
+
+			// The lock is only held between convolvers, so registering doesn't wait
+			//	on a whole pass. By index, since convolvers may change in between
+			for(size_t i = 0; i < convolvers.size(); i++) {
+				current = convolvers[i];
+				l.unlock();
+				worked = Work(current) || worked;
+				l.lock();
+
+				current = nullptr;
+				released.notify_all();
+			}
+
+			// The audio thread doesn't take the lock to notify, so a wakeup can
+			//	occasionally be missed. Work is handed over well ahead of time so
+			//	waking on a short timeout covers that
+			if(!worked)
+				wake.wait_for(l, std::chrono::milliseconds(2));
+		}
+	}
+};
+
+namespace {
+	std::mutex registryMutex;
+	std::map<std::string, std::shared_ptr<const ImpulseResponse>> impulseResponses;
+	std::map<u32, std::shared_ptr<const FFT>> ffts;
+
+	ConvolutionWorker worker;
+
+	// Spectrum of fft.size real samples, keeping only the non-redundant bins
+	void RealSpectrum(const FFT& fft, const f32* samples, Complex* scratch, f32* re, f32* im, u32 bins) {
+		for(u32 i = 0; i < fft.size; i++)
+			scratch[i] = Complex(samples[i], 0.f);
+
+		fft.Transform(scratch, false);
+
+		for(u32 b = 0; b < bins; b++) {
+			re[b] = scratch[b].real();
+			im[b] = scratch[b].imag();
+		}
+	}
+
+	// Inverse of RealSpectrum, the real part of scratch holds the signal scaled by fft.size
+	void RealSignal(const FFT& fft, const f32* re, const f32* im, Complex* scratch, u32 bins) {
+		for(u32 b = 0; b < bins; b++)
+			scratch[b] = Complex(re[b], im[b]);
+
+		for(u32 b = bins; b < fft.size; b++)
+			scratch[b] = std::conj(scratch[fft.size - b]);
+
+		fft.Transform(scratch, true);
+	}
+
+	void MultiplyAccumulate(f32* __restrict accRe, f32* __restrict accIm,
+		const f32* __restrict aRe, const f32* __restrict aIm,
+		const f32* __restrict bRe, const f32* __restrict bIm, u32 count) {
+
+		for(u32 i = 0; i < count; i++) {
+			accRe[i] += aRe[i]*bRe[i] - aIm[i]*bIm[i];
+			accIm[i] += aRe[i]*bIm[i] + aIm[i]*bRe[i];
+		}
+	}
+
+	std::shared_ptr<const FFT> GetFFT(u32 size) {
+		std::lock_guard<std::mutex> l(registryMutex);
+		auto& fft = ffts[size];
+		if(!fft) {
+			auto f = std::make_shared<FFT>();
+			f->Init(size);
+			fft = f;
+		}
+
+		return fft;
+	}
+}
+
+bool CreateImpulseResponse(const char* name, const f32* samples, u32 length, u32 partitionSize) {
+	u32 size = 16;
+	while(size < partitionSize) size <<= 1;
+	partitionSize = size;
+
+	auto ir = std::make_shared<ImpulseResponse>();
+	ir->name = name;
+	ir->partitionSize = partitionSize;
+	ir->partitionCount = std::max((length + partitionSize - 1) / partitionSize, 1u);
+	ir->bins = partitionSize + 1;
+	ir->fft = GetFFT(partitionSize*2);
+
+	ir->head.assign(partitionSize, 0.f);
+	for(u32 i = 0; i < std::min(length, partitionSize); i++)
+		ir->head[partitionSize-1-i] = samples[i];
+
+	u32 tailPartitions = ir->partitionCount-1;
+	ir->spectraRe.resize(tailPartitions * ir->bins);
+	ir->spectraIm.resize(tailPartitions * ir->bins);
+
+	std::vector<f32> padded(partitionSize*2);
+	std::vector<Complex> scratch(partitionSize*2);
+
+	for(u32 p = 0; p < tailPartitions; p++) {
+		u32 begin = (p+1) * partitionSize;
+		u32 count = std::min(length - begin, partitionSize);
+
+		std::fill(padded.begin(), padded.end(), 0.f);
+		std::copy(samples + begin, samples + begin + count, padded.begin());
+
+		RealSpectrum(*ir->fft, padded.data(), scratch.data(),
+			&ir->spectraRe[p*ir->bins], &ir->spectraIm[p*ir->bins], ir->bins);
+	}
+
+	std::lock_guard<std::mutex> l(registryMutex);
+	impulseResponses[name] = ir;
+	return true;
+}
+
+bool LoadImpulseResponse(const char* name, u32 partitionSize, u32 partitionCount,
+	const f32* head, const f32* spectraRe, const f32* spectraIm) {
+
+	// Sizes CreateImpulseResponse wouldn't have made
+	if(partitionSize < 16 || (partitionSize & (partitionSize-1)) || partitionCount == 0)
+		return false;
+
+	auto ir = std::make_shared<ImpulseResponse>();
+	ir->name = name;
+	ir->partitionSize = partitionSize;
+	ir->partitionCount = partitionCount;
+	ir->bins = partitionSize + 1;
+	ir->fft = GetFFT(partitionSize*2);
+
+	u32 spectra = (partitionCount-1) * ir->bins;
+	ir->head.assign(head, head + partitionSize);
+	ir->spectraRe.assign(spectraRe, spectraRe + spectra);
+	ir->spectraIm.assign(spectraIm, spectraIm + spectra);
+
+	std::lock_guard<std::mutex> l(registryMutex);
+	impulseResponses[name] = ir;
+	return true;
+}
+
+std::shared_ptr<const ImpulseResponse> GetImpulseResponse(const char* name) {
+	std::lock_guard<std::mutex> l(registryMutex);
+	auto it = impulseResponses.find(name);
+	if(it == impulseResponses.end())
+		return nullptr;
+
+	return it->second;
+}
+
+void Convolver::Init(std::shared_ptr<const ImpulseResponse> ir_, u32 slackFrames) {
+	ir = std::move(ir_);
+
+	u32 size = ir->partitionSize;
+	u32 bins = ir->bins;
+
+	farPartition = ir->partitionCount;
+	if(slackFrames > 0) {
+		// Far sums are issued farPartition-1 blocks ahead, which has to span at
+		//	least one whole burst of rendering for the worker to get a chance to run
+		u32 ahead = (slackFrames*2 + size - 1) / size;
+		farPartition = std::min(ahead + 1, ir->partitionCount);
+	}
+
+	slots = ir->partitionCount + farPartition;
+	position = 0;
+	historyPosition = 0;
+	block = 0;
+
+	history.assign(size*2, 0.f);
+	input.assign(size*2, 0.f);
+	tail.assign(size, 0.f);
+	delayRe.assign(slots * bins, 0.f);
+	delayIm.assign(slots * bins, 0.f);
+	farRe.assign(farPartition * bins, 0.f);
+	farIm.assign(farPartition * bins, 0.f);
+	accRe.assign(bins, 0.f);
+	accIm.assign(bins, 0.f);
+	scratch.assign(size*2, 0.f);
+
+	// Far sums before this only cover input from before the first block
+	farIssued = farPartition-1;
+	farClaimed = farPartition-1;
+	farDone = farPartition-1;
+	misses = 0;
+
+	if(farPartition < ir->partitionCount)
+		worker.Register(this);
+}
+
+void Convolver::Deinit() {
+	if(farPartition < ir->partitionCount)
+		worker.Unregister(this);
+
+	ir = nullptr;
+}
+
+f32 Convolver::Process(f32 sample) {
+	u32 size = ir->partitionSize;
+
+	history[historyPosition] = sample;
+	history[historyPosition + size] = sample;
+	historyPosition = (historyPosition + 1) % size;
+
+	const f32* head = ir->head.data();
+	const f32* window = &history[historyPosition];
+
+	f32 out = tail[position];
+	for(u32 i = 0; i < size; i++)
+		out += head[i] * window[i];
+
+	input[size + position] = sample;
+	if(++position == size) {
+		ProcessBlock();
+		position = 0;
+	}
+
+	return out;
+}
+
+void Convolver::ProcessBlock() {
+	u32 size = ir->partitionSize;
+	u32 bins = ir->bins;
+	auto& fft = *ir->fft;
+
+	u32 slot = (block % slots) * bins;
+	RealSpectrum(fft, input.data(), scratch.data(), &delayRe[slot], &delayIm[slot], bins);
+	std::copy(input.begin() + size, input.end(), input.begin());
+
+	std::fill(accRe.begin(), accRe.end(), 0.f);
+	std::fill(accIm.begin(), accIm.end(), 0.f);
+	AccumulatePartitions(block+1, 1, farPartition, accRe.data(), accIm.data());
+
+	if(farPartition < ir->partitionCount) {
+		u64 target = block+1;
+
+		// Never waits on the worker. If it hasn't started this sum, it's computed
+		//	here, if it's in the middle of it, the sum is left out
+		u64 claimed = farClaimed.load(std::memory_order_acquire);
+		if(farDone.load(std::memory_order_acquire) < target && claimed < target
+			&& farClaimed.compare_exchange_strong(claimed, target, std::memory_order_acq_rel))
+			ComputeFarSum(target);
+
+		if(farDone.load(std::memory_order_acquire) >= target) {
+			u32 farSlot = (target % farPartition) * bins;
+			for(u32 b = 0; b < bins; b++) {
+				accRe[b] += farRe[farSlot + b];
+				accIm[b] += farIm[farSlot + b];
+			}
+		}else{
+			misses++;
+		}
+
+		// Everything the far sum farPartition blocks from now depends on is in the delay line
+		farIssued.store(block + farPartition, std::memory_order_release);
+		worker.wake.notify_one();
+	}
+
+	RealSignal(fft, accRe.data(), accIm.data(), scratch.data(), bins);
+
+	// Overlap-save, only the second half is free of circular aliasing
+	f32 scale = 1.f / fft.size;
+	for(u32 i = 0; i < size; i++)
+		tail[i] = scratch[size + i].real() * scale;
+
+	block++;
+}
+
+void Convolver::ComputeFarSum(u64 targetBlock) {
+	u32 bins = ir->bins;
+	u32 slot = (targetBlock % farPartition) * bins;
+	std::fill_n(&farRe[slot], bins, 0.f);
+	std::fill_n(&farIm[slot], bins, 0.f);
+	AccumulatePartitions(targetBlock, farPartition, ir->partitionCount, &farRe[slot], &farIm[slot]);
+
+	// Sums finish out of order when the audio thread steps in
+	u64 done = farDone.load(std::memory_order_relaxed);
+	while(done < targetBlock && !farDone.compare_exchange_weak(done, targetBlock, std::memory_order_release))
+		;
+}
+
+void Convolver::AccumulatePartitions(u64 targetBlock, u32 first, u32 last, f32* accRe, f32* accIm) {
+	u32 bins = ir->bins;
+
+	for(u32 k = first; k < last; k++) {
+		u32 slot = ((targetBlock + slots - k) % slots) * bins;
+		u32 partition = (k-1) * bins;
+
+		MultiplyAccumulate(accRe, accIm, &delayRe[slot], &delayIm[slot],
+			&ir->spectraRe[partition], &ir->spectraIm[partition], bins);
+	}
+}
+
+}
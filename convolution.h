@@ -0,0 +1,88 @@
+#ifndef CONVOLUTION_H
+#define CONVOLUTION_H
+
+#include "common.h"
+#include <atomic>
+#include <complex>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace synth {
+
+struct FFT;
+
+// Impulse responses are split into partitions of partitionSize samples. The first
+//	(the head) is convolved directly so that convolution adds no latency, the rest
+//	are stored as spectra of 2*partitionSize samples. Responses are immutable once
+//	created, and are shared between every convolver using them.
+struct ImpulseResponse {
+	std::string name; // As registered
+	u32 partitionSize;
+	u32 partitionCount; // Including the head
+	u32 bins;           // Non-redundant bins per spectrum, partitionSize+1
+	std::shared_ptr<const FFT> fft;
+
+	std::vector<f32> head; // Reversed, so it can be applied with a dot product
+	std::vector<f32> spectraRe; // (partitionCount-1) x bins
+	std::vector<f32> spectraIm;
+};
+
+std::shared_ptr<const ImpulseResponse> GetImpulseResponse(const char* name);
+
+// Registers (or replaces) a response from partitions computed earlier, e.g., read back
+//	from a graph cache, skipping the transforms. head is partitionSize samples, the
+//	spectra (partitionCount-1) x (partitionSize+1) bins, all copied
+bool LoadImpulseResponse(const char* name, u32 partitionSize, u32 partitionCount,
+	const f32* head, const f32* spectraRe, const f32* spectraIm);
+
+// Uniformly partitioned overlap-save convolution. Every partitionSize samples the
+//	spectrum of the last two input blocks is pushed into a frequency domain delay
+//	line, and the tail for the next block is the sum of delayed spectra multiplied
+//	by the partition spectra.
+//
+//	Asynchronous convolvers leave partitions from farPartition on to a background
+//	worker. Those only depend on input at least farPartition blocks old, so the
+//	worker is handed them farPartition-1 blocks before they're needed. The audio
+//	thread never waits on the worker: a far sum the worker hasn't started by the
+//	time it's needed is computed inline, and one it's still in the middle of is
+//	left out of the output and counted in misses.
+struct Convolver {
+	std::shared_ptr<const ImpulseResponse> ir;
+
+	u32 farPartition; // partitionCount when synchronous
+	u32 slots; // Size of the delay line
+	u32 position;
+	u32 historyPosition;
+	u64 block;
+
+	std::vector<f32> history; // Double written ring of the last partitionSize inputs
+	std::vector<f32> input;   // Previous and current input blocks
+	std::vector<f32> tail;    // Output of all but the head for the current block
+	std::vector<f32> delayRe, delayIm; // slots x bins
+	std::vector<f32> farRe, farIm;     // farPartition x bins, one sum per block in flight
+	std::vector<f32> accRe, accIm;
+	std::vector<std::complex<f32>> scratch;
+
+	std::atomic<u64> farIssued;
+	std::atomic<u64> farClaimed; // Started, by the worker or by the audio thread when the worker is late
+	std::atomic<u64> farDone;
+	u64 misses;
+
+	// slackFrames: how many samples may be rendered in one go before the worker is
+	//	late, e.g., the device buffer size. 0 computes everything inline
+	void Init(std::shared_ptr<const ImpulseResponse>, u32 slackFrames);
+	void Deinit();
+
+	f32 Process(f32 sample);
+
+private:
+	void ProcessBlock();
+	void AccumulatePartitions(u64 targetBlock, u32 first, u32 last, f32* accRe, f32* accIm);
+	void ComputeFarSum(u64 targetBlock); // Once claimed
+	friend struct ConvolutionWorker;
+};
+
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef DENORMAL_H
+#define DENORMAL_H
+
+#include "common.h"
+#include <cfloat>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SYNTH_FTZ_SSE
+#elif defined(__aarch64__) || (defined(__arm__) && defined(__VFP_FP__) && !defined(__SOFTFP__))
+#define SYNTH_FTZ_ARM
+#elif !defined(SYNTH_DENORMAL_SAFE)
+// No way of making the FPU flush subnormals, so stateful nodes flush their own state
+#define SYNTH_DENORMAL_SAFE
+#endif
+
+namespace synth {
+
+// Makes the calling thread flush subnormal results and inputs to zero. Has to be
+//	called on every thread that runs DSP, since the mode is per thread. Returns false
+//	where that isn't supported, in which case only the SYNTH_DENORMAL_SAFE path helps
+inline bool EnableFlushToZero() {
+#if defined(SYNTH_FTZ_SSE)
+	// FTZ (bit 15) and DAZ (bit 6)
+	_mm_setcsr(_mm_getcsr() | 0x8040);
+	return true;
+#elif defined(SYNTH_FTZ_ARM) && defined(__aarch64__)
+	u64 fpcr;
+	asm volatile("mrs %0, fpcr" : "=r"(fpcr));
+	asm volatile("msr fpcr, %0" :: "r"(fpcr | (1ull<<24)));
+	return true;
+#elif defined(SYNTH_FTZ_ARM)
+	u32 fpscr;
+	asm volatile("vmrs %0, fpscr" : "=r"(fpscr));
+	asm volatile("vmsr fpscr, %0" :: "r"(fpscr | (1u<<24)));
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Undoes EnableFlushToZero for the calling thread
+inline void DisableFlushToZero() {
+#if defined(SYNTH_FTZ_SSE)
+	_mm_setcsr(_mm_getcsr() & ~0x8040u);
+#elif defined(SYNTH_FTZ_ARM) && defined(__aarch64__)
+	u64 fpcr;
+	asm volatile("mrs %0, fpcr" : "=r"(fpcr));
+	asm volatile("msr fpcr, %0" :: "r"(fpcr & ~(1ull<<24)));
+#elif defined(SYNTH_FTZ_ARM)
+	u32 fpscr;
+	asm volatile("vmrs %0, fpscr" : "=r"(fpscr));
+	asm volatile("vmsr fpscr, %0" :: "r"(fpscr & ~(1u<<24)));
+#endif
+}
+
+// Only meaningful with flush to zero disabled, DAZ reads subnormal inputs as zero
+inline bool IsSubnormal(f32 v) {
+	return v != 0.f && std::abs(v) < FLT_MIN;
+}
+
+// Applied to recursive state that decays towards zero. A no-op unless built with
+//	SYNTH_DENORMAL_SAFE, which is defined automatically where FTZ isn't available
+inline f32 FlushDenormal(f32 v) {
+#ifdef SYNTH_DENORMAL_SAFE
+	return (std::abs(v) < FLT_MIN)? 0.f : v;
+#else
+	return v;
+#endif
+}
+
+}
+
+#endif
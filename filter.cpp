@@ -0,0 +1,129 @@
+#include "filter.h"
+#include "synth.h"
+#include "denormal.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace synth {
+
+void Filter::Init(Type type_, FilterMode mode_, u32 stages_) {
+	memset(this, 0, sizeof(Filter));
+	type = type_;
+	mode = mode_;
+	stages = std::min(std::max(stages_, 1u), u32(MaxStages));
+}
+
+void Filter::Design(f32 freq, f32 q, f64 dt, f32 out[5]) const {
+	// Keep away from DC and nyquist, where the designs degenerate
+	f64 f = std::min(std::max(f64(freq), 1.0), 0.49/dt);
+	q = std::max(q, 0.01f);
+
+	if(type == TypeStateVariable) {
+		f64 g = std::tan(PI * f * dt);
+		f64 k = 1.0/q;
+		f64 a1 = 1.0/(1.0 + g*(g + k));
+
+		out[0] = k;
+		out[1] = a1;
+		out[2] = g*a1;
+		out[3] = g*g*a1;
+		out[4] = 0.f;
+		return;
+	}
+
+	f64 w0 = 2.0 * PI * f * dt;
+	f64 cw = std::cos(w0);
+	f64 alpha = std::sin(w0)/(2.0*q);
+
+	f64 b0, b1, b2;
+	switch(mode) {
+		default:
+		case FilterMode::LowPass:  b0 = (1.0-cw)/2.0; b1 = 1.0-cw;     b2 = b0; break;
+		case FilterMode::HighPass: b0 = (1.0+cw)/2.0; b1 = -(1.0+cw);  b2 = b0; break;
+		case FilterMode::BandPass: b0 = alpha;        b1 = 0.0;        b2 = -alpha; break;
+		case FilterMode::Notch:    b0 = 1.0;          b1 = -2.0*cw;    b2 = 1.0; break;
+	}
+
+	f64 a0 = 1.0 + alpha;
+	out[0] = b0/a0;
+	out[1] = b1/a0;
+	out[2] = b2/a0;
+	out[3] = -2.0*cw/a0;
+	out[4] = (1.0 - alpha)/a0;
+}
+
+f32 Filter::Process(f32 input, f32 freq, f32 q, f64 dt) {
+	if(countdown == 0) {
+		countdown = ControlBlock;
+
+		if(!designed || freq != designFreq || q != designQ || dt != designDT) {
+			f32 target[5];
+			Design(freq, q, dt, target);
+
+			if(designed) {
+				for(u32 i = 0; i < 5; i++)
+					steps[i] = (target[i] - coeffs[i]) / ControlBlock;
+
+				ramp = ControlBlock;
+			}else{
+				std::copy(target, target+5, coeffs);
+				designed = true;
+			}
+
+			designFreq = freq;
+			designQ = q;
+			designDT = dt;
+		}
+	}
+
+	countdown--;
+	if(ramp > 0) {
+		for(u32 i = 0; i < 5; i++)
+			coeffs[i] += steps[i];
+
+		ramp--;
+	}
+
+	f32 x = input;
+
+	if(type == TypeBiquad) {
+		f32 b0 = coeffs[0], b1 = coeffs[1], b2 = coeffs[2];
+		f32 a1 = coeffs[3], a2 = coeffs[4];
+
+		// Transposed direct form II
+		for(u32 s = 0; s < stages; s++) {
+			auto z = state[s];
+			f32 y = b0*x + z[0];
+			z[0] = FlushDenormal(b1*x - a1*y + z[1]);
+			z[1] = FlushDenormal(b2*x - a2*y);
+			x = FlushDenormal(y);
+		}
+
+		return x;
+	}
+
+	f32 k = coeffs[0], a1 = coeffs[1], a2 = coeffs[2], a3 = coeffs[3];
+
+	// Trapezoidal integrated SVF, see Zavalishin's The Art of VA Filter Design
+	for(u32 s = 0; s < stages; s++) {
+		auto ic = state[s];
+		f32 v3 = x - ic[1];
+		f32 v1 = a1*ic[0] + a2*v3;
+		f32 v2 = ic[1] + a2*ic[0] + a3*v3;
+		ic[0] = FlushDenormal(2.f*v1 - ic[0]);
+		ic[1] = FlushDenormal(2.f*v2 - ic[1]);
+
+		switch(mode) {
+			default:
+			case FilterMode::LowPass:  x = v2; break;
+			case FilterMode::HighPass: x = x - k*v1 - v2; break;
+			case FilterMode::BandPass: x = k*v1; break;
+			case FilterMode::Notch:    x = x - k*v1; break;
+		}
+	}
+
+	return x;
+}
+
+}
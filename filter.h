@@ -0,0 +1,51 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "common.h"
+
+namespace synth {
+
+enum class FilterMode : u8;
+
+// Cascade of up to MaxStages identical biquad or state variable sections.
+//	Coefficients are only redesigned at the start of a control block, and only if
+//	the cutoff, Q or sample rate changed since the last design. New coefficients
+//	are ramped to across the block so that stepped or modulated cutoffs don't zipper.
+struct Filter {
+	enum Type : u8 {
+		TypeBiquad,
+		TypeStateVariable,
+	};
+
+	enum {
+		MaxStages = 4,
+		ControlBlock = 32,
+	};
+
+	Type type;
+	FilterMode mode;
+	u32 stages;
+
+	f32 designFreq;
+	f32 designQ;
+	f64 designDT;
+	bool designed;
+
+	// Biquad: b0, b1, b2, a1, a2. State variable: k, a1, a2, a3
+	f32 coeffs[5];
+	f32 steps[5];
+	u32 countdown;
+	u32 ramp;
+
+	f32 state[MaxStages][2];
+
+	void Init(Type, FilterMode, u32 stages);
+	f32 Process(f32 input, f32 freq, f32 q, f64 dt);
+
+private:
+	void Design(f32 freq, f32 q, f64 dt, f32 out[5]) const;
+};
+
+}
+
+#endif
@@ -0,0 +1,635 @@
+#include "graphcache.h"
+#include "synth.h"
+#include "convolution.h"
+#include "sampler.h"
+#include "filter.h"
+#include "noise.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace synth {
+
+namespace {
+	// Bump whenever node types, their inputs or anything below changes meaning
+	enum { GraphCacheVersion = 1 };
+
+	struct Header {
+		char magic[8];
+		u32 version;
+		u32 nodeSize; // sizeof(SynthNode)
+		u32 nodeTypes; // NodeTypeCount
+		u32 graphs; // Shared synth first, then buses, then synths
+		u64 key;
+		u64 size; // Of the whole file
+		u64 checksum; // Of everything after the header
+		u32 samples;
+		u32 impulses;
+	};
+
+	constexpr char magic[8] = "LSGRAPH";
+
+	enum GraphKind : u32 {
+		GraphShared,
+		GraphBus,
+		GraphSynth,
+	};
+
+	// FNV-1a
+	u64 HashBytes(const void* data, size_t size, u64 h = 0xcbf29ce484222325ull) {
+		auto p = (const u8*) data;
+		for(size_t i = 0; i < size; i++)
+			h = (h ^ p[i]) * 0x100000001b3ull;
+
+		return h;
+	}
+
+	// Arrays are aligned to 8 bytes within the file, which is mapped page aligned,
+	//	so node tables can be read in place
+	struct Writer {
+		std::vector<u8> data;
+
+		void Write(const void* p, size_t size) {
+			auto b = (const u8*) p;
+			data.insert(data.end(), b, b + size);
+		}
+
+		template<class T>
+		void Write(const T& v) {
+			Write(&v, sizeof(T));
+		}
+
+		void WriteString(const char* s) {
+			u32 length = strlen(s) + 1;
+			Write(length);
+			Write(s, length);
+		}
+
+		template<class T>
+		void WriteArray(const T* p, u32 count) {
+			Write(count);
+			data.resize((data.size() + 7) & ~size_t(7), 0);
+			Write(p, count * sizeof(T));
+		}
+	};
+
+	struct Reader {
+		const u8* begin;
+		const u8* at;
+		const u8* end;
+		bool ok;
+
+		template<class T>
+		T Read() {
+			T v {};
+			if(size_t(end - at) < sizeof(T)) {
+				ok = false;
+				return v;
+			}
+
+			memcpy(&v, at, sizeof(T));
+			at += sizeof(T);
+			return v;
+		}
+
+		const char* ReadString() {
+			u32 length = Read<u32>();
+			if(!ok || length == 0 || size_t(end - at) < length || at[length-1]) {
+				ok = false;
+				return "";
+			}
+
+			auto s = (const char*) at;
+			at += length;
+			return s;
+		}
+
+		template<class T>
+		const T* ReadArray(u32* count) {
+			*count = Read<u32>();
+			at = begin + ((at - begin + 7) & ~size_t(7));
+			if(!ok || at > end || size_t(end - at) / sizeof(T) < *count) {
+				ok = false;
+				*count = 0;
+				return nullptr;
+			}
+
+			auto p = (const T*) at;
+			at += *count * sizeof(T);
+			return p;
+		}
+
+		// Checked against what's left, so that a bad count can't allocate much
+		u32 ReadCount(size_t minSize) {
+			u32 count = Read<u32>();
+			if(!ok || size_t(end - at) / minSize < count) {
+				ok = false;
+				return 0;
+			}
+
+			return count;
+		}
+	};
+
+	struct Mapping {
+		void* data = nullptr;
+		size_t size = 0;
+
+		bool Map(const char* path) {
+#ifdef _WIN32
+			auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if(file == INVALID_HANDLE_VALUE) return false;
+
+			LARGE_INTEGER fileSize;
+			GetFileSizeEx(file, &fileSize);
+			auto map = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			CloseHandle(file);
+			if(!map) return false;
+
+			data = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+			size = fileSize.QuadPart;
+			CloseHandle(map);
+			return data != nullptr;
+#else
+			int fd = open(path, O_RDONLY);
+			if(fd < 0) return false;
+
+			struct stat st;
+			if(fstat(fd, &st) < 0 || st.st_size == 0) {
+				close(fd);
+				return false;
+			}
+
+			void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if(mapping == MAP_FAILED) return false;
+
+			data = mapping;
+			size = st.st_size;
+			return true;
+#endif
+		}
+
+		~Mapping() {
+			if(!data) return;
+
+#ifdef _WIN32
+			UnmapViewOfFile(data);
+#else
+			munmap(data, size);
+#endif
+		}
+	};
+
+	// bus: the bus s is the graph of, nullptr for other graphs
+	void WriteGraph(Writer& w, AudioContext* ctx, Synth* s, GraphKind kind, const char* bus) {
+		std::lock_guard<std::mutex> l(s->mutex);
+
+		w.Write(u32(kind));
+		if(kind == GraphBus)
+			w.WriteString(bus);
+
+		w.Write(u32(s->flags & Synth::FlagPlaying));
+		w.Write(s->outputNode);
+		w.Write(s->rateDivider);
+		w.Write(s->noiseSeed);
+		w.Write(s->targetGain);
+		w.Write(s->targetPan);
+
+		auto sendBus = GetBusName(ctx, s->bus);
+		w.WriteString(sendBus? sendBus : "");
+		w.Write(s->send);
+
+		// As CreateNode leaves them, so graphs load untouched by whatever has played
+		std::vector<SynthNode> nodes(s->nodes.size());
+		for(u32 i = 0; i < nodes.size(); i++) {
+			auto& from = s->nodes[i];
+			nodes[i].type = from.type;
+			nodes[i].inputTypes = from.inputTypes;
+			memcpy(nodes[i].inputs, from.inputs, sizeof(from.inputs));
+
+			if(from.type == NodeType::EnvelopeFade || from.type == NodeType::EnvelopeADSR)
+				nodes[i].phase = std::nan("");
+		}
+
+		w.WriteArray(nodes.data(), nodes.size());
+
+		w.Write(u32(s->controls.size()));
+		for(auto& c: s->controls) {
+			w.WriteString(c.name);
+			w.Write(c.initial);
+		}
+
+		w.Write(u32(s->triggers.size()));
+		for(auto& t: s->triggers)
+			w.WriteString(t.name);
+
+		w.Write(u32(s->noises.size()));
+		for(auto n: s->noises) {
+			w.Write(u32(n->color));
+			w.Write(n->seed);
+		}
+
+		w.Write(u32(s->filters.size()));
+		for(auto f: s->filters) {
+			w.Write(u32(f->type));
+			w.Write(u32(f->mode));
+			w.Write(f->stages);
+		}
+
+		w.Write(u32(s->samplers.size()));
+		for(auto v: s->samplers)
+			w.WriteString(v->sample->name.c_str());
+
+		w.Write(u32(s->convolvers.size()));
+		for(auto c: s->convolvers) {
+			w.WriteString(c->ir->name.c_str());
+			w.Write(u32(c->farPartition < c->ir->partitionCount));
+		}
+
+		w.Write(u32(s->origins.size()));
+		for(auto& o: s->origins) {
+			w.WriteString(o.source? o.source : "");
+			w.Write(o.line);
+		}
+	}
+
+	// A graph as read from the file, strings and nodes pointing into the mapping
+	struct GraphRecord {
+		struct Control { const char* name; f32 initial; };
+		struct Noise { u32 color, seed; };
+		struct FilterSetup { u32 type, mode, stages; };
+		struct ConvolverSetup { const char* impulse; bool async; };
+
+		GraphKind kind;
+		const char* bus;
+		u32 flags;
+		u32 outputNode;
+		u32 rateDivider;
+		u32 noiseSeed;
+		f32 gain;
+		f32 pan;
+		const char* sendBus;
+		f32 send;
+
+		const SynthNode* nodes;
+		u32 nodeCount;
+		std::vector<Control> controls;
+		std::vector<const char*> triggers;
+		std::vector<Noise> noises;
+		std::vector<FilterSetup> filters;
+		std::vector<const char*> samplers;
+		std::vector<ConvolverSetup> convolvers;
+		std::vector<NodeOrigin> origins;
+	};
+
+	bool ReadGraph(Reader& r, GraphRecord& g) {
+		g.kind = GraphKind(r.Read<u32>());
+		g.bus = g.kind == GraphBus? r.ReadString() : nullptr;
+		g.flags = r.Read<u32>();
+		g.outputNode = r.Read<u32>();
+		g.rateDivider = r.Read<u32>();
+		g.noiseSeed = r.Read<u32>();
+		g.gain = r.Read<f32>();
+		g.pan = r.Read<f32>();
+		g.sendBus = r.ReadString();
+		g.send = r.Read<f32>();
+
+		g.nodes = r.ReadArray<SynthNode>(&g.nodeCount);
+		for(u32 i = 0; i < g.nodeCount && r.ok; i++)
+			r.ok = u32(g.nodes[i].type) < NodeTypeCount;
+
+		g.controls.resize(r.ReadCount(8));
+		for(auto& c: g.controls)
+			c = {r.ReadString(), r.Read<f32>()};
+
+		g.triggers.resize(r.ReadCount(4));
+		for(auto& t: g.triggers)
+			t = r.ReadString();
+
+		g.noises.resize(r.ReadCount(8));
+		for(auto& n: g.noises)
+			n = {r.Read<u32>(), r.Read<u32>()};
+
+		g.filters.resize(r.ReadCount(12));
+		for(auto& f: g.filters)
+			f = {r.Read<u32>(), r.Read<u32>(), r.Read<u32>()};
+
+		g.samplers.resize(r.ReadCount(4));
+		for(auto& s: g.samplers)
+			s = r.ReadString();
+
+		g.convolvers.resize(r.ReadCount(8));
+		for(auto& c: g.convolvers)
+			c = {r.ReadString(), r.Read<u32>() != 0};
+
+		g.origins.resize(r.ReadCount(8));
+		for(auto& o: g.origins) {
+			o.source = r.ReadString();
+			o.line = r.Read<u32>();
+		}
+
+		return r.ok && g.kind <= GraphSynth;
+	}
+
+	// Resources are rebuilt in the order the nodes refer to them. Samples and impulse
+	//	responses that failed to load leave their nodes silent, like when creating them
+	void BuildGraph(AudioContext* ctx, Synth* s, const GraphRecord& g) {
+		SetSynthRateDivider(s, g.rateDivider);
+		SetSynthSend(s, *g.sendBus? g.sendBus : nullptr, g.send);
+		SetSynthGain(s, g.gain);
+		SetSynthPan(s, g.pan);
+
+		auto config = GetAudioConfig(ctx);
+		std::lock_guard<std::mutex> l(s->mutex);
+		s->noiseSeed = g.noiseSeed;
+
+		for(auto& c: g.controls) {
+			auto name = s->arena.String(c.name);
+			s->controls.push_back({name, c.initial, c.initial, c.initial, 0.f, c.initial});
+		}
+
+		for(auto name: g.triggers)
+			s->triggers.push_back({s->arena.String(name), 0});
+
+		for(auto& n: g.noises) {
+			auto noise = s->arena.New<NoiseGenerator>();
+			noise->Init(NoiseColor(n.color), 0);
+			noise->seed = n.seed;
+			s->noises.push_back(noise);
+		}
+
+		for(auto& f: g.filters) {
+			auto filter = s->arena.New<Filter>();
+			filter->Init(Filter::Type(f.type), FilterMode(f.mode), std::min<u32>(f.stages, Filter::MaxStages));
+			s->filters.push_back(filter);
+		}
+
+		std::vector<u32> samplers;
+		for(auto name: g.samplers) {
+			auto file = OpenSample(name);
+			auto voice = s->arena.New<SamplerVoice>();
+			if(!file || !voice->Init(std::move(file))) {
+				voice->Deinit();
+				samplers.push_back(~0u);
+				continue;
+			}
+
+			s->samplers.push_back(voice);
+			samplers.push_back(s->samplers.size()-1u);
+		}
+
+		std::vector<u32> convolvers;
+		for(auto& c: g.convolvers) {
+			auto ir = GetImpulseResponse(c.impulse);
+			if(!ir) {
+				printf("Impulse response '%s' doesn't exist\n", c.impulse);
+				convolvers.push_back(~0u);
+				continue;
+			}
+
+			auto convolver = s->arena.New<Convolver>();
+			convolver->Init(std::move(ir), c.async? config.deviceFrames + config.blockFrames : 0);
+			s->convolvers.push_back(convolver);
+			convolvers.push_back(s->convolvers.size()-1u);
+		}
+
+		auto remap = [](const std::vector<u32>& ids, u32 id) {
+			return id < ids.size()? ids[id] : ~0u;
+		};
+
+		s->nodes.assign(g.nodes, g.nodes + g.nodeCount);
+		for(auto& node: s->nodes) {
+			if(node.type == NodeType::SourceSampler)
+				node.inputs[4].node = remap(samplers, node.inputs[4].node);
+			else if(node.type == NodeType::EffectsConvolution)
+				node.inputs[1].node = remap(convolvers, node.inputs[1].node);
+		}
+
+		for(u32 i = 0; i < g.origins.size(); i++)
+			if(*g.origins[i].source)
+				SetNodeOrigin(s, i, g.origins[i].source, g.origins[i].line);
+
+		s->outputNode = g.outputNode;
+		s->flags |= g.flags & Synth::FlagPlaying;
+	}
+}
+
+bool WriteGraphCache(AudioContext* ctx, const char* path, u64 key) {
+	Writer w;
+	Header header {};
+	memcpy(header.magic, magic, sizeof(magic));
+	header.version = GraphCacheVersion;
+	header.nodeSize = sizeof(SynthNode);
+	header.nodeTypes = NodeTypeCount;
+	header.key = key;
+	w.Write(header);
+
+	// The shared synth, buses and synths, and the samples and responses they use
+	struct Graph {
+		Synth* synth;
+		GraphKind kind;
+		const char* bus;
+	};
+
+	std::vector<Graph> graphs {{GetSharedSynth(ctx), GraphShared, nullptr}};
+	for(u32 i = 0; auto bus = GetBusName(ctx, i); i++)
+		graphs.push_back({GetBus(ctx, bus), GraphBus, bus});
+
+	for(u32 handle: GetSynthHandles(ctx)) {
+		auto s = GetSynth(ctx, handle);
+		if(s && !(s->flags & Synth::FlagDeletionRequested))
+			graphs.push_back({s, GraphSynth, nullptr});
+	}
+
+	std::vector<std::shared_ptr<const SampleFile>> samples;
+	std::vector<std::shared_ptr<const ImpulseResponse>> impulses;
+	for(auto& g: graphs) {
+		std::lock_guard<std::mutex> l(g.synth->mutex);
+		for(auto v: g.synth->samplers)
+			if(std::find(samples.begin(), samples.end(), v->sample) == samples.end())
+				samples.push_back(v->sample);
+
+		for(auto c: g.synth->convolvers)
+			if(std::find(impulses.begin(), impulses.end(), c->ir) == impulses.end())
+				impulses.push_back(c->ir);
+	}
+
+	for(auto& s: samples) {
+		w.WriteString(s->name.c_str());
+		w.WriteString(s->path.c_str());
+		w.Write(s->preloadTime);
+	}
+
+	for(auto& ir: impulses) {
+		w.WriteString(ir->name.c_str());
+		w.Write(ir->partitionSize);
+		w.Write(ir->partitionCount);
+		w.WriteArray(ir->head.data(), ir->head.size());
+		w.WriteArray(ir->spectraRe.data(), ir->spectraRe.size());
+		w.WriteArray(ir->spectraIm.data(), ir->spectraIm.size());
+	}
+
+	auto sharedNodes = GetSharedNodes(ctx);
+	w.Write(u32(sharedNodes.size()));
+	for(u32 node: sharedNodes)
+		w.Write(node);
+
+	for(auto& g: graphs)
+		WriteGraph(w, ctx, g.synth, g.kind, g.bus);
+
+	header.graphs = graphs.size();
+	header.samples = samples.size();
+	header.impulses = impulses.size();
+	header.size = w.data.size();
+	header.checksum = HashBytes(w.data.data() + sizeof(Header), w.data.size() - sizeof(Header));
+	memcpy(w.data.data(), &header, sizeof(Header));
+
+	// Written to the side and renamed over, so a reader never maps half a file
+	std::string temporary = std::string(path) + ".tmp";
+	auto file = fopen(temporary.c_str(), "wb");
+	if(!file) {
+		printf("Failed to open '%s' for writing\n", temporary.c_str());
+		return false;
+	}
+
+	bool written = fwrite(w.data.data(), 1, w.data.size(), file) == w.data.size();
+	written = !fclose(file) && written;
+
+#ifdef _WIN32
+	remove(path);
+#endif
+	if(!written || rename(temporary.c_str(), path)) {
+		printf("Failed to write graph cache '%s'\n", path);
+		remove(temporary.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool ReadGraphCache(AudioContext* ctx, const char* path, u64 key) {
+	// Graphs are restored by index, which only works if nothing took the indices yet
+	if(!GetSynthHandles(ctx).empty() || !GetSharedSynth(ctx)->nodes.empty() || GetBusName(ctx, 0))
+		return false;
+
+	Mapping mapping;
+	if(!mapping.Map(path) || mapping.size < sizeof(Header))
+		return false;
+
+	Header header;
+	memcpy(&header, mapping.data, sizeof(Header));
+
+	auto data = (const u8*) mapping.data;
+	if(memcmp(header.magic, magic, sizeof(magic)) || header.version != GraphCacheVersion
+		|| header.nodeSize != sizeof(SynthNode) || header.nodeTypes != NodeTypeCount
+		|| header.key != key) {
+		printf("Graph cache '%s' is stale or from another build, ignoring it\n", path);
+		return false;
+	}
+
+	if(header.size != mapping.size || header.checksum != HashBytes(data + sizeof(Header), mapping.size - sizeof(Header))) {
+		printf("Graph cache '%s' is corrupt, ignoring it\n", path);
+		return false;
+	}
+
+	// Everything is read before anything is built, so a bad file builds nothing
+	Reader r {data, data + sizeof(Header), data + mapping.size, true};
+
+	struct Sample { const char* name; const char* path; f32 preloadTime; };
+	std::vector<Sample> samples;
+	for(u32 i = 0; i < header.samples && r.ok; i++)
+		samples.push_back({r.ReadString(), r.ReadString(), r.Read<f32>()});
+
+	struct Impulse {
+		const char* name;
+		u32 partitionSize, partitionCount;
+		const f32* head;
+		const f32* spectraRe;
+		const f32* spectraIm;
+	};
+
+	std::vector<Impulse> impulses;
+	for(u32 i = 0; i < header.impulses && r.ok; i++) {
+		Impulse ir;
+		u32 headSize, spectraRe, spectraIm;
+		ir.name = r.ReadString();
+		ir.partitionSize = r.Read<u32>();
+		ir.partitionCount = r.Read<u32>();
+		ir.head = r.ReadArray<f32>(&headSize);
+		ir.spectraRe = r.ReadArray<f32>(&spectraRe);
+		ir.spectraIm = r.ReadArray<f32>(&spectraIm);
+
+		u64 spectra = u64(ir.partitionCount - 1) * (ir.partitionSize + 1);
+		r.ok = r.ok && ir.partitionCount > 0 && headSize == ir.partitionSize
+			&& spectraRe == spectra && spectraIm == spectra;
+		impulses.push_back(ir);
+	}
+
+	std::vector<u32> sharedNodes(r.ReadCount(sizeof(u32)));
+	for(auto& node: sharedNodes)
+		node = r.Read<u32>();
+
+	std::vector<GraphRecord> graphs(r.ok? header.graphs : 0);
+	for(auto& g: graphs)
+		if(!ReadGraph(r, g)) break;
+
+	if(!r.ok || r.at != r.end || graphs.empty() || graphs[0].kind != GraphShared) {
+		printf("Graph cache '%s' is corrupt, ignoring it\n", path);
+		return false;
+	}
+
+	for(auto& s: samples)
+		RegisterSample(s.name, s.path, s.preloadTime);
+
+	for(auto& ir: impulses)
+		LoadImpulseResponse(ir.name, ir.partitionSize, ir.partitionCount, ir.head, ir.spectraRe, ir.spectraIm);
+
+	// Buses first, so that sends find them
+	for(auto& g: graphs)
+		if(g.kind == GraphBus)
+			GetBus(ctx, g.bus);
+
+	for(auto& g: graphs) {
+		Synth* s = nullptr;
+		switch(g.kind) {
+			case GraphShared: s = GetSharedSynth(ctx); break;
+			case GraphBus: s = GetBus(ctx, g.bus); break;
+			case GraphSynth: s = CreateSynth(ctx); break;
+		}
+
+		if(s) BuildGraph(ctx, s, g);
+	}
+
+	for(u32 node: sharedNodes)
+		ExportSharedNode(ctx, node);
+
+	return true;
+}
+
+u64 HashFile(const char* path) {
+	auto file = fopen(path, "rb");
+	if(!file) return 0;
+
+	u64 hash = HashBytes(nullptr, 0);
+	u8 buffer[1<<16];
+	size_t read;
+	while((read = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		hash = HashBytes(buffer, read, hash);
+
+	bool failed = ferror(file);
+	fclose(file);
+	return failed? 0 : hash;
+}
+
+}
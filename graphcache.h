@@ -0,0 +1,33 @@
+#ifndef GRAPHCACHE_H
+#define GRAPHCACHE_H
+
+#include "common.h"
+
+namespace synth {
+
+struct AudioContext;
+
+// Compiled graph cache, so that a script that has been run before can start without
+//	lua building its graphs again. A cache file holds everything a context was built
+//	with: the shared synth and its exported nodes, buses, and every synth's node
+//	table (constants included), controls, triggers, sends, noise, filter, sampler and
+//	convolution setups and node origins, along with the samples and impulse
+//	responses used, the latter with their spectra so nothing is transformed again.
+//	Node tables are stored as they are in memory, and loading copies them straight
+//	out of a memory mapping of the file. Graphs load as created, i.e., envelopes
+//	untriggered and controls at their initial values.
+//
+//	Files are only valid for the build that wrote them, and for the key they were
+//	written with, e.g., a hash of the script. Context settings such as the limiter
+//	look-ahead aren't graphs and aren't cached.
+bool WriteGraphCache(AudioContext*, const char* path, u64 key);
+
+// Only into a context nothing has been built in yet. false, with nothing built, if
+//	path doesn't hold graphs for key from this build
+bool ReadGraphCache(AudioContext*, const char* path, u64 key);
+
+u64 HashFile(const char* path); // Of the contents, 0 if it can't be read
+
+}
+
+#endif
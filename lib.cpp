@@ -1,5 +1,7 @@
 #include "synth.h"
 #include "common.h"
+#include "sampler.h"
+#include "trace.h"
 
 #define LUAFUNC(x) static int x(LuaState l)
 #define LUALAMBDA [](LuaState l) -> s32
@@ -10,8 +12,7 @@ using LibraryType = const luaL_Reg[];
 namespace synth {
 
 namespace {
-	LuaState l;
-	void stackdump();
+	void stackdump(LuaState l);
 }
 
 struct LuaSynthNode {
@@ -27,78 +28,276 @@ struct LuaSynthNode {
 	}
 };
 
+// Userdata only hold synth handles, so scripts holding on to nodes or triggers of
+//	synths destroyed by a reload get an error rather than a dangling pointer
+struct LuaNodeRef {
+	u32 synth;
+	u32 node;
+};
+
 struct LuaTrigger {
-	Synth* synth;
+	u32 synth;
 	u32 trigger;
 };
 
-s32 PushLuaSynthNode(Synth* s, u32 node) {
-	*(LuaSynthNode*) lua_newuserdata(l, sizeof(LuaSynthNode)) = {s, true, node};
+Synth* ResolveSynthLua(LuaState l, u32 a, u32 handle) {
+	auto s = GetSynth(GetAudioContextLua(l), handle);
+	if(!s) luaL_argerror(l, a, "synth has been destroyed");
+	return s;
+}
+
+s32 PushLuaSynth(LuaState l, Synth* s) {
+	if(!s) return luaL_error(l, "failed to create synth");
+
+	*(u32*) lua_newuserdata(l, sizeof(u32)) = s->id;
+	luaL_setmetatable(l, "synthmt");
+	return 1;
+}
+
+// Attributes the node to the innermost lua line on the stack, for profiles
+void RecordNodeOrigin(LuaState l, Synth* s, u32 node) {
+	lua_Debug ar;
+	for(s32 level = 1; lua_getstack(l, level, &ar); level++) {
+		if(!lua_getinfo(l, "Sl", &ar) || ar.currentline <= 0) continue;
+
+		SetNodeOrigin(s, node, ar.short_src, ar.currentline);
+		return;
+	}
+}
+
+s32 PushLuaSynthNode(LuaState l, Synth* s, u32 node) {
+	RecordNodeOrigin(l, s, node);
+
+	*(LuaNodeRef*) lua_newuserdata(l, sizeof(LuaNodeRef)) = {s->id, node};
 	luaL_setmetatable(l, "nodemt");
 	return 1;
 }
 
-s32 PushLuaSynthTrigger(Synth* s, u32 trigger) {
-	*(LuaTrigger*) lua_newuserdata(l, sizeof(LuaTrigger)) = {s, trigger};
+s32 PushLuaSynthTrigger(LuaState l, Synth* s, u32 trigger) {
+	*(LuaTrigger*) lua_newuserdata(l, sizeof(LuaTrigger)) = {s->id, trigger};
 	luaL_setmetatable(l, "triggermt");
 	return 1;
 }
 
-Synth* GetSynthArg(u32 a) {
-	return *(Synth**)luaL_checkudata(l, a, "synthmt");
+Synth* GetSynthArg(LuaState l, u32 a) {
+	return ResolveSynthLua(l, a, *(u32*)luaL_checkudata(l, a, "synthmt"));
 }
 
-LuaTrigger* GetSynthTriggerArg(u32 a) {
+LuaTrigger* GetSynthTriggerArg(LuaState l, u32 a) {
 	return (LuaTrigger*)luaL_testudata(l, a, "triggermt");
 }
 
-u32 GetSynthTriggerID(u32 a) {
+u32 GetSynthTriggerID(LuaState l, u32 a) {
 	if(auto trg = (LuaTrigger*)luaL_testudata(l, a, "triggermt"))
 		return trg->trigger;
 
 	return ~0u;
 }
 
-LuaSynthNode GetSynthNodeArg(u32 a, f32 def = 0.f) {
+LuaSynthNode GetSynthNodeArg(LuaState l, u32 a, f32 def = 0.f) {
 	LuaSynthNode n {nullptr, false, 0};
 	if(lua_isnumber(l, a)) {
 		n.value = lua_tonumber(l, a);
 		return n;
-	}else if(auto node = (LuaSynthNode*)luaL_testudata(l, a, "nodemt")) {
-		return *node;
+	}else if(auto ref = (LuaNodeRef*)luaL_testudata(l, a, "nodemt")) {
+		n.synth = ResolveSynthLua(l, a, ref->synth);
+		n.isNode = true;
+		n.node = ref->node;
+		return n;
 	}
 
 	n.value = def;
 	return n;
 }
 
+// The control behind a value node, ~0u for numbers and any other node
+u32 GetSynthControlID(const LuaSynthNode& n) {
+	if(!n.isNode) return ~0u;
+
+	auto& node = n.synth->nodes[n.node];
+	return node.type == NodeType::InteractionValue? node.inputs[0].node : ~0u;
+}
+
+FilterMode GetFilterModeArg(LuaState l, u32 a) {
+	static const char* modes[] {"lowpass", "highpass", "bandpass", "notch", nullptr};
+	return FilterMode(luaL_checkoption(l, a, "lowpass", modes));
+}
+
+AudioContext* GetAudioContextLua(lua_State* l) {
+	lua_getfield(l, LUA_REGISTRYINDEX, "synthcontext");
+	auto ctx = (AudioContext*) lua_touserdata(l, -1);
+	lua_pop(l, 1);
+	return ctx;
+}
+
 Synth* GetSynthLua(lua_State* l, u32 a) {
-	auto s = (Synth**)luaL_testudata(l, a, "synthmt");
-	if(s) return *s;
+	auto s = (u32*)luaL_testudata(l, a, "synthmt");
+	if(s) return GetSynth(GetAudioContextLua(l), *s);
 	return nullptr;
 }
 
-bool InitLuaLib(LuaState _l) {
-	l = _l;
-	if(!l) {
+bool InitLuaLib(LuaState l, AudioContext* ctx) {
+	if(!l || !ctx) {
 		puts("Lua context acquisition failed");
 		return false;
 	}
 
+	lua_pushlightuserdata(l, ctx);
+	lua_setfield(l, LUA_REGISTRYINDEX, "synthcontext");
+
 	static LibraryType synthLib = {
 		{"new", LUALAMBDA {
-			auto synth = CreateSynth();
-			*(Synth**) lua_newuserdata(l, sizeof(Synth*)) = synth;
-			luaL_setmetatable(l, "synthmt");
+			return PushLuaSynth(l, CreateSynth(GetAudioContextLua(l)));
+		}},
+		{"bus", LUALAMBDA {
+			auto name = luaL_checkstring(l, 1);
+			return PushLuaSynth(l, GetBus(GetAudioContextLua(l), name));
+		}},
+		{"impulse", LUALAMBDA {
+			auto name = luaL_checkstring(l, 1);
+			u32 partitionSize = luaL_optinteger(l, 3, 64);
+			std::vector<f32> samples;
+
+			// Either a path or a table of samples
+			if(lua_type(l, 2) == LUA_TSTRING) {
+				if(!ReadSampleFile(lua_tostring(l, 2), samples))
+					return luaL_error(l, "failed to read impulse response '%s'", lua_tostring(l, 2));
+
+			}else{
+				luaL_checktype(l, 2, LUA_TTABLE);
+				samples.resize(lua_rawlen(l, 2));
+				for(u32 i = 0; i < samples.size(); i++) {
+					lua_rawgeti(l, 2, i+1);
+					samples[i] = lua_tonumber(l, -1);
+					lua_pop(l, 1);
+				}
+			}
+
+			CreateImpulseResponse(name, samples.data(), samples.size(), partitionSize);
+			return 0;
+		}},
+		{"sample", LUALAMBDA {
+			auto name = luaL_checkstring(l, 1);
+			auto path = luaL_checkstring(l, 2);
+			f32 preload = luaL_optnumber(l, 3, 250.f) / 1000.f;
+			RegisterSample(name, path, preload);
+			return 0;
+		}},
+		{"lookahead", LUALAMBDA {
+			SetLimiterLookahead(GetAudioContextLua(l), luaL_checknumber(l, 1));
+			return 0;
+		}},
+		{"config", LUALAMBDA {
+			auto config = GetAudioConfig(GetAudioContextLua(l));
+			lua_createtable(l, 0, 4);
+			lua_pushinteger(l, config.sampleRate);
+			lua_setfield(l, -2, "samplerate");
+			lua_pushinteger(l, config.deviceFrames);
+			lua_setfield(l, -2, "deviceframes");
+			lua_pushinteger(l, config.blockFrames);
+			lua_setfield(l, -2, "blockframes");
+			lua_pushinteger(l, config.channels);
+			lua_setfield(l, -2, "channels");
 			return 1;
 		}},
+		{"denormals", LUALAMBDA {
+			SetDenormalCheck(GetAudioContextLua(l), lua_isnone(l, 1) || lua_toboolean(l, 1));
+			return 0;
+		}},
+		{"denormalreport", LUALAMBDA {
+			PrintDenormalReport(GetAudioContextLua(l));
+			return 0;
+		}},
+		{"shared", LUALAMBDA {
+			return PushLuaSynth(l, GetSharedSynth(GetAudioContextLua(l)));
+		}},
+		{"time", LUALAMBDA {
+			lua_pushnumber(l, GetAudioTime(GetAudioContextLua(l)));
+			return 1;
+		}},
+		{"metrics", LUALAMBDA {
+			auto m = GetAudioMetrics(GetAudioContextLua(l));
+
+			lua_createtable(l, 0, 13);
+			lua_pushinteger(l, m.callbacks);
+			lua_setfield(l, -2, "callbacks");
+			lua_pushinteger(l, m.xruns);
+			lua_setfield(l, -2, "xruns");
+			lua_pushnumber(l, m.lastCallbackSeconds);
+			lua_setfield(l, -2, "callbacktime");
+			lua_pushnumber(l, m.lastPeriodSeconds);
+			lua_setfield(l, -2, "period");
+			lua_pushnumber(l, m.lastLoad);
+			lua_setfield(l, -2, "load");
+			lua_pushnumber(l, m.averageLoad);
+			lua_setfield(l, -2, "averageload");
+			lua_pushnumber(l, m.peakLoad);
+			lua_setfield(l, -2, "peakload");
+			lua_pushinteger(l, m.activeSynths);
+			lua_setfield(l, -2, "active");
+			lua_pushinteger(l, m.idleSynths);
+			lua_setfield(l, -2, "idle");
+			lua_pushinteger(l, m.fadingSynths);
+			lua_setfield(l, -2, "fading");
+			lua_pushinteger(l, m.retiredSynths);
+			lua_setfield(l, -2, "retired");
+
+			// histogram[i] counts callbacks of [2^(i-1), 2^i) microseconds
+			lua_createtable(l, MetricsHistogramBuckets, 0);
+			for(u32 i = 0; i < MetricsHistogramBuckets; i++) {
+				lua_pushinteger(l, m.durationHistogram[i]);
+				lua_rawseti(l, -2, i+1);
+			}
+			lua_setfield(l, -2, "histogram");
+			return 1;
+		}},
+		{"tracing", LUALAMBDA {
+			SetTracing(lua_isnone(l, 1) || lua_toboolean(l, 1));
+			return 0;
+		}},
+		{"writetrace", LUALAMBDA {
+			lua_pushboolean(l, WriteTrace(luaL_checkstring(l, 1)));
+			return 1;
+		}},
+		// Distributions of how long triggers and control changes take to be picked
+		//	up by the audio thread and to be heard, in seconds
+		{"latency", LUALAMBDA {
+			auto latency = GetTriggerLatency(GetAudioContextLua(l));
+
+			auto push = [l](const LatencyHistogram& h) {
+				lua_createtable(l, 0, 6);
+				lua_pushinteger(l, h.count);
+				lua_setfield(l, -2, "count");
+				lua_pushnumber(l, h.count? h.totalSeconds / h.count : 0.0);
+				lua_setfield(l, -2, "mean");
+				lua_pushnumber(l, GetLatencyPercentile(h, 0.5));
+				lua_setfield(l, -2, "p50");
+				lua_pushnumber(l, GetLatencyPercentile(h, 0.9));
+				lua_setfield(l, -2, "p90");
+				lua_pushnumber(l, GetLatencyPercentile(h, 0.99));
+				lua_setfield(l, -2, "p99");
+				lua_pushnumber(l, h.maxSeconds);
+				lua_setfield(l, -2, "max");
+			};
+
+			lua_createtable(l, 0, 2);
+			push(latency.pickup);
+			lua_setfield(l, -2, "pickup");
+			push(latency.output);
+			lua_setfield(l, -2, "output");
+			return 1;
+		}},
+		{"profiling", LUALAMBDA {
+			SetNodeProfiling(GetAudioContextLua(l), lua_isnone(l, 1) || lua_toboolean(l, 1));
+			return 0;
+		}},
 		{nullptr, nullptr}
 	};
 
 	static LibraryType synthOPS = {
 		{"output", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			auto f = GetSynthNodeArg(2);
+			auto s = GetSynthArg(l, 1);
+			auto f = GetSynthNodeArg(l, 2);
 			if(f.isNode) {
 				s->outputNode = f.node;
 				s->flags |= Synth::FlagPlaying;
@@ -106,157 +305,302 @@ bool InitLuaLib(LuaState _l) {
 			return 0;
 		}},
 
+		{"ratedivider", LUALAMBDA {
+			auto s = GetSynthArg(l, 1);
+			SetSynthRateDivider(s, luaL_checkinteger(l, 2));
+			return 0;
+		}},
+		{"seed", LUALAMBDA {
+			auto s = GetSynthArg(l, 1);
+			s->noiseSeed = luaL_checkinteger(l, 2);
+			return 0;
+		}},
+		{"send", LUALAMBDA {
+			auto s = GetSynthArg(l, 1);
+			auto bus = luaL_optstring(l, 2, nullptr);
+			f32 level = luaL_optnumber(l, 3, 1.f);
+			SetSynthSend(s, bus, level);
+			return 0;
+		}},
+
+		// Costs since the last call, in ns per output frame. Nodes are listed most
+		//	expensive first, and summed by type and by the line that created them
+		{"profile", LUALAMBDA {
+			auto profile = GetSynthProfile(GetSynthArg(l, 1));
+
+			lua_createtable(l, 0, 7);
+			lua_pushinteger(l, profile.frames);
+			lua_setfield(l, -2, "frames");
+			lua_pushnumber(l, profile.seconds);
+			lua_setfield(l, -2, "seconds");
+			lua_pushnumber(l, profile.nsPerFrame);
+			lua_setfield(l, -2, "ns");
+			lua_pushnumber(l, profile.load);
+			lua_setfield(l, -2, "load");
+
+			lua_createtable(l, profile.nodes.size(), 0);
+			for(u32 i = 0; i < profile.nodes.size(); i++) {
+				auto& n = profile.nodes[i];
+				lua_createtable(l, 0, 5);
+				lua_pushinteger(l, n.node);
+				lua_setfield(l, -2, "node");
+				lua_pushstring(l, GetNodeTypeName(n.type));
+				lua_setfield(l, -2, "type");
+				lua_pushnumber(l, n.nsPerFrame);
+				lua_setfield(l, -2, "ns");
+
+				if(n.origin.source) {
+					lua_pushstring(l, n.origin.source);
+					lua_setfield(l, -2, "source");
+					lua_pushinteger(l, n.origin.line);
+					lua_setfield(l, -2, "line");
+				}
+
+				lua_rawseti(l, -2, i+1);
+			}
+			lua_setfield(l, -2, "nodes");
+
+			lua_newtable(l);
+			for(u32 t = 0; t < NodeTypeCount; t++) {
+				if(profile.typeNsPerFrame[t] <= 0.0) continue;
+				lua_pushnumber(l, profile.typeNsPerFrame[t]);
+				lua_setfield(l, -2, GetNodeTypeName(NodeType(t)));
+			}
+			lua_setfield(l, -2, "types");
+
+			// Keyed "source:line"
+			lua_newtable(l);
+			for(auto& n: profile.nodes) {
+				if(!n.origin.source) continue;
+
+				lua_pushfstring(l, "%s:%d", n.origin.source, s32(n.origin.line));
+				lua_pushvalue(l, -1);
+				lua_rawget(l, -3);
+				f64 ns = lua_tonumber(l, -1) + n.nsPerFrame;
+				lua_pop(l, 1);
+				lua_pushnumber(l, ns);
+				lua_rawset(l, -3);
+			}
+			lua_setfield(l, -2, "lines");
+
+			return 1;
+		}},
+
 		{"setvalue", LUALAMBDA {
-			auto s = GetSynthArg(1);
+			auto s = GetSynthArg(l, 1);
 			auto name = luaL_checkstring(l, 2);
 			f32 v = luaL_checknumber(l, 3);
 			SetSynthControl(s, name, v);
 			return 0;
 		}},
 		// {"triptrigger", LUALAMBDA {
-		// 	auto s = GetSynthArg(1);
+		// 	auto s = GetSynthArg(l, 1);
 		// 	auto name = luaL_checkstring(l, 2);
 		// 	TripSynthTrigger(s, name);
 		// 	return 0;
 		// }},
 
 		{"sin", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			auto f = GetSynthNodeArg(2);
-			auto p = GetSynthNodeArg(3);
-			return PushLuaSynthNode(s, NewSinOscillator(s, f, p));
+			auto s = GetSynthArg(l, 1);
+			auto f = GetSynthNodeArg(l, 2);
+			auto p = GetSynthNodeArg(l, 3);
+			return PushLuaSynthNode(l, s, NewSinOscillator(s, f, p));
 		}},
 		{"tri", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			auto f = GetSynthNodeArg(2);
-			auto p = GetSynthNodeArg(3);
-			return PushLuaSynthNode(s, NewTriOscillator(s, f, p));
+			auto s = GetSynthArg(l, 1);
+			auto f = GetSynthNodeArg(l, 2);
+			auto p = GetSynthNodeArg(l, 3);
+			return PushLuaSynthNode(l, s, NewTriOscillator(s, f, p));
 		}},
 		{"sqr", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			auto f = GetSynthNodeArg(2);
-			auto d = GetSynthNodeArg(3, 1.f);
-			auto p = GetSynthNodeArg(4);
-			return PushLuaSynthNode(s, NewSqrOscillator(s, f, p, d));
+			auto s = GetSynthArg(l, 1);
+			auto f = GetSynthNodeArg(l, 2);
+			auto d = GetSynthNodeArg(l, 3, 1.f);
+			auto p = GetSynthNodeArg(l, 4);
+			return PushLuaSynthNode(l, s, NewSqrOscillator(s, f, p, d));
 		}},
 		{"saw", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			auto f = GetSynthNodeArg(2);
-			auto p = GetSynthNodeArg(3);
-			return PushLuaSynthNode(s, NewSawOscillator(s, f, p));
+			auto s = GetSynthArg(l, 1);
+			auto f = GetSynthNodeArg(l, 2);
+			auto p = GetSynthNodeArg(l, 3);
+			return PushLuaSynthNode(l, s, NewSawOscillator(s, f, p));
 		}},
 		{"noise", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			return PushLuaSynthNode(s, NewNoiseSource(s));
+			static const char* colors[] {"white", "pink", "brown", nullptr};
+			auto s = GetSynthArg(l, 1);
+			auto color = NoiseColor(luaL_checkoption(l, 2, "white", colors));
+			u32 seed = luaL_optinteger(l, 3, ~0u);
+			return PushLuaSynthNode(l, s, NewNoiseSource(s, color, seed));
 		}},
 		{"time", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			return PushLuaSynthNode(s, NewTimeSource(s));
+			auto s = GetSynthArg(l, 1);
+			return PushLuaSynthNode(l, s, NewTimeSource(s));
+		}},
+		{"sampler", LUALAMBDA {
+			auto s = GetSynthArg(l, 1);
+			auto name = luaL_checkstring(l, 2);
+			auto r = GetSynthNodeArg(l, 3, 1.f);
+			auto p = GetSynthNodeArg(l, 4);
+			auto lp = GetSynthNodeArg(l, 5);
+			u32 trg = GetSynthTriggerID(l, 6);
+			return PushLuaSynthNode(l, s, NewSamplerSource(s, name, r, p, lp, trg));
+		}},
+		{"shared", LUALAMBDA {
+			auto s = GetSynthArg(l, 1);
+			auto n = GetSynthNodeArg(l, 2);
+			if(!n.isNode || n.synth != GetSharedSynth(s->context))
+				return luaL_argerror(l, 2, "expected a node of synth.shared()");
+
+			return PushLuaSynthNode(l, s, NewSharedSource(s, n.node));
+		}},
+		{"input", LUALAMBDA {
+			auto s = GetSynthArg(l, 1);
+			if(!(s->flags & Synth::FlagBus))
+				return luaL_argerror(l, 1, "expected a synth.bus()");
+
+			return PushLuaSynthNode(l, s, NewBusInput(s));
 		}},
 
 		{"fade", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			auto f = GetSynthNodeArg(2);
-			u32 trg = GetSynthTriggerID(3);
-			return PushLuaSynthNode(s, NewFadeEnvelope(s, f, trg));
+			auto s = GetSynthArg(l, 1);
+			auto f = GetSynthNodeArg(l, 2);
+			u32 trg = GetSynthTriggerID(l, 3);
+			return PushLuaSynthNode(l, s, NewFadeEnvelope(s, f, trg));
 		}},
 		{"ar", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			auto a = GetSynthNodeArg(2);
-			auto r = GetSynthNodeArg(3);
-			u32 trg = GetSynthTriggerID(4);
-			return PushLuaSynthNode(s, NewADSREnvelope(s, a, 0.f, 0.f, 1.f, r, trg));
+			auto s = GetSynthArg(l, 1);
+			auto a = GetSynthNodeArg(l, 2);
+			auto r = GetSynthNodeArg(l, 3);
+			u32 trg = GetSynthTriggerID(l, 4);
+			return PushLuaSynthNode(l, s, NewADSREnvelope(s, a, 0.f, 0.f, 1.f, r, trg));
 		}},
 
 		{"lowpass", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			auto i = GetSynthNodeArg(2);
-			auto f = GetSynthNodeArg(3);
-			return PushLuaSynthNode(s, NewLowPassEffect(s, i, f));
+			auto s = GetSynthArg(l, 1);
+			auto i = GetSynthNodeArg(l, 2);
+			auto f = GetSynthNodeArg(l, 3);
+			return PushLuaSynthNode(l, s, NewLowPassEffect(s, i, f));
 		}},
 		{"highpass", LUALAMBDA {
-			auto s = GetSynthArg(1);
-			auto i = GetSynthNodeArg(2);
-			auto f = GetSynthNodeArg(3);
-			return PushLuaSynthNode(s, NewHighPassEffect(s, i, f));
+			auto s = GetSynthArg(l, 1);
+			auto i = GetSynthNodeArg(l, 2);
+			auto f = GetSynthNodeArg(l, 3);
+			return PushLuaSynthNode(l, s, NewHighPassEffect(s, i, f));
+		}},
+		{"biquad", LUALAMBDA {
+			auto s = GetSynthArg(l, 1);
+			auto i = GetSynthNodeArg(l, 2);
+			auto f = GetSynthNodeArg(l, 3);
+			auto q = GetSynthNodeArg(l, 4, 0.7071f);
+			auto mode = GetFilterModeArg(l, 5);
+			u32 stages = luaL_optinteger(l, 6, 1);
+			return PushLuaSynthNode(l, s, NewBiquadEffect(s, i, f, q, mode, stages));
+		}},
+		{"svf", LUALAMBDA {
+			auto s = GetSynthArg(l, 1);
+			auto i = GetSynthNodeArg(l, 2);
+			auto f = GetSynthNodeArg(l, 3);
+			auto q = GetSynthNodeArg(l, 4, 0.7071f);
+			auto mode = GetFilterModeArg(l, 5);
+			u32 stages = luaL_optinteger(l, 6, 1);
+			return PushLuaSynthNode(l, s, NewStateVariableEffect(s, i, f, q, mode, stages));
+		}},
+
+		{"convolve", LUALAMBDA {
+			auto s = GetSynthArg(l, 1);
+			auto i = GetSynthNodeArg(l, 2);
+			auto ir = luaL_checkstring(l, 3);
+			bool async = lua_toboolean(l, 4);
+			return PushLuaSynthNode(l, s, NewConvolutionEffect(s, i, ir, async));
 		}},
 
 		{"value", LUALAMBDA {
-			auto s = GetSynthArg(1);
+			auto s = GetSynthArg(l, 1);
 			auto name = luaL_checkstring(l, 2);
 			f32 def = luaL_optnumber(l, 3, 0.f);
-			return PushLuaSynthNode(s, NewSynthControl(s, name, def));
+			return PushLuaSynthNode(l, s, NewSynthControl(s, name, def));
 		}},
 		{"trigger", LUALAMBDA {
-			auto s = GetSynthArg(1);
+			auto s = GetSynthArg(l, 1);
 			auto name = luaL_checkstring(l, 2);
-			return PushLuaSynthTrigger(s, NewSynthTrigger(s, name));
+			return PushLuaSynthTrigger(l, s, NewSynthTrigger(s, name));
 		}},
 		{nullptr, nullptr}
 	};
 
 	static LibraryType nodeMT = {
 		{"__add", LUALAMBDA {
-			auto left = GetSynthNodeArg(1);
-			auto right = GetSynthNodeArg(2);
+			auto left = GetSynthNodeArg(l, 1);
+			auto right = GetSynthNodeArg(l, 2);
 			auto s = left.synth?left.synth:right.synth;
 			assert(s && ((left.synth == right.synth) || !left.synth || !right.synth));
-			return PushLuaSynthNode(s, NewAddOperation(s, left, right));
+			return PushLuaSynthNode(l, s, NewAddOperation(s, left, right));
 		}},
 
 		{"__sub", LUALAMBDA {
-			auto left = GetSynthNodeArg(1);
-			auto right = GetSynthNodeArg(2);
+			auto left = GetSynthNodeArg(l, 1);
+			auto right = GetSynthNodeArg(l, 2);
 			auto s = left.synth?left.synth:right.synth;
 			assert(s && ((left.synth == right.synth) || !left.synth || !right.synth));
-			return PushLuaSynthNode(s, NewSubtractOperation(s, left, right));
+			return PushLuaSynthNode(l, s, NewSubtractOperation(s, left, right));
 		}},
 
 		{"__mul", LUALAMBDA {
-			auto left = GetSynthNodeArg(1);
-			auto right = GetSynthNodeArg(2);
+			auto left = GetSynthNodeArg(l, 1);
+			auto right = GetSynthNodeArg(l, 2);
 			auto s = left.synth?left.synth:right.synth;
 			assert(s && ((left.synth == right.synth) || !left.synth || !right.synth));
-			return PushLuaSynthNode(s, NewMultiplyOperation(s, left, right));
+			return PushLuaSynthNode(l, s, NewMultiplyOperation(s, left, right));
 		}},
 
 		{"__div", LUALAMBDA {
-			auto left = GetSynthNodeArg(1);
-			auto right = GetSynthNodeArg(2);
+			auto left = GetSynthNodeArg(l, 1);
+			auto right = GetSynthNodeArg(l, 2);
 			auto s = left.synth?left.synth:right.synth;
 			assert(s && ((left.synth == right.synth) || !left.synth || !right.synth));
-			return PushLuaSynthNode(s, NewDivideOperation(s, left, right));
+			return PushLuaSynthNode(l, s, NewDivideOperation(s, left, right));
 		}},
 
 		{"__pow", LUALAMBDA {
-			auto left = GetSynthNodeArg(1);
-			auto right = GetSynthNodeArg(2);
+			auto left = GetSynthNodeArg(l, 1);
+			auto right = GetSynthNodeArg(l, 2);
 			auto s = left.synth?left.synth:right.synth;
 			assert(s && ((left.synth == right.synth) || !left.synth || !right.synth));
-			return PushLuaSynthNode(s, NewPowOperation(s, left, right));
+			return PushLuaSynthNode(l, s, NewPowOperation(s, left, right));
 		}},
 
 		{"__unm", LUALAMBDA {
-			auto a = GetSynthNodeArg(1);
+			auto a = GetSynthNodeArg(l, 1);
 			auto s = a.synth;
 			assert(s);
-			return PushLuaSynthNode(s, NewNegateOperation(s, a));
+			return PushLuaSynthNode(l, s, NewNegateOperation(s, a));
 		}},
 		{nullptr, nullptr}
 	};
 
 	static LibraryType nodeLib = {
 		{"set", LUALAMBDA {
-			auto a = GetSynthNodeArg(1);
-			if(a.isNode) {
-				// TODO: Safety
-				auto node = &a.synth->controls[a.node];
+			auto a = GetSynthNodeArg(l, 1);
+			u32 control = GetSynthControlID(a);
+			if(control != ~0u) {
 				f32 v = luaL_checknumber(l, 2);
 				f32 lerpTime = luaL_optnumber(l, 3, 0.f);
-				SetSynthControl(a.synth, node->name, v, lerpTime);
+				SetSynthControl(a.synth, a.synth->controls[control].name, v, lerpTime);
 			}
 			return 0;
 		}},
+		// time is on the synth.time() clock
+		{"set_at", LUALAMBDA {
+			auto a = GetSynthNodeArg(l, 1);
+			u32 control = GetSynthControlID(a);
+			if(control == ~0u) return luaL_argerror(l, 1, "expected a value node");
+
+			f64 time = luaL_checknumber(l, 2);
+			f32 v = luaL_checknumber(l, 3);
+			f32 lerpTime = luaL_optnumber(l, 4, 0.f);
+			ScheduleSynthControl(a.synth, a.synth->controls[control].name, time, v, lerpTime);
+			return 0;
+		}},
 
 		{nullptr, nullptr}
 	};
@@ -267,11 +611,20 @@ bool InitLuaLib(LuaState _l) {
 
 	static LibraryType triggerLib = {
 		{"trigger", LUALAMBDA {
-			// TODO: Safety
-			auto a = GetSynthTriggerArg(1);
-			assert(a);
-			auto trg = &a->synth->triggers[a->trigger];
-			TripSynthTrigger(a->synth, trg->name);
+			auto a = GetSynthTriggerArg(l, 1);
+			if(!a) return luaL_argerror(l, 1, "expected a trigger");
+
+			auto s = ResolveSynthLua(l, 1, a->synth);
+			auto trg = &s->triggers[a->trigger];
+			TripSynthTrigger(s, trg->name);
+			return 0;
+		}},
+		{"trigger_at", LUALAMBDA {
+			auto a = GetSynthTriggerArg(l, 1);
+			if(!a) return luaL_argerror(l, 1, "expected a trigger");
+
+			auto s = ResolveSynthLua(l, 1, a->synth);
+			ScheduleSynthTrigger(s, s->triggers[a->trigger].name, luaL_checknumber(l, 2));
 			return 0;
 		}},
 
@@ -298,20 +651,20 @@ bool InitLuaLib(LuaState _l) {
 	return true;
 }
 
-void ExtendTriggerLib(LibraryType lib) {
+void ExtendTriggerLib(LuaState l, LibraryType lib) {
 	luaL_getmetatable(l, "triggermt");
 	lua_getfield(l, -1, "__index");
 	luaL_setfuncs(l, lib, 0);
 }
 
-void ExtendSynthLib(LibraryType lib) {
+void ExtendSynthLib(LuaState l, LibraryType lib) {
 	luaL_getmetatable(l, "synthmt");
 	lua_getfield(l, -1, "__index");
 	luaL_setfuncs(l, lib, 0);
 }
 
 namespace {
-	void stackdump(){
+	void stackdump(LuaState l){
 		int i;
 		int top = lua_gettop(l);
 		printf("[LuaStack] ");
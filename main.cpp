@@ -1,10 +1,14 @@
 #include "common.h"
 
+#include "graphcache.h"
 #include "recording.h"
 #include "synth.h"
+#include "trace.h"
 #include <lua.hpp>
 
 #include <SDL2/SDL.h>
+#include <sndfile.h>
+#include <string>
 #include <vector>
 #include <chrono>
 
@@ -12,7 +16,175 @@ using namespace synth;
 
 u64 getFileModificationTime(const char*);
 
-s32 main(){
+// Tells when a file has been saved. On Linux inotify watches the file's directory,
+//	since editors often save by writing a new file and renaming it over the old one.
+//	Elsewhere the modification time is polled every quarter second
+struct FileWatcher {
+	std::string path;
+	std::string name;
+	s32 fd = -1;
+	u64 modificationTime = 0;
+	f32 pollTimer = 0.f;
+
+	void Init(const char* path);
+	bool Changed(f32 dt);
+	~FileWatcher();
+};
+
+void callUpdate(lua_State* l, u32 updateRef, f32 elapsed, f32 dt) {
+	if(!updateRef) return;
+
+	TraceScope trace {"lua update"};
+	lua_rawgeti(l, LUA_REGISTRYINDEX, updateRef);
+	lua_pushnumber(l, elapsed);
+	lua_pushnumber(l, dt);
+	if(lua_pcall(l, 2, 0, 0)) {
+		puts(lua_tostring(l, -1));
+		lua_pop(l, 1);
+	}
+}
+
+// Runs the script, unless cacheDir has the graphs from an earlier run of the same
+//	script, in which case lua doesn't build them again. Only scripts without an update
+//	function are cached, since everything else they do would be missing
+bool buildGraphs(lua_State* l, AudioContext* audio, const char* soundscript, const char* cacheDir) {
+	TraceScope trace {"build graph"};
+
+	std::string cachePath;
+	u64 key = cacheDir? HashFile(soundscript) : 0;
+	if(key) {
+		char name[32];
+		snprintf(name, sizeof(name), "/%016llx.graph", (unsigned long long)key);
+		cachePath = cacheDir + std::string(name);
+
+		if(ReadGraphCache(audio, cachePath.c_str(), key))
+			return true;
+	}
+
+	if(luaL_dofile(l, soundscript)) {
+		puts(lua_tostring(l, -1));
+		lua_pop(l, 1);
+		return false;
+	}
+
+	if(!cachePath.empty()) {
+		lua_getglobal(l, "update");
+		bool hasUpdate = lua_isfunction(l, -1);
+		lua_pop(l, 1);
+
+		if(!hasUpdate)
+			WriteGraphCache(audio, cachePath.c_str(), key);
+	}
+
+	return true;
+}
+
+// Renders seconds of a script straight to a file, with no device or window, as fast
+//	as it'll go. update is called 60 times per second of rendered audio
+s32 renderOffline(const char* soundscript, const char* output, f32 seconds, const char* cacheDir) {
+	AudioConfig config;
+	config.backend = AudioBackend::Offline;
+
+	auto audio = InitAudio(config);
+	config = GetAudioConfig(audio);
+
+	auto l = luaL_newstate();
+	luaL_openlibs(l);
+
+	if(!InitLuaLib(l, audio)) {
+		puts("Synth lua lib init failed!");
+		return 1;
+	}
+
+	if(!buildGraphs(l, audio, soundscript, cacheDir))
+		return 1;
+
+	u32 updateRef = 0;
+	lua_getglobal(l, "update");
+	if(lua_isfunction(l, -1)) {
+		updateRef = luaL_ref(l, LUA_REGISTRYINDEX);
+	}
+
+	SF_INFO info {};
+	info.samplerate = config.sampleRate;
+	info.channels = config.channels;
+	info.format = GetRecordingFormat(output);
+
+	auto sndfile = info.format? sf_open(output, SFM_WRITE, &info) : nullptr;
+	if(!sndfile) {
+		printf("Failed to open '%s' for writing, expected a .wav, .flac or .ogg file\n", output);
+		return 1;
+	}
+
+	u32 updateFrames = config.sampleRate / 60;
+	u64 totalFrames = u64(seconds * config.sampleRate);
+	std::vector<f32> buffer(updateFrames * config.channels);
+
+	using clock = std::chrono::steady_clock;
+	auto begin = clock::now();
+
+	f32 elapsed = 0.f;
+	for(u64 frame = 0; frame < totalFrames; frame += updateFrames) {
+		u32 count = std::min<u64>(updateFrames, totalFrames - frame);
+		RenderAudio(audio, buffer.data(), count);
+
+		{
+			TraceScope trace {"write output"};
+			sf_writef_float(sndfile, buffer.data(), count);
+		}
+
+		f32 dt = f32(count) / config.sampleRate;
+		elapsed += dt;
+
+		UpdateAudio(audio);
+		callUpdate(l, updateRef, elapsed, dt);
+	}
+
+	f32 renderTime = std::chrono::duration<f32>(clock::now() - begin).count();
+	printf("Rendered %.1fs of '%s' in %.2fs (%.1fx realtime)\n", seconds, soundscript, renderTime, seconds / renderTime);
+
+	sf_close(sndfile);
+	lua_close(l);
+	DeinitAudio(audio);
+	return 0;
+}
+
+// Usage: build [script] [-o output -t seconds] [--trace trace.json] [--cache dir]
+//	With an output file the script is rendered offline rather than played. With a
+//	trace file everything is traced and written out on exit, see trace.h. With a
+//	cache directory graphs are loaded from there when the script hasn't changed
+//	since it was last run, see graphcache.h
+s32 main(s32 argc, char** argv){
+	const char* soundscript = "scripts/scratch0.lua";
+	const char* output = nullptr;
+	const char* tracePath = nullptr;
+	const char* cacheDir = nullptr;
+	f32 seconds = 10.f;
+
+	for(s32 i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-o") && i+1 < argc) {
+			output = argv[++i];
+		}else if(!strcmp(argv[i], "-t") && i+1 < argc) {
+			seconds = atof(argv[++i]);
+		}else if(!strcmp(argv[i], "--trace") && i+1 < argc) {
+			tracePath = argv[++i];
+		}else if(!strcmp(argv[i], "--cache") && i+1 < argc) {
+			cacheDir = argv[++i];
+		}else{
+			soundscript = argv[i];
+		}
+	}
+
+	SetTraceThreadName("main");
+	if(tracePath)
+		SetTracing(true);
+
+	if(output) {
+		s32 result = renderOffline(soundscript, output, seconds, cacheDir);
+		if(tracePath) WriteTrace(tracePath);
+		return result;
+	}
+
 	SDL_Init(SDL_INIT_EVERYTHING);
 	auto sdlWindow = SDL_CreateWindow("LuaSynth Test",
 		SDL_WINDOWPOS_CENTERED_DISPLAY(1), SDL_WINDOWPOS_UNDEFINED,
@@ -23,11 +195,6 @@ s32 main(){
 		return 1;
 	}
 
-	if(!InitRecording("audio.ogg")) {
-		puts("Recording init failed!");
-		return 1;
-	}
-
 	auto l = luaL_newstate();
 	if(!l) {
 		puts("Lua init failed");
@@ -36,30 +203,34 @@ s32 main(){
 
 	luaL_openlibs(l);
 
-	if(!InitLuaLib(l)) {
-		puts("Synth lua lib init failed!");
+	auto audio = InitAudio();
+	if(!audio) {
+		puts("Audio init failed!");
 		return 1;
 	}
 
-	if(!InitAudio()) {
-		puts("Audio init failed!");
+	// Blocks reach the hook as interleaved stereo, whatever the device has
+	if(!InitRecording("audio.ogg", GetAudioConfig(audio).sampleRate, 2)) {
+		puts("Recording init failed!");
 		return 1;
 	}
 
-	SetAudioPostNormalizeHook([](const f32* b, u32 len){
+	if(!InitLuaLib(l, audio)) {
+		puts("Synth lua lib init failed!");
+		return 1;
+	}
+
+	SetAudioPostNormalizeHook(audio, [](const f32* b, u32 len){
 		RecordBuffer(b, len);
 	});
 
 	// SetSynthPostProcessHook([](Synth* s, f32* b, u32 len, f32* stereoCoeffs){
 	// });
 
-	const char* soundscript = "scripts/scratch0.lua";
+	FileWatcher watcher;
+	watcher.Init(soundscript);
 
-	u32 fileModTime = getFileModificationTime(soundscript);
-	if(luaL_dofile(l, soundscript)){
-		puts(lua_tostring(l, -1));
-		lua_pop(l, 1);
-	}
+	buildGraphs(l, audio, soundscript, cacheDir);
 
 	u32 updateRef = 0;
 	lua_getglobal(l, "update");
@@ -67,15 +238,12 @@ s32 main(){
 		updateRef = luaL_ref(l, LUA_REGISTRYINDEX);
 	}
 
-	auto synth = GetSynth(0);
-	
 	using std::chrono::duration;
 	using std::chrono::duration_cast;
 	using clock = std::chrono::high_resolution_clock;
 	auto begin = clock::now();
 
 	f32 elapsed = 0.f;
-	f32 pollTimer = 0.f;
 
 	bool running = true;
 	while(running){
@@ -92,7 +260,9 @@ s32 main(){
 				if(k == SDLK_SPACE){
 					// static f32 freqs[] {1./3.f, 1.f/2.f, 1.f, 2.f/3.f, 3.f/2.f, 4.f/5.f, 9.f/8.f};
 					// SetSynthControl(synth, "freq", freqs[rand()%sizeof(freqs)/4]*220.f);
-					TripSynthTrigger(synth, "<global>");
+					auto handles = GetSynthHandles(audio);
+					if(auto synth = handles.empty()? nullptr : GetSynth(audio, handles[0]))
+						TripSynthTrigger(synth, "<global>");
 				}
 			}
 		}
@@ -103,55 +273,127 @@ s32 main(){
 		elapsed += dt;
 		begin = end;
 
-		pollTimer -= dt;
-		if(pollTimer < 0.f) {
-			u64 newFileModTime = getFileModificationTime(soundscript);
-			if(newFileModTime > fileModTime) {
-				DestroyAllSynths();
-				if(luaL_dofile(l, soundscript)){
-					puts(lua_tostring(l, -1));
-					lua_pop(l, 1);
-				}
+		// The new graphs are diffed against the playing ones, so only what changed
+		//	restarts. A script that fails leaves the previous version playing
+		if(watcher.Changed(dt)) {
+			TraceScope trace {"reload"};
+			auto reloadBegin = clock::now();
+
+			BeginSynthReload(audio);
+			if(luaL_dofile(l, soundscript)){
+				puts(lua_tostring(l, -1));
+				lua_pop(l, 1);
+				CancelSynthReload(audio);
+				printf("Reloading '%s' failed, the previous version keeps playing\n", soundscript);
+			}else{
+				auto report = CommitSynthReload(audio);
+
+				luaL_unref(l, LUA_REGISTRYINDEX, updateRef);
+				updateRef = 0;
 
 				lua_getglobal(l, "update");
-				if(lua_isfunction(l, -1)) {
-					luaL_unref(l, LUA_REGISTRYINDEX, updateRef);
+				if(lua_isfunction(l, -1))
 					updateRef = luaL_ref(l, LUA_REGISTRYINDEX);
-				}
+				else
+					lua_pop(l, 1);
 
-				fileModTime = newFileModTime;
+				f32 ms = duration<f32, std::milli>(clock::now() - reloadBegin).count();
+				printf("Reloaded '%s' in %.1fms: %u synths kept, %u new, %u removed, %u of %u nodes kept their state\n",
+					soundscript, ms, report.keptSynths, report.newSynths, report.removedSynths,
+					report.keptNodes, report.keptNodes + report.newNodes);
 			}
-			
-			pollTimer = 0.25f;
 		}
 
-		UpdateAudio();
-
-		if(updateRef) {
-			lua_rawgeti(l, LUA_REGISTRYINDEX, updateRef);
-			lua_pushnumber(l, elapsed);
-			lua_pushnumber(l, dt);
-			if(lua_pcall(l, 2, 0, 0)) {
-				puts(lua_tostring(l, -1));
-				lua_pop(l, 1);
-			}
-		}
+		UpdateAudio(audio);
+		callUpdate(l, updateRef, elapsed, dt);
 
 		SDL_Delay(1);
 	}
 
-	DeinitAudio();
+	DeinitAudio(audio);
 	FinishRecording();
 	SDL_Quit();
 
+	if(tracePath)
+		WriteTrace(tracePath);
+
 	return 0;
 }
 
 
 #include <sys/stat.h>
 
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
 u64 getFileModificationTime(const char* path) {
 	struct stat attr;
-    stat(path, &attr);
-    return attr.st_mtime;
+	if(stat(path, &attr))
+		return 0;
+
+	return attr.st_mtime;
+}
+
+void FileWatcher::Init(const char* p) {
+	path = p;
+	modificationTime = getFileModificationTime(p);
+
+#ifdef __linux__
+	auto slash = path.find_last_of('/');
+	std::string directory = slash == std::string::npos? "." : path.substr(0, slash+1);
+	name = slash == std::string::npos? path : path.substr(slash+1);
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd >= 0 && inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(fd);
+		fd = -1;
+	}
+
+	if(fd < 0)
+		printf("Can't watch '%s' with inotify, polling it instead\n", p);
+#endif
+}
+
+bool FileWatcher::Changed(f32 dt) {
+#ifdef __linux__
+	if(fd >= 0) {
+		// A save can take several events, they all count as one change
+		bool changed = false;
+		alignas(inotify_event) char buffer[4096];
+		ssize_t length;
+
+		while((length = read(fd, buffer, sizeof buffer)) > 0) {
+			for(char* e = buffer; e < buffer + length;) {
+				auto event = (inotify_event*)e;
+				if(event->len && name == event->name)
+					changed = true;
+
+				e += sizeof(inotify_event) + event->len;
+			}
+		}
+
+		return changed;
+	}
+#endif
+
+	pollTimer -= dt;
+	if(pollTimer >= 0.f)
+		return false;
+
+	pollTimer = 0.25f;
+
+	u64 time = getFileModificationTime(path.c_str());
+	if(time <= modificationTime)
+		return false;
+
+	modificationTime = time;
+	return true;
+}
+
+FileWatcher::~FileWatcher() {
+#ifdef __linux__
+	if(fd >= 0) close(fd);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,285 @@
+#include "mixer.h"
+#include "denormal.h"
+
+#include <algorithm>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SYNTH_SSE
+#endif
+
+namespace synth {
+
+namespace {
+	constexpr f32 targetLevel = 0.7f;
+	constexpr f32 attackTime  = 5.f / 1000.f;
+	constexpr f32 releaseTime = 200.f / 1000.f;
+
+	f32 clamp01(f32 v) {
+		return std::min(std::max(v, 0.f), 1.f);
+	}
+
+#ifdef SYNTH_SSE
+	__m128 clamp01(__m128 v) {
+		return _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1.f));
+	}
+#endif
+
+	// Subtracts a per channel DC estimate. The estimate moves so slowly that
+	//	following the block mean and ramping across the block is indistinguishable
+	//	from a per sample one-pole
+	void RemoveDC(f32* buffer, u32 frames, f32 dc[2], f32 coeff) {
+		f32 sum[2] {0.f, 0.f};
+		u32 i = 0;
+
+#ifdef SYNTH_SSE
+		__m128 acc = _mm_setzero_ps();
+		for(; i+2 <= frames; i += 2)
+			acc = _mm_add_ps(acc, _mm_loadu_ps(buffer + i*2));
+
+		alignas(16) f32 lanes[4];
+		_mm_store_ps(lanes, acc);
+		sum[0] = lanes[0] + lanes[2];
+		sum[1] = lanes[1] + lanes[3];
+#endif
+		for(; i < frames; i++) {
+			sum[0] += buffer[i*2+0];
+			sum[1] += buffer[i*2+1];
+		}
+
+		f32 decay = std::pow(1.f - coeff, f32(frames));
+		f32 step[2];
+		for(u32 c = 0; c < 2; c++) {
+			f32 mean = sum[c] / frames;
+			f32 newDC = mean + (dc[c] - mean) * decay;
+			step[c] = (newDC - dc[c]) / frames;
+		}
+
+		i = 0;
+#ifdef SYNTH_SSE
+		__m128 ramp = _mm_set_ps(dc[1] + step[1]*2.f, dc[0] + step[0]*2.f, dc[1] + step[1], dc[0] + step[0]);
+		__m128 rampStep = _mm_set_ps(step[1]*2.f, step[0]*2.f, step[1]*2.f, step[0]*2.f);
+		for(; i+2 <= frames; i += 2) {
+			__m128 x = _mm_loadu_ps(buffer + i*2);
+			_mm_storeu_ps(buffer + i*2, _mm_sub_ps(x, ramp));
+			ramp = _mm_add_ps(ramp, rampStep);
+		}
+#endif
+		for(; i < frames; i++) {
+			buffer[i*2+0] -= dc[0] + step[0]*(i+1);
+			buffer[i*2+1] -= dc[1] + step[1]*(i+1);
+		}
+
+		dc[0] = FlushDenormal(dc[0] + step[0]*frames);
+		dc[1] = FlushDenormal(dc[1] + step[1]*frames);
+	}
+
+	// peaks[i] = max(|left|, |right|)
+	void FramePeaks(const f32* buffer, f32* peaks, u32 frames) {
+		u32 i = 0;
+
+#ifdef SYNTH_SSE
+		const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+		for(; i+4 <= frames; i += 4) {
+			__m128 a = _mm_and_ps(_mm_loadu_ps(buffer + i*2), absMask);
+			__m128 b = _mm_and_ps(_mm_loadu_ps(buffer + i*2 + 4), absMask);
+			__m128 left  = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+			_mm_storeu_ps(peaks + i, _mm_max_ps(left, right));
+		}
+#endif
+		for(; i < frames; i++)
+			peaks[i] = std::max(std::abs(buffer[i*2]), std::abs(buffer[i*2+1]));
+	}
+
+	// buffer = clamp(buffer * gain, -1, 1), one gain per frame
+	void ApplyGains(f32* buffer, const f32* gains, u32 frames) {
+		u32 i = 0;
+
+#ifdef SYNTH_SSE
+		const __m128 one = _mm_set1_ps(1.f);
+		const __m128 negOne = _mm_set1_ps(-1.f);
+		for(; i+4 <= frames; i += 4) {
+			__m128 g = _mm_loadu_ps(gains + i);
+			__m128 a = _mm_mul_ps(_mm_loadu_ps(buffer + i*2), _mm_unpacklo_ps(g, g));
+			__m128 b = _mm_mul_ps(_mm_loadu_ps(buffer + i*2 + 4), _mm_unpackhi_ps(g, g));
+			_mm_storeu_ps(buffer + i*2, _mm_min_ps(_mm_max_ps(a, negOne), one));
+			_mm_storeu_ps(buffer + i*2 + 4, _mm_min_ps(_mm_max_ps(b, negOne), one));
+		}
+#endif
+		for(; i < frames; i++) {
+			buffer[i*2+0] = std::min(std::max(buffer[i*2+0]*gains[i], -1.f), 1.f);
+			buffer[i*2+1] = std::min(std::max(buffer[i*2+1]*gains[i], -1.f), 1.f);
+		}
+	}
+}
+
+void MixMono(f32* out, const f32* in, u32 count, f32 gain, f32 gainStep, f32 scale) {
+	u32 i = 0;
+
+#ifdef SYNTH_SSE
+	__m128 idx = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+	const __m128 four = _mm_set1_ps(4.f);
+	const __m128 g0 = _mm_set1_ps(gain);
+	const __m128 gs = _mm_set1_ps(gainStep);
+	const __m128 sc = _mm_set1_ps(scale);
+
+	for(; i+4 <= count; i += 4) {
+		__m128 g = _mm_mul_ps(clamp01(_mm_add_ps(g0, _mm_mul_ps(gs, idx))), sc);
+		__m128 o = _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(_mm_loadu_ps(in + i), g));
+		_mm_storeu_ps(out + i, o);
+		idx = _mm_add_ps(idx, four);
+	}
+#endif
+	for(; i < count; i++)
+		out[i] += in[i] * clamp01(gain + gainStep*i) * scale;
+}
+
+void MixStereo(f32* out, const f32* in, u32 count, f32 pan, f32 panStep, f32 gain, f32 gainStep, const f32 coeffs[2]) {
+	u32 i = 0;
+
+#ifdef SYNTH_SSE
+	__m128 idx = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+	const __m128 four = _mm_set1_ps(4.f);
+	const __m128 one = _mm_set1_ps(1.f);
+	const __m128 g0 = _mm_set1_ps(gain);
+	const __m128 gs = _mm_set1_ps(gainStep);
+	const __m128 p0 = _mm_set1_ps(pan);
+	const __m128 ps = _mm_set1_ps(panStep);
+	const __m128 cl = _mm_set1_ps(coeffs[0]);
+	const __m128 cr = _mm_set1_ps(coeffs[1]);
+
+	for(; i+4 <= count; i += 4) {
+		__m128 v = _mm_mul_ps(_mm_loadu_ps(in + i), clamp01(_mm_add_ps(g0, _mm_mul_ps(gs, idx))));
+		__m128 p = _mm_add_ps(p0, _mm_mul_ps(ps, idx));
+		__m128 l = _mm_mul_ps(_mm_mul_ps(v, cl), clamp01(_mm_sub_ps(one, p)));
+		__m128 r = _mm_mul_ps(_mm_mul_ps(v, cr), clamp01(_mm_add_ps(one, p)));
+
+		f32* o = out + i*2;
+		_mm_storeu_ps(o,     _mm_add_ps(_mm_loadu_ps(o),     _mm_unpacklo_ps(l, r)));
+		_mm_storeu_ps(o + 4, _mm_add_ps(_mm_loadu_ps(o + 4), _mm_unpackhi_ps(l, r)));
+		idx = _mm_add_ps(idx, four);
+	}
+#endif
+	for(; i < count; i++) {
+		f32 v = in[i] * clamp01(gain + gainStep*i);
+		f32 p = pan + panStep*i;
+		out[i*2+0] += v * coeffs[0] * clamp01(1-p);
+		out[i*2+1] += v * coeffs[1] * clamp01(1+p);
+	}
+}
+
+void Limiter::Init(u32 sampleRate, f32 maxLookaheadTime) {
+	envelope = 1.f;
+	signalDC[0] = 0.f;
+	signalDC[1] = 0.f;
+
+	dcCoeff = 0.5f / sampleRate;
+	attack  = std::exp(-1.f / (attackTime * sampleRate));
+	release = std::exp(-1.f / (releaseTime * sampleRate));
+
+	maxLookahead = std::max(u32(maxLookaheadTime * sampleRate), 1u);
+	delayLine.assign((maxLookahead + ChunkSize) * 2, 0.f);
+	heldGains.assign(maxLookahead, targetLevel);
+	peakFrames.assign(maxLookahead, 0);
+	peakValues.assign(maxLookahead, 0.f);
+
+	SetLookahead(0);
+}
+
+void Limiter::SetLookahead(u32 frames) {
+	lookahead = std::min(frames, maxLookahead);
+	frame = 0;
+	peakHead = 0;
+	peakCount = 0;
+	releasedGain = targetLevel;
+	gainSum = f64(targetLevel) * lookahead;
+
+	std::fill(heldGains.begin(), heldGains.end(), targetLevel);
+	std::fill(delayLine.begin(), delayLine.end(), 0.f);
+}
+
+void Limiter::Process(f32* buffer, u32 frames) {
+	while(frames > 0) {
+		u32 chunk = std::min<u32>(frames, ChunkSize);
+		ProcessChunk(buffer, chunk);
+		buffer += chunk*2;
+		frames -= chunk;
+	}
+}
+
+void Limiter::ProcessChunk(f32* buffer, u32 frames) {
+	f32 peaks[ChunkSize];
+	f32 gains[ChunkSize];
+
+	RemoveDC(buffer, frames, signalDC, dcCoeff);
+	FramePeaks(buffer, peaks, frames);
+
+	if(lookahead > 0) {
+		LookaheadGains(peaks, gains, frames);
+
+		// Delay by lookahead-1 frames so each gain lines up with the oldest frame
+		//	of the window it was computed from
+		u32 history = (lookahead-1) * 2;
+		u32 length = frames * 2;
+		std::copy(buffer, buffer + length, delayLine.begin() + history);
+		std::copy(delayLine.begin(), delayLine.begin() + length, buffer);
+		std::copy(delayLine.begin() + length, delayLine.begin() + length + history, delayLine.begin());
+	}else{
+		EnvelopeGains(peaks, gains, frames);
+	}
+
+	ApplyGains(buffer, gains, frames);
+}
+
+void Limiter::EnvelopeGains(const f32* peaks, f32* gains, u32 frames) {
+	f32 env = envelope;
+
+	for(u32 i = 0; i < frames; i++) {
+		f32 p = peaks[i];
+		f32 coeff = (p > env)? attack : release;
+		env = std::max(p + (env - p) * coeff, 1.f);
+		gains[i] = targetLevel / env;
+	}
+
+	envelope = env;
+}
+
+// The gain for each frame is held at the minimum required over the look-ahead
+//	window, released slowly, and then box filtered over the same window. Every
+//	value entering the average is at most the gain required by the oldest frame
+//	in the window, so peaks are reached without overshoot and without the attack
+//	distortion of the envelope follower.
+void Limiter::LookaheadGains(const f32* peaks, f32* gains, u32 frames) {
+	for(u32 i = 0; i < frames; i++, frame++) {
+		f32 p = peaks[i];
+
+		// Expire first so the queue never holds more than lookahead frames
+		while(peakCount > 0 && peakFrames[peakHead] + lookahead <= frame) {
+			peakHead = (peakHead + 1) % maxLookahead;
+			peakCount--;
+		}
+
+		while(peakCount > 0 && peakValues[(peakHead + peakCount - 1) % maxLookahead] <= p)
+			peakCount--;
+
+		u32 back = (peakHead + peakCount) % maxLookahead;
+		peakFrames[back] = frame;
+		peakValues[back] = p;
+		peakCount++;
+
+		f32 held = targetLevel / std::max(peakValues[peakHead], 1.f);
+		if(held < releasedGain)
+			releasedGain = held;
+		else
+			releasedGain = held + (releasedGain - held) * release;
+
+		u32 slot = frame % lookahead;
+		gainSum += releasedGain - heldGains[slot];
+		heldGains[slot] = releasedGain;
+		gains[i] = f32(gainSum / lookahead);
+	}
+}
+
+}
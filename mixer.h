@@ -0,0 +1,57 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include "common.h"
+#include <vector>
+
+namespace synth {
+
+// Block-wise kernels for the mixing and master stages of audio_callback.
+//	Stereo buffers are interleaved. Gain and pan ramps are linear over the block
+//	and are clamped to [0, 1] per sample, the same as the old per-sample mix.
+
+// out[i] += in[i] * clamp(gain + gainStep*i, 0, 1) * scale
+void MixMono(f32* out, const f32* in, u32 count, f32 gain, f32 gainStep, f32 scale);
+
+// out[2i+0] += in[i] * coeffs[0] * clamp(1 - pan_i, 0, 1) * clamp(gain_i, 0, 1)
+// out[2i+1] += in[i] * coeffs[1] * clamp(1 + pan_i, 0, 1) * clamp(gain_i, 0, 1)
+void MixStereo(f32* out, const f32* in, u32 count, f32 pan, f32 panStep, f32 gain, f32 gainStep, const f32 coeffs[2]);
+
+// DC blocker and limiter run over the final stereo mix.
+//	With a look-ahead window the gain is reduced before peaks arrive instead of
+//	after, at the cost of delaying the output by the window length.
+struct Limiter {
+	enum { ChunkSize = 256 };
+
+	f32 envelope;
+	f32 signalDC[2];
+
+	f32 dcCoeff;
+	f32 attack;
+	f32 release;
+
+	u32 lookahead; // In frames, 0 when disabled
+	u32 maxLookahead;
+	u64 frame;
+
+	std::vector<f32> delayLine;  // Interleaved, lookahead-1 frames of history followed by the current chunk
+	std::vector<f32> heldGains;  // Box filter history
+	std::vector<u64> peakFrames; // Monotonic queue of window peaks
+	std::vector<f32> peakValues;
+	u32 peakHead, peakCount;
+	f64 gainSum;
+	f32 releasedGain;
+
+	void Init(u32 sampleRate, f32 maxLookaheadTime);
+	void SetLookahead(u32 frames); // Clamped to maxLookahead, resets look-ahead state
+	void Process(f32* buffer, u32 frames);
+
+private:
+	void ProcessChunk(f32* buffer, u32 frames);
+	void EnvelopeGains(const f32* peaks, f32* gains, u32 frames);
+	void LookaheadGains(const f32* peaks, f32* gains, u32 frames);
+};
+
+}
+
+#endif
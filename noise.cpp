@@ -0,0 +1,115 @@
+#include "noise.h"
+#include "synth.h"
+#include "denormal.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SYNTH_SSE
+#endif
+
+namespace synth {
+
+namespace {
+	// lowbias32, see https://nullprogram.com/blog/2018/07/31/
+	u32 Hash(u32 x) {
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+
+#ifdef SYNTH_SSE
+	// SSE2 has no 32 bit multiply, so multiply even and odd lanes separately
+	__m128i Multiply(__m128i a, u32 b) {
+		__m128i m = _mm_set1_epi32(b);
+		__m128i even = _mm_mul_epu32(a, m);
+		__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);
+		return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+			_mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+	}
+
+	__m128i Hash(__m128i x) {
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		x = Multiply(x, 0x7feb352du);
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+		x = Multiply(x, 0x846ca68bu);
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		return x;
+	}
+#endif
+
+	// Top 24 bits to [-1, 1)
+	constexpr f32 unitScale = 2.f / (1u<<24);
+}
+
+u32 HashSeed(u32 seed, u32 value) {
+	return Hash(seed ^ Hash(value + 0x9e3779b9u));
+}
+
+void NoiseGenerator::Init(NoiseColor color_, u32 seed_) {
+	memset(this, 0, sizeof(NoiseGenerator));
+	color = color_;
+	seed = Hash(seed_);
+	position = BlockSize;
+}
+
+void NoiseGenerator::Fill() {
+	u32 i = 0;
+
+#ifdef SYNTH_SSE
+	const __m128i s = _mm_set1_epi32(seed);
+	const __m128 scale = _mm_set1_ps(unitScale);
+	const __m128 one = _mm_set1_ps(1.f);
+	__m128i c = _mm_add_epi32(_mm_set1_epi32(counter), _mm_set_epi32(3, 2, 1, 0));
+
+	for(; i+4 <= BlockSize; i += 4) {
+		__m128i h = Hash(_mm_xor_si128(Hash(c), s));
+		__m128 v = _mm_cvtepi32_ps(_mm_srli_epi32(h, 8));
+		_mm_storeu_ps(block + i, _mm_sub_ps(_mm_mul_ps(v, scale), one));
+		c = _mm_add_epi32(c, _mm_set1_epi32(4));
+	}
+#endif
+	for(; i < BlockSize; i++)
+		block[i] = (Hash(Hash(counter + i) ^ seed) >> 8) * unitScale - 1.f;
+
+	counter += BlockSize;
+	position = 0;
+
+	switch(color) {
+		case NoiseColor::Pink: {
+			// -3dB/oct to within 0.05dB above 9Hz, scaled to roughly unit peak
+			auto b = pink;
+			for(u32 i = 0; i < BlockSize; i++) {
+				f32 w = block[i];
+				b[0] = 0.99886f * b[0] + w * 0.0555179f;
+				b[1] = 0.99332f * b[1] + w * 0.0750759f;
+				b[2] = 0.96900f * b[2] + w * 0.1538520f;
+				b[3] = 0.86650f * b[3] + w * 0.3104856f;
+				b[4] = 0.55000f * b[4] + w * 0.5329522f;
+				b[5] = -0.7616f * b[5] - w * 0.0168980f;
+				block[i] = (b[0] + b[1] + b[2] + b[3] + b[4] + b[5] + b[6] + w * 0.5362f) * 0.11f;
+				b[6] = w * 0.115926f;
+			}
+
+			for(u32 j = 0; j < 6; j++)
+				b[j] = FlushDenormal(b[j]);
+		}	break;
+
+		case NoiseColor::Brown: {
+			// Leaky integrator, -6dB/oct above a few Hz
+			f32 b = brown;
+			for(u32 i = 0; i < BlockSize; i++) {
+				b = (b + 0.02f * block[i]) / 1.02f;
+				block[i] = b * 3.5f;
+			}
+
+			brown = FlushDenormal(b);
+		}	break;
+
+		default: break;
+	}
+}
+
+}
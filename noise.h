@@ -0,0 +1,44 @@
+#ifndef NOISE_H
+#define NOISE_H
+
+#include "common.h"
+
+namespace synth {
+
+enum class NoiseColor : u8;
+
+// Counter based noise: sample n is a hash of (seed, n), so generators share no
+//	state, can be filled a block at a time with SIMD, and a given seed always
+//	produces the same sequence. Pink and brown noise filter the white block.
+struct NoiseGenerator {
+	enum { BlockSize = 64 };
+
+	NoiseColor color;
+	u32 seed;
+	u32 counter;
+	u32 position;
+
+	f32 pink[7]; // Paul Kellet's filter
+	f32 brown;
+
+	f32 block[BlockSize];
+
+	void Init(NoiseColor, u32 seed);
+
+	f32 Next() {
+		if(position == BlockSize)
+			Fill();
+
+		return block[position++];
+	}
+
+private:
+	void Fill();
+};
+
+// Mixes a value into a seed, e.g., to derive node seeds from a synth seed
+u32 HashSeed(u32 seed, u32 value);
+
+}
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "common.h"
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define SYNTH_CYCLE_COUNTER_TSC
+#endif
+
+namespace synth {
+
+// A cheap, monotonic tick count for timing single nodes. The time stamp counter
+//	where there is one, steady_clock otherwise. Ticks only mean something relative
+//	to a calibration against steady_clock, see TicksPerSecond
+inline u64 ReadCycleCounter() {
+#ifdef SYNTH_CYCLE_COUNTER_TSC
+	return __rdtsc();
+#else
+	return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Tick rate between two points at which both clocks were read, 0 if no time passed
+inline f64 TicksPerSecond(u64 beginTicks, std::chrono::steady_clock::time_point beginTime) {
+	f64 seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - beginTime).count();
+	u64 ticks = ReadCycleCounter() - beginTicks;
+	return seconds > 0.0? ticks / seconds : 0.0;
+}
+
+}
+
+#endif
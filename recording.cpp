@@ -1,18 +1,83 @@
 #include "recording.h"
+#include "trace.h"
 #include <sndfile.h>
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
 namespace {
+	// How far the writer may fall behind before buffers are dropped
+	constexpr f32 ringTime = 2.f;
+
 	SNDFILE* sndfile = nullptr;
+	u32 sampleRate = 0;
+	u32 channels = 0;
+
+	// Single producer, single consumer. Positions are in samples and only grow
+	std::vector<f32> ring;
+	std::atomic<u64> written {0}; // Only advanced by RecordBuffer
+	std::atomic<u64> encoded {0}; // Only advanced by the writer
+
+	std::atomic<u64> droppedBlocks {0};
+	std::atomic<u64> droppedSamples {0};
+
+	std::thread writer;
+	std::atomic<bool> running {false};
+
+	// Encodes everything submitted so far, false if there was nothing
+	bool Drain() {
+		u64 end = written.load(std::memory_order_acquire);
+		u64 begin = encoded.load(std::memory_order_relaxed);
+		if(begin == end) return false;
+
+		synth::TraceScope trace {"recording flush"};
+
+		// The ring holds whole frames, so every chunk does too
+		while(begin < end) {
+			u64 offset = begin % ring.size();
+			u64 count = std::min<u64>(end - begin, ring.size() - offset);
+			sf_write_float(sndfile, &ring[offset], count);
+
+			begin += count;
+			encoded.store(begin, std::memory_order_release);
+		}
+
+		return true;
+	}
+
+	void Write() {
+		synth::SetTraceThreadName("recording writer");
+		u64 reportedDrops = 0;
+
+		while(running.load(std::memory_order_acquire)) {
+			if(!Drain())
+				std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+			u64 drops = droppedBlocks.load(std::memory_order_relaxed);
+			if(drops != reportedDrops) {
+				printf("Recording fell behind, %llu blocks dropped so far\n", (unsigned long long)drops);
+				reportedDrops = drops;
+			}
+		}
+
+		Drain();
+	}
 }
 
-bool InitRecording(const char* fname) {
+bool InitRecording(const char* fname, u32 rate, u32 channelCount) {
 	assert(!sndfile);
 
 	SF_INFO info {};
-	info.samplerate = 44100;
-	info.channels = 1;
-	// info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
-	info.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+	info.samplerate = rate;
+	info.channels = channelCount;
+	info.format = GetRecordingFormat(fname);
+
+	if(!info.format) {
+		printf("Can't record to '%s', expected a .wav, .flac or .ogg file\n", fname);
+		return false;
+	}
 
 	sndfile = sf_open(fname, SFM_WRITE, &info);
 	if(!sndfile) {
@@ -20,16 +85,64 @@ bool InitRecording(const char* fname) {
 		return false;
 	}
 
+	sampleRate = rate;
+	channels = channelCount;
+	ring.assign(u32(ringTime * rate) * channels, 0.f);
+	written = 0;
+	encoded = 0;
+	droppedBlocks = 0;
+	droppedSamples = 0;
+
+	running = true;
+	writer = std::thread{Write};
 	return true;
 }
 
 void RecordBuffer(const f32* buf, u32 len) {
 	assert(sndfile);
-	sf_write_float(sndfile, buf, len);
+	assert(len % channels == 0);
+
+	u64 begin = written.load(std::memory_order_relaxed);
+	u64 space = ring.size() - (begin - encoded.load(std::memory_order_acquire));
+
+	if(len > space) {
+		droppedBlocks.fetch_add(1, std::memory_order_relaxed);
+		droppedSamples.fetch_add(len, std::memory_order_relaxed);
+		return;
+	}
+
+	u64 offset = begin % ring.size();
+	u32 first = std::min<u64>(len, ring.size() - offset);
+	std::copy(buf, buf + first, &ring[offset]);
+	std::copy(buf + first, buf + len, &ring[0]);
+
+	written.store(begin + len, std::memory_order_release);
 }
 
 void FinishRecording() {
+	running = false;
+	writer.join();
+
+	if(u64 drops = droppedBlocks.load()) {
+		f32 seconds = f32(droppedSamples.load()) / channels / sampleRate;
+		printf("Recording dropped %llu blocks (%.2fs of audio)\n", (unsigned long long)drops, seconds);
+	}
+
 	sf_write_sync(sndfile);
 	sf_close(sndfile);
 	sndfile = nullptr;
 }
+
+u64 GetDroppedRecordingBlocks() {
+	return droppedBlocks.load(std::memory_order_relaxed);
+}
+
+s32 GetRecordingFormat(const char* fname) {
+	const char* extension = strrchr(fname, '.');
+	extension = extension? extension+1 : "";
+
+	if(!strcmp(extension, "wav")) return SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+	if(!strcmp(extension, "flac")) return SF_FORMAT_FLAC | SF_FORMAT_PCM_24;
+	if(!strcmp(extension, "ogg")) return SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+	return 0;
+}
@@ -3,8 +3,17 @@
 
 #include "common.h"
 
-bool InitRecording(const char* fname);
-void RecordBuffer(const f32* buf, u32 len);
-void FinishRecording();
+// Records interleaved audio to a file without blocking the thread that submits it.
+//	Buffers are copied into a ring which a writer thread encodes from. The format
+//	follows the extension: .wav (float), .flac (24 bit) or .ogg (Vorbis). If the
+//	writer falls behind whole buffers are dropped rather than waited on, and counted.
+bool InitRecording(const char* fname, u32 sampleRate, u32 channels);
+void RecordBuffer(const f32* buf, u32 len); // len in samples, a multiple of channels. Realtime safe
+void FinishRecording(); // Writes out whatever is left and closes the file
 
-#endif
\ No newline at end of file
+u64 GetDroppedRecordingBlocks();
+
+// libsndfile format for a file name, going by the extension as above. 0 if unsupported
+s32 GetRecordingFormat(const char* fname);
+
+#endif
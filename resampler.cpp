@@ -0,0 +1,67 @@
+#include "resampler.h"
+
+namespace synth {
+
+void Resampler::Init(u32 factor_) {
+	factor = std::max(factor_, 1u);
+	phase = 0;
+	historyPosition = 0;
+
+	history.assign(Taps*2, 0.f);
+	coeffs.resize(factor * Taps);
+
+	// Blackman windowed sinc, cut off a little below the input nyquist
+	u32 length = factor * Taps;
+	f64 cutoff = 0.45 / factor;
+	f64 center = (length - 1) / 2.0;
+
+	for(u32 p = 0; p < factor; p++) {
+		f64 sum = 0.0;
+		f32* c = &coeffs[p * Taps];
+
+		for(u32 k = 0; k < Taps; k++) {
+			u32 n = k*factor + p;
+			f64 x = n - center;
+			f64 sinc = (std::abs(x) < 1e-9)? 1.0 : std::sin(2.0*PI*cutoff*x) / (PI*x);
+			f64 window = 0.42 - 0.5*std::cos(2.0*PI*n/(length-1)) + 0.08*std::cos(4.0*PI*n/(length-1));
+			f64 h = 2.0*cutoff * sinc * window;
+
+			// k = 0 multiplies the newest input, which the dot product reads last
+			c[Taps-1-k] = h;
+			sum += h;
+		}
+
+		// Unity gain at DC for every phase
+		for(u32 k = 0; k < Taps; k++)
+			c[k] /= sum;
+	}
+}
+
+u32 Resampler::InputsNeeded(u32 count) const {
+	u32 first = FirstInput();
+	if(first >= count) return 0;
+	return (count - 1 - first) / factor + 1;
+}
+
+void Resampler::Process(const f32* in, f32* out, u32 count) {
+	for(u32 i = 0; i < count; i++) {
+		if(phase == 0) {
+			history[historyPosition] = *in;
+			history[historyPosition + Taps] = *in;
+			historyPosition = (historyPosition + 1) % Taps;
+			in++;
+		}
+
+		const f32* c = &coeffs[phase * Taps];
+		const f32* window = &history[historyPosition];
+
+		f32 acc = 0.f;
+		for(u32 k = 0; k < Taps; k++)
+			acc += c[k] * window[k];
+
+		out[i] = acc;
+		phase = (phase + 1) % factor;
+	}
+}
+
+}
@@ -0,0 +1,36 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include "common.h"
+#include <vector>
+
+namespace synth {
+
+// Upsamples by an integer factor with a polyphase windowed sinc. Each output
+//	phase is a Taps long dot product over the most recent inputs, so only the
+//	nonzero samples of the zero-stuffed signal are ever multiplied.
+//	Adds Taps/2 input samples of latency.
+struct Resampler {
+	enum { Taps = 16 };
+
+	u32 factor;
+	u32 phase; // Output samples since the last input
+	u32 historyPosition;
+
+	std::vector<f32> coeffs; // factor x Taps, each phase reversed
+	std::vector<f32> history; // Double written ring of the last Taps inputs
+	std::vector<f32> input;  // Scratch for the owner to render inputs into
+
+	void Init(u32 factor);
+
+	// Inputs consumed by the next count outputs. The first is consumed by output
+	//	FirstInput(), then one every factor outputs
+	u32 InputsNeeded(u32 count) const;
+	u32 FirstInput() const { return (factor - phase) % factor; }
+
+	void Process(const f32* in, f32* out, u32 count);
+};
+
+}
+
+#endif
@@ -0,0 +1,221 @@
+// The fortified inline versions of open and read would clash with the interposers
+#undef _FORTIFY_SOURCE
+
+#include "rtcheck.h"
+
+#ifdef SYNTH_RT_CHECK
+
+#include <atomic>
+#include <cstdarg>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace synth {
+
+namespace {
+	enum Kind { KindAllocation, KindFree, KindLock, KindIO, KindCount };
+	const char* kindNames[KindCount] {"allocation", "free", "lock", "file I/O"};
+
+	enum { MaxReports = 16, MaxFrames = 32, SiteFrames = 6 };
+
+	thread_local u32 depth = 0;
+	thread_local bool reporting = false; // Whatever reporting does itself doesn't count
+	thread_local const char* sectionName = nullptr;
+	thread_local u32 sectionViolations = 0;
+	thread_local u32 allowedLocks = 0;
+
+	std::atomic<u64> sections;
+	std::atomic<u64> failedSections;
+	std::atomic<u64> counts[KindCount];
+	std::atomic<u32> maxPerSection;
+
+	std::atomic<u32> siteCount;
+	std::atomic<u64> sites[MaxReports]; // Hashes of the call stacks already logged
+
+	void Report(Kind kind) {
+		reporting = true;
+		counts[kind].fetch_add(1, std::memory_order_relaxed);
+		sectionViolations++;
+
+		void* frames[MaxFrames];
+		s32 frameCount = backtrace(frames, MaxFrames);
+
+		// Skip Report and the interposer
+		u64 site = kind;
+		for(s32 i = 2; i < std::min<s32>(frameCount, 2 + SiteFrames); i++)
+			site = site*31 + (u64)frames[i];
+
+		bool seen = false;
+		u32 logged = std::min<u32>(siteCount.load(), MaxReports);
+		for(u32 i = 0; i < logged && !seen; i++)
+			seen = sites[i].load() == site;
+
+		if(!seen) {
+			u32 index = siteCount.fetch_add(1);
+			if(index < MaxReports) {
+				sites[index] = site;
+				fprintf(stderr, "Realtime violation: %s in %s\n", kindNames[kind], sectionName);
+				backtrace_symbols_fd(frames + 2, frameCount - 2, 2);
+			}
+		}
+
+		reporting = false;
+	}
+
+	inline bool Checking() {
+		return depth > 0 && !reporting;
+	}
+
+	template<class F>
+	F Real(std::atomic<F>& fn, const char* name) {
+		auto f = fn.load(std::memory_order_relaxed);
+		if(!f) {
+			f = (F) dlsym(RTLD_NEXT, name);
+			fn.store(f, std::memory_order_relaxed);
+		}
+
+		return f;
+	}
+
+	std::atomic<int (*)(pthread_mutex_t*)> realLock;
+	std::atomic<int (*)(const char*, int, ...)> realOpen;
+	std::atomic<int (*)(const char*, int, ...)> realOpen64;
+	std::atomic<ssize_t (*)(int, void*, size_t)> realRead;
+	std::atomic<ssize_t (*)(int, const void*, size_t)> realWrite;
+	std::atomic<int (*)(int)> realClose;
+	std::atomic<size_t (*)(void*, size_t, size_t, FILE*)> realFread;
+	std::atomic<size_t (*)(const void*, size_t, size_t, FILE*)> realFwrite;
+}
+
+void BeginRealtimeSection(const char* name) {
+	if(depth++ > 0) return;
+
+	sectionName = name;
+	sectionViolations = 0;
+}
+
+void EndRealtimeSection() {
+	if(--depth > 0) return;
+
+	sections.fetch_add(1, std::memory_order_relaxed);
+	if(sectionViolations == 0) return;
+
+	u32 max = maxPerSection.load();
+	while(sectionViolations > max && !maxPerSection.compare_exchange_weak(max, sectionViolations));
+
+	if(failedSections.fetch_add(1) < MaxReports) {
+		reporting = true;
+		fprintf(stderr, "%u realtime violations in %s\n", sectionViolations, sectionName);
+		reporting = false;
+	}
+}
+
+void BeginAllowedLock() {
+	allowedLocks++;
+}
+
+void EndAllowedLock() {
+	allowedLocks--;
+}
+
+RealtimeViolations GetRealtimeViolations() {
+	RealtimeViolations v {};
+	v.sections = sections.load();
+	v.failedSections = failedSections.load();
+	v.allocations = counts[KindAllocation].load();
+	v.frees = counts[KindFree].load();
+	v.locks = counts[KindLock].load();
+	v.io = counts[KindIO].load();
+	v.maxPerSection = maxPerSection.load();
+	return v;
+}
+
+}
+
+using namespace synth;
+
+// Replacing malloc and friends is supported by glibc, the originals stay reachable
+//	through their __libc_ names. Everything else is forwarded through dlsym. stdio
+//	doesn't go through read and write, so its entry points are checked separately
+extern "C" {
+	void* __libc_malloc(size_t);
+	void* __libc_calloc(size_t, size_t);
+	void* __libc_realloc(void*, size_t);
+	void __libc_free(void*);
+
+	void* malloc(size_t size) {
+		if(Checking()) Report(KindAllocation);
+		return __libc_malloc(size);
+	}
+
+	void* calloc(size_t count, size_t size) {
+		if(Checking()) Report(KindAllocation);
+		return __libc_calloc(count, size);
+	}
+
+	void* realloc(void* p, size_t size) {
+		if(Checking()) Report(KindAllocation);
+		return __libc_realloc(p, size);
+	}
+
+	void free(void* p) {
+		if(p && Checking()) Report(KindFree);
+		__libc_free(p);
+	}
+
+	// Reported whether or not it waits, so that a run doesn't depend on timing
+	int pthread_mutex_lock(pthread_mutex_t* m) {
+		if(Checking() && allowedLocks == 0) Report(KindLock);
+		return Real(realLock, "pthread_mutex_lock")(m);
+	}
+
+	int open(const char* path, int flags, ...) {
+		va_list args;
+		va_start(args, flags);
+		mode_t mode = (flags & (O_CREAT|O_TMPFILE))? va_arg(args, mode_t) : 0;
+		va_end(args);
+
+		if(Checking()) Report(KindIO);
+		return Real(realOpen, "open")(path, flags, mode);
+	}
+
+	int open64(const char* path, int flags, ...) {
+		va_list args;
+		va_start(args, flags);
+		mode_t mode = (flags & (O_CREAT|O_TMPFILE))? va_arg(args, mode_t) : 0;
+		va_end(args);
+
+		if(Checking()) Report(KindIO);
+		return Real(realOpen64, "open64")(path, flags, mode);
+	}
+
+	ssize_t read(int fd, void* buffer, size_t size) {
+		if(Checking()) Report(KindIO);
+		return Real(realRead, "read")(fd, buffer, size);
+	}
+
+	ssize_t write(int fd, const void* buffer, size_t size) {
+		if(Checking()) Report(KindIO);
+		return Real(realWrite, "write")(fd, buffer, size);
+	}
+
+	int close(int fd) {
+		if(Checking()) Report(KindIO);
+		return Real(realClose, "close")(fd);
+	}
+
+	size_t fread(void* buffer, size_t size, size_t count, FILE* file) {
+		if(Checking()) Report(KindIO);
+		return Real(realFread, "fread")(buffer, size, count, file);
+	}
+
+	size_t fwrite(const void* buffer, size_t size, size_t count, FILE* file) {
+		if(Checking()) Report(KindIO);
+		return Real(realFwrite, "fwrite")(buffer, size, count, file);
+	}
+}
+
+#endif
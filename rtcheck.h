@@ -0,0 +1,63 @@
+#ifndef RTCHECK_H
+#define RTCHECK_H
+
+#include "common.h"
+
+#include <mutex>
+
+namespace synth {
+
+// Debug mode that catches threads which mustn't wait allocating, freeing, blocking
+//	on a mutex or doing file I/O. Only compiled in with SYNTH_RT_CHECK defined, in
+//	which case malloc, free, pthread_mutex_lock, open, read, write and close are
+//	intercepted (glibc only). Every lock counts, whether or not it happens to be
+//	contended, except those taken through AllowedRealtimeLock. The first few call
+//	sites are logged with a backtrace.
+struct RealtimeViolations {
+	u64 sections;       // Realtime sections run, e.g., audio callbacks
+	u64 failedSections; // Sections with at least one violation
+	u64 allocations;
+	u64 frees;
+	u64 locks;
+	u64 io;
+	u32 maxPerSection;
+};
+
+#ifdef SYNTH_RT_CHECK
+void BeginRealtimeSection(const char* name);
+void EndRealtimeSection();
+void BeginAllowedLock();
+void EndAllowedLock();
+RealtimeViolations GetRealtimeViolations();
+#else
+inline void BeginRealtimeSection(const char*) {}
+inline void EndRealtimeSection() {}
+inline void BeginAllowedLock() {}
+inline void EndAllowedLock() {}
+inline RealtimeViolations GetRealtimeViolations() { return {}; }
+#endif
+
+// Marks the calling thread as realtime for the rest of a scope. Sections can nest
+struct RealtimeSection {
+	RealtimeSection(const char* name) { BeginRealtimeSection(name); }
+	~RealtimeSection() { EndRealtimeSection(); }
+};
+
+// A lock_guard whose lock isn't reported. Only for mutexes other threads hold
+//	for short, bounded work, and that a realtime thread can't do without, e.g., a
+//	synth's mutex, which scripts take to change a control
+struct AllowedRealtimeLock {
+	std::mutex& mutex;
+
+	AllowedRealtimeLock(std::mutex& m) : mutex{m} {
+		BeginAllowedLock();
+		mutex.lock();
+		EndAllowedLock();
+	}
+
+	~AllowedRealtimeLock() { mutex.unlock(); }
+};
+
+}
+
+#endif
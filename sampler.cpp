@@ -0,0 +1,558 @@
+#include "sampler.h"
+#include "synth.h"
+#include "denormal.h"
+
+#include <sndfile.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace synth {
+
+namespace {
+	// Reads a byte of every page holding frames [first, last), so that the page faults
+	//	(and the disk reads behind them) happen on the calling thread
+	void TouchFrames(const SampleFile* s, u64 first, u64 last, bool loop) {
+		enum { PageSize = 4096 }; // Or a fraction of it, which touches some pages twice
+
+		auto begin = (const u8*) s->mapping;
+		volatile u8 sink = 0;
+
+		while(first < last) {
+			u64 frame = loop? first % s->frames : first;
+			if(frame >= s->frames) break;
+
+			u64 count = std::min(last - first, s->frames - frame);
+			auto p = s->data + frame * s->frameBytes;
+			auto end = p + count * s->frameBytes;
+			auto page = begin + (p - begin) / PageSize * PageSize;
+
+#ifndef _WIN32
+			// Lets the kernel read the range in larger requests than one fault at a time
+			madvise((void*) page, end - page, MADV_WILLNEED);
+#endif
+
+			for(; page < end; page += PageSize)
+				sink = sink + *page;
+
+			first += count;
+		}
+	}
+}
+
+// Refills the rings of streamed sampler voices, and faults in the pages of mapped
+//	voices ahead of where they play
+struct SampleStreamer {
+	enum { ChunkFrames = 1024 };
+	static constexpr f32 PrefetchSeconds = 0.5f; // At the sample's own rate
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::vector<SamplerVoice*> voices;
+	std::vector<f32> scratch;
+	bool running = false;
+
+	~SampleStreamer() {
+		if(!thread.joinable()) return;
+
+		{
+			std::lock_guard<std::mutex> l(mutex);
+			running = false;
+		}
+
+		wake.notify_one();
+		thread.join();
+	}
+
+	void Register(SamplerVoice* v) {
+		std::lock_guard<std::mutex> l(mutex);
+		voices.push_back(v);
+
+		if(!running) {
+			running = true;
+			thread = std::thread{[this]{ Run(); }};
+		}
+	}
+
+	// Blocks while the disk thread is busy, so v is never referenced once this returns
+	void Unregister(SamplerVoice* v) {
+		std::lock_guard<std::mutex> l(mutex);
+		voices.erase(std::remove(voices.begin(), voices.end(), v), voices.end());
+	}
+
+	void Run() {
+		EnableFlushToZero();
+
+		std::unique_lock<std::mutex> l(mutex);
+
+		while(running) {
+			for(auto v: voices) {
+				if(v->stream) Fill(v);
+				else Prefetch(v);
+			}
+
+			// Rings hold far more than this, and Start notifies
+			wake.wait_for(l, std::chrono::milliseconds(5));
+		}
+	}
+
+	// Touching a page that's already resident is cheap, so the window is simply
+	//	restarted at the play position whenever that jumped, e.g., looped
+	void Prefetch(SamplerVoice* v) {
+		constexpr u64 frameMask = (1ull<<SamplerVoice::GenerationShift) - 1;
+
+		u64 request = v->seek.load(std::memory_order_acquire);
+		u32 generation = request >> SamplerVoice::GenerationShift;
+		if(generation == 0 || !v->sample->frames)
+			return;
+
+		u64 consumed = v->consumed.load(std::memory_order_acquire);
+		u64 ahead = u64(PrefetchSeconds * v->sample->sampleRate);
+
+		if(generation != v->diskGeneration) {
+			v->diskGeneration = generation;
+			v->diskFrame = request & frameMask;
+		}
+
+		if(v->diskFrame < consumed || v->diskFrame > consumed + ahead)
+			v->diskFrame = consumed;
+
+		u64 limit = consumed + ahead;
+		if(v->diskFrame >= limit)
+			return;
+
+		TouchFrames(v->sample.get(), v->diskFrame, limit, v->looping.load(std::memory_order_relaxed));
+		v->diskFrame = limit;
+	}
+
+	void Fill(SamplerVoice* v) {
+		constexpr u64 frameMask = (1ull<<SamplerVoice::GenerationShift) - 1;
+
+		u64 request = v->seek.load(std::memory_order_acquire);
+		u32 generation = request >> SamplerVoice::GenerationShift;
+
+		// Voices that have never been started have nothing to read ahead
+		if(generation == 0 || !v->sample->frames)
+			return;
+
+		if(generation != v->diskGeneration) {
+			v->diskGeneration = generation;
+			v->diskFrame = request & frameMask;
+		}
+
+		auto sample = v->sample.get();
+		u64 limit = v->consumed.load(std::memory_order_acquire) + SamplerVoice::RingSize;
+		u64 fileFrame = ~0ull;
+
+		scratch.resize(ChunkFrames * sample->channels);
+
+		while(v->diskFrame < limit) {
+			bool loop = v->looping.load(std::memory_order_relaxed);
+			u64 frame = loop? v->diskFrame % sample->frames : v->diskFrame;
+			u64 ringFrame = v->diskFrame % SamplerVoice::RingSize;
+
+			u64 count = std::min<u64>(limit - v->diskFrame, ChunkFrames);
+			count = std::min<u64>(count, SamplerVoice::RingSize - ringFrame);
+
+			f32* dst = &v->ring[ringFrame];
+
+			if(frame >= sample->frames) {
+				std::fill_n(dst, count, 0.f);
+
+			}else{
+				count = std::min<u64>(count, sample->frames - frame);
+
+				if(frame != fileFrame)
+					sf_seek(v->stream, frame, SEEK_SET);
+
+				u64 read = sf_readf_float(v->stream, scratch.data(), count);
+				for(u64 i = 0; i < read; i++) {
+					f32 sum = 0.f;
+					for(u32 c = 0; c < sample->channels; c++)
+						sum += scratch[i*sample->channels + c];
+
+					dst[i] = sum / sample->channels;
+				}
+
+				std::fill(dst + read, dst + count, 0.f);
+				fileFrame = frame + count;
+			}
+
+			v->diskFrame += count;
+			v->filled.store(u64(generation) << SamplerVoice::GenerationShift | v->diskFrame, std::memory_order_release);
+		}
+	}
+};
+
+namespace {
+	struct SampleEntry {
+		std::string path;
+		f32 preloadTime;
+		std::shared_ptr<const SampleFile> file;
+	};
+
+	std::mutex registryMutex;
+	std::map<std::string, SampleEntry> samples;
+
+	SampleStreamer streamer;
+
+	template<class T>
+	T ReadLE(const u8* p) {
+		T v = 0;
+		for(u32 i = 0; i < sizeof(T); i++)
+			v |= T(p[i]) << (i*8);
+
+		return v;
+	}
+
+	bool MapFile(SampleFile* s) {
+#ifdef _WIN32
+		auto file = CreateFileA(s->path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if(file == INVALID_HANDLE_VALUE) return false;
+
+		LARGE_INTEGER size;
+		GetFileSizeEx(file, &size);
+		auto map = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		CloseHandle(file);
+		if(!map) return false;
+
+		s->mapping = MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+		s->mappingSize = size.QuadPart;
+		CloseHandle(map);
+		return s->mapping != nullptr;
+#else
+		int fd = open(s->path.c_str(), O_RDONLY);
+		if(fd < 0) return false;
+
+		struct stat st;
+		if(fstat(fd, &st) < 0 || st.st_size == 0) {
+			close(fd);
+			return false;
+		}
+
+		void* mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if(mapping == MAP_FAILED) return false;
+
+		s->mapping = mapping;
+		s->mappingSize = st.st_size;
+		return true;
+#endif
+	}
+
+	void UnmapFile(SampleFile* s) {
+		if(!s->mapping) return;
+
+#ifdef _WIN32
+		UnmapViewOfFile(s->mapping);
+#else
+		munmap(s->mapping, s->mappingSize);
+#endif
+		s->mapping = nullptr;
+	}
+
+	// Finds the sample data of WAVs that can be read in place
+	bool ParseWav(SampleFile* s) {
+		auto p = (const u8*) s->mapping;
+		auto end = p + s->mappingSize;
+
+		if(s->mappingSize < 12 || memcmp(p, "RIFF", 4) || memcmp(p+8, "WAVE", 4))
+			return false;
+
+		u16 format = 0, bits = 0;
+		bool haveFormat = false;
+
+		for(p += 12; p + 8 <= end;) {
+			u32 size = ReadLE<u32>(p+4);
+			auto chunk = p + 8;
+			if(size > u64(end - chunk)) size = end - chunk;
+
+			if(!memcmp(p, "fmt ", 4) && size >= 16) {
+				format = ReadLE<u16>(chunk);
+				s->channels = ReadLE<u16>(chunk+2);
+				s->sampleRate = ReadLE<u32>(chunk+4);
+				bits = ReadLE<u16>(chunk+14);
+
+				// WAVE_FORMAT_EXTENSIBLE keeps the real format at the start of the sub format GUID
+				if(format == 0xFFFE && size >= 26)
+					format = ReadLE<u16>(chunk+24);
+
+				haveFormat = true;
+
+			}else if(!memcmp(p, "data", 4) && haveFormat) {
+				if(format == 1 && bits == 16) s->encoding = SampleFile::EncodingPCM16;
+				else if(format == 1 && bits == 24) s->encoding = SampleFile::EncodingPCM24;
+				else if(format == 3 && bits == 32) s->encoding = SampleFile::EncodingFloat;
+				else return false;
+
+				if(!s->channels) return false;
+
+				s->data = chunk;
+				s->frameBytes = bits/8 * s->channels;
+				s->frames = size / s->frameBytes;
+				return true;
+			}
+
+			p = chunk + size + (size&1);
+		}
+
+		return false;
+	}
+
+	bool OpenStreamed(SampleFile* s, f32 preloadTime) {
+		SF_INFO info {};
+		auto file = sf_open(s->path.c_str(), SFM_READ, &info);
+		if(!file) return false;
+
+		s->encoding = SampleFile::EncodingStreamed;
+		s->sampleRate = info.samplerate;
+		s->channels = info.channels;
+		s->frames = info.frames;
+
+		u64 preloadFrames = std::min<u64>(preloadTime * info.samplerate, info.frames);
+		std::vector<f32> interleaved(preloadFrames * info.channels);
+		preloadFrames = sf_readf_float(file, interleaved.data(), preloadFrames);
+		sf_close(file);
+
+		s->preload.resize(preloadFrames);
+		for(u64 i = 0; i < preloadFrames; i++) {
+			f32 sum = 0.f;
+			for(s32 c = 0; c < info.channels; c++)
+				sum += interleaved[i*info.channels + c];
+
+			s->preload[i] = sum / info.channels;
+		}
+
+		return true;
+	}
+}
+
+SampleFile::~SampleFile() {
+	UnmapFile(this);
+}
+
+f32 SampleFile::Read(u64 frame) const {
+	f32 sum = 0.f;
+
+	switch(encoding) {
+		case EncodingPCM16: {
+			auto p = data + frame*channels*2;
+			for(u32 c = 0; c < channels; c++)
+				sum += s16(ReadLE<u16>(p + c*2)) / 32768.f;
+		}	break;
+		case EncodingPCM24: {
+			auto p = data + frame*channels*3;
+			for(u32 c = 0; c < channels; c++) {
+				// Shifted into the top of an s32 to sign extend
+				u32 v = u32(p[c*3]) << 8 | u32(p[c*3+1]) << 16 | u32(p[c*3+2]) << 24;
+				sum += s32(v) / 2147483648.f;
+			}
+		}	break;
+		case EncodingFloat: {
+			auto p = data + frame*channels*4;
+			for(u32 c = 0; c < channels; c++) {
+				f32 v;
+				memcpy(&v, p + c*4, 4);
+				sum += v;
+			}
+		}	break;
+
+		default: return 0.f;
+	}
+
+	return sum / channels;
+}
+
+void RegisterSample(const char* name, const char* path, f32 preloadTime) {
+	std::lock_guard<std::mutex> l(registryMutex);
+	samples[name] = SampleEntry{path, preloadTime, nullptr};
+}
+
+std::shared_ptr<const SampleFile> OpenSample(const char* name) {
+	std::lock_guard<std::mutex> l(registryMutex);
+
+	auto it = samples.find(name);
+	if(it == samples.end()) {
+		printf("Sample '%s' isn't registered\n", name);
+		return nullptr;
+	}
+
+	auto& entry = it->second;
+	if(entry.file)
+		return entry.file;
+
+	auto s = std::make_shared<SampleFile>();
+	s->name = name;
+	s->path = entry.path;
+	s->preloadTime = entry.preloadTime;
+	s->mapping = nullptr;
+	s->data = nullptr;
+
+	bool mapped = MapFile(s.get()) && ParseWav(s.get());
+	if(!mapped) {
+		UnmapFile(s.get());
+
+		if(!OpenStreamed(s.get(), entry.preloadTime)) {
+			printf("Failed to open sample '%s': %s\n", entry.path.c_str(), sf_strerror(nullptr));
+			return nullptr;
+		}
+	}else{
+		// Playback mostly starts at the beginning, before the disk thread can get ahead
+		TouchFrames(s.get(), 0, u64(entry.preloadTime * s->sampleRate), false);
+	}
+
+	entry.file = s;
+	return s;
+}
+
+bool ReadSampleFile(const char* path, std::vector<f32>& out, u32* sampleRate) {
+	SF_INFO info {};
+	auto file = sf_open(path, SFM_READ, &info);
+	if(!file) {
+		printf("Failed to open '%s': %s\n", path, sf_strerror(nullptr));
+		return false;
+	}
+
+	std::vector<f32> interleaved(info.frames * info.channels);
+	u64 frames = sf_readf_float(file, interleaved.data(), info.frames);
+	sf_close(file);
+
+	out.resize(frames);
+	for(u64 i = 0; i < frames; i++) {
+		f32 sum = 0.f;
+		for(s32 c = 0; c < info.channels; c++)
+			sum += interleaved[i*info.channels + c];
+
+		out[i] = sum / info.channels;
+	}
+
+	if(sampleRate)
+		*sampleRate = info.samplerate;
+
+	return true;
+}
+
+bool SamplerVoice::Init(std::shared_ptr<const SampleFile> s) {
+	sample = std::move(s);
+	position = 0.0;
+	playing = false;
+	stream = nullptr;
+	generation = 0;
+	underruns = 0;
+	registered = false;
+	diskGeneration = 0;
+	diskFrame = 0;
+
+	seek = 0;
+	filled = 0;
+	consumed = 0;
+	looping = false;
+
+	if(sample->encoding == SampleFile::EncodingStreamed) {
+		SF_INFO info {};
+		stream = sf_open(sample->path.c_str(), SFM_READ, &info);
+		if(!stream) {
+			printf("Failed to open sample '%s': %s\n", sample->path.c_str(), sf_strerror(nullptr));
+			return false;
+		}
+
+		ring.assign(RingSize, 0.f);
+	}
+
+	streamer.Register(this);
+	registered = true;
+	return true;
+}
+
+void SamplerVoice::Deinit() {
+	if(registered) {
+		streamer.Unregister(this);
+		registered = false;
+	}
+
+	if(stream) {
+		sf_close(stream);
+		stream = nullptr;
+	}
+
+	sample = nullptr;
+}
+
+void SamplerVoice::Start(f32 seconds) {
+	position = std::max(seconds, 0.f) * sample->sampleRate;
+	playing = true;
+
+	u64 frame = u64(position);
+	// Generation 0 is reserved for voices that haven't started
+	generation = (generation + 1) & ((1u<<(64-GenerationShift)) - 1);
+	if(generation == 0) generation = 1;
+
+	consumed.store(frame, std::memory_order_relaxed);
+	seek.store(u64(generation) << GenerationShift | frame, std::memory_order_release);
+	streamer.wake.notify_one();
+}
+
+f32 SamplerVoice::Process(f64 step, bool loop) {
+	if(!playing || !sample->frames)
+		return 0.f;
+
+	if(!loop && position >= sample->frames) {
+		playing = false;
+		return 0.f;
+	}
+
+	u64 frame = u64(position);
+	f32 frac = position - frame;
+	f32 a = Frame(frame, loop);
+	f32 b = Frame(frame+1, loop);
+
+	position += std::max(step, 0.0);
+
+	looping.store(loop, std::memory_order_relaxed);
+	consumed.store(frame, std::memory_order_release);
+
+	if(!stream && loop && position >= sample->frames) {
+		// Mapped samples don't need virtual positions, wrapping keeps precision
+		position = std::fmod(position, f64(sample->frames));
+	}
+
+	return a + (b - a) * frac;
+}
+
+f32 SamplerVoice::Frame(u64 virtualFrame, bool loop) {
+	u64 frame = loop? virtualFrame % sample->frames : virtualFrame;
+	if(frame >= sample->frames)
+		return 0.f;
+
+	if(!stream)
+		return sample->Read(frame);
+
+	if(frame < sample->preload.size())
+		return sample->preload[frame];
+
+	constexpr u64 frameMask = (1ull<<GenerationShift) - 1;
+	u64 state = filled.load(std::memory_order_acquire);
+	u64 filledFrame = state & frameMask;
+
+	if((state >> GenerationShift) != generation || virtualFrame >= filledFrame || virtualFrame + RingSize < filledFrame) {
+		underruns++;
+		return 0.f;
+	}
+
+	return ring[virtualFrame % RingSize];
+}
+
+}
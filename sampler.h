@@ -0,0 +1,93 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include "common.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+typedef struct SNDFILE_tag SNDFILE;
+
+namespace synth {
+
+// Sample files are only opened the first time a sampler uses them. Uncompressed
+//	WAVs (16/24 bit PCM and float) are memory mapped and read in place, so only the
+//	pages that are actually played become resident. The audio thread mustn't be the
+//	one to fault them in, so the first preloadTime seconds are touched when the file
+//	is opened, and the disk thread touches pages ahead of every playing voice.
+//	Anything else libsndfile can read is streamed by the disk thread, with the first
+//	preloadTime seconds decoded up front so that playback can start before the disk
+//	thread catches up.
+struct SampleFile {
+	enum Encoding : u8 {
+		EncodingPCM16,
+		EncodingPCM24,
+		EncodingFloat,
+		EncodingStreamed,
+	};
+
+	std::string name; // As registered
+	std::string path;
+	f32 preloadTime;
+	u32 sampleRate;
+	u32 channels;
+	u64 frames;
+	Encoding encoding;
+	u32 frameBytes; // Mapped files only
+
+	void* mapping;
+	size_t mappingSize;
+	const u8* data; // Start of the interleaved frames in the mapping
+
+	std::vector<f32> preload; // Mono, streamed files only
+
+	~SampleFile();
+
+	f32 Read(u64 frame) const; // Mono mix of a mapped frame
+};
+
+std::shared_ptr<const SampleFile> OpenSample(const char* name);
+
+// Reads a whole file as mono, e.g., for impulse responses
+bool ReadSampleFile(const char* path, std::vector<f32>& samples, u32* sampleRate = nullptr);
+
+// Playback state for one sampler node. Streamed files get their own file handle
+//	and a ring of decoded frames, refilled by the disk thread ahead of the play
+//	position. Positions are virtual frames which keep counting across loops, so the
+//	disk thread can read ahead across the loop point.
+struct SamplerVoice {
+	enum { RingSize = 1<<14, GenerationShift = 40 };
+
+	std::shared_ptr<const SampleFile> sample;
+	f64 position;
+	bool playing;
+
+	SNDFILE* stream;
+	std::vector<f32> ring;
+	u32 generation;
+	u64 underruns;
+	bool registered; // With the disk thread, which either streams or prefetches
+
+	std::atomic<u64> seek;     // generation << GenerationShift | virtual frame to fill from
+	std::atomic<u64> filled;   // generation << GenerationShift | virtual frame filled up to
+	std::atomic<u64> consumed; // Virtual frame below which the ring can be overwritten
+	std::atomic<bool> looping;
+
+	// Only touched by the disk thread
+	u32 diskGeneration;
+	u64 diskFrame;
+
+	bool Init(std::shared_ptr<const SampleFile>);
+	void Deinit();
+
+	void Start(f32 seconds);
+	f32 Process(f64 step, bool loop); // step: frames of the sample per output sample
+
+private:
+	f32 Frame(u64 virtualFrame, bool loop);
+};
+
+}
+
+#endif
@@ -1,7 +1,21 @@
 #include "synth.h"
+#include "mixer.h"
+#include "convolution.h"
+#include "sampler.h"
+#include "filter.h"
+#include "denormal.h"
+#include "noise.h"
+#include "resampler.h"
+#include "rtcheck.h"
+#include "profile.h"
+#include "trace.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <deque>
+#include <unordered_map>
 
 #include <SDL2/SDL.h>
 
@@ -69,28 +83,169 @@ namespace {
 namespace synth {
 
 namespace {
-	SDL_AudioDeviceID dev;
-	std::vector<Synth*> synths;
-	std::mutex synthMutex;
+	struct Bus {
+		const char* name;
+		Synth* graph; // Effects applied to the summed input
+		Synth* staged; // Replaces graph once a reload is committed
+		std::vector<f32> input;
+	};
+
+	// Handles are generation << HandleIndexBits | slot index
+	enum {
+		HandleIndexBits = 16,
+		SlotChunkSize = 256,
+		MaxSlotChunks = (1<<HandleIndexBits) / SlotChunkSize,
+		MaxBuses = 64,
+		MaxSharedNodes = 64,
+	};
+
+	struct SynthSlot {
+		std::atomic<u32> handle; // 0 while free
+		std::atomic<Synth*> synth;
+		u32 generation;
+	};
+
+	using SynthList = std::vector<Synth*>;
+
+	// Written by the audio thread only, read lock free
+	struct LatencyRecorder {
+		std::atomic<u64> count;
+		std::atomic<u64> totalNs;
+		std::atomic<u64> maxNs;
+		std::atomic<u64> buckets[LatencyBuckets];
+
+		void Record(u64 ns) {
+			u32 bucket = std::min<u64>(ns / u64(LatencyBucketSeconds * 1e9), LatencyBuckets-1);
+			buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+			totalNs.fetch_add(ns, std::memory_order_relaxed);
+			if(ns > maxNs.load(std::memory_order_relaxed))
+				maxNs.store(ns, std::memory_order_relaxed);
+
+			count.fetch_add(1, std::memory_order_release);
+		}
 
-	u32 sampleRate;
-	f32 envelope;
-	f32 signalDC;
-	AudioPostNormalizeHook* bufferReadHook;
-	AudioPostProcessHook* bufferPostProcessHook;
-	SynthPostProcessHook* synthPostProcessHook;
-	// TODO: Move state to audio context
+		void Load(LatencyHistogram* h) const {
+			h->count = count.load(std::memory_order_acquire);
+			h->totalSeconds = totalNs.load(std::memory_order_relaxed) / 1e9;
+			h->maxSeconds = maxNs.load(std::memory_order_relaxed) / 1e9;
+			for(u32 i = 0; i < LatencyBuckets; i++)
+				h->buckets[i] = buckets[i].load(std::memory_order_relaxed);
+		}
+	};
+
+	u64 SteadyNow() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
 
+	// Freed once the audio thread has finished the block it was rendering at epoch
+	struct Retired {
+		u64 epoch;
+		SynthList* list;
+		Synth* synth;
+	};
+
+	// Read only once initialised, so shared by every context
 	Wavetable sinTable;
 	Wavetable triangleTable;
 	Wavetable sawTable;
-	Wavetable noiseTable;
+	constexpr u32 wavetableSize = 1<<13;
+	std::once_flag wavetablesInitialised;
 }
 
+struct AudioContext {
+	SDL_AudioDeviceID dev;
+
+	// Only taken by threads creating and destroying synths, never by the audio thread
+	std::mutex registryMutex;
+
+	// Slots only ever get added, so handles can be looked up without locking. Freed
+	//	slots are reused oldest first, each time with a new generation
+	std::atomic<SynthSlot*> slotChunks[MaxSlotChunks];
+	std::atomic<u32> slotCount;
+	std::deque<u32> freeSlots;
+
+	// The synths rendered each block. The list is replaced rather than modified,
+	//	and replaced lists and removed synths are only freed once no block that
+	//	could have seen them is still being rendered
+	std::atomic<SynthList*> renderList;
+	std::atomic<u64> renderEpoch; // Odd while a block is being rendered
+	std::vector<Retired> retired;
+
+	// Buses are never removed, so they're published by bumping busCount
+	Bus* buses[MaxBuses];
+	std::atomic<u32> busCount;
+
+	AudioConfig config;
+	std::vector<f32> blockBuffer; // The last rendered block, stereo
+	std::vector<f32> intermediate; // Output of a single synth for one block
+	u32 blockRead; // Frames of blockBuffer already sent to the device
+	Limiter limiter;
+	std::atomic<u32> limiterLookahead;
+	std::atomic<bool> denormalCheck;
+	bool checkDenormals; // denormalCheck for the current callback
+	std::atomic<bool> nodeProfiling;
+	bool profileNodes; // nodeProfiling for the current callback
+	u64 profileInputTicks; // Ticks spent in the inputs of the node being evaluated
+	u64 profileBeginTicks; // Calibrates ticks against profileBeginTime
+	std::chrono::steady_clock::time_point profileBeginTime;
+
+	// Written by the audio thread (retiredSynths by UpdateAudio), see GetAudioMetrics
+	std::atomic<u64> callbacks;
+	std::atomic<u64> xruns;
+	std::atomic<f64> lastCallbackSeconds;
+	std::atomic<f64> lastPeriodSeconds;
+	std::atomic<f32> lastLoad;
+	std::atomic<f32> averageLoad;
+	std::atomic<f32> peakLoad;
+	std::atomic<u32> activeSynths;
+	std::atomic<u32> idleSynths;
+	std::atomic<u32> fadingSynths;
+	std::atomic<u32> retiredSynths;
+	std::atomic<u64> durationHistogram[MetricsHistogramBuckets];
+
+	// Where the block being rendered sits in time, for trigger latencies
+	u64 callbackBegin; // Steady clock ns
+	u32 callbackFrames; // Frames of the current callback written before the block
+	LatencyRecorder pickupLatency;
+	LatencyRecorder outputLatency;
+	AudioPostNormalizeHook* bufferReadHook;
+	AudioPostProcessHook* bufferPostProcessHook;
+	SynthPostProcessHook* synthPostProcessHook;
+
+	Synth* sharedSynth;
+	std::vector<u32> sharedNodes; // Nodes of sharedSynth readable by other synths
+	std::vector<f32> sharedOutputs; // One block of samples per shared node
+	u32 sharedOutputCount;
+	u32 blockPosition;
+	u32 blockLength;
+	u64 blockFrame; // Frames rendered before the current block
+	std::atomic<u64> renderedFrames; // The context's clock, see GetAudioTime
+
+	u32 synthSerial; // Default noise seeds, so the same script always sounds the same
+
+	// Hot reload, see BeginSynthReload. Only touched by the reloading thread
+	bool reloading;
+	std::vector<Synth*> stagedSynths; // In creation order
+	Synth* stagedShared;
+	std::vector<u32> stagedSharedNodes;
+	u32 reloadBusCount; // Buses that existed before the reload
+};
+
 void audio_callback(void* ud, u8* stream, s32 len);
 
-Synth* CreateSynth() {
-	auto s = new Synth{};
+// Everything else in the graph goes with the arena
+Synth::~Synth() {
+	for(auto c: convolvers)
+		c->Deinit();
+
+	for(auto v: samplers)
+		v->Deinit();
+
+	delete resampler;
+}
+
+void InitSynth(AudioContext* ctx, Synth* s) {
+	s->context = ctx;
 	s->flags = 0;
 	s->globalTrigger.name = "<global>";
 	s->globalTrigger.state = 1;
@@ -100,27 +255,790 @@ Synth* CreateSynth() {
 	s->beginGain = 0.f;
 	s->targetGain = 1.f;
 
-	std::lock_guard<std::mutex> guard{synthMutex};
-	s->id = synths.size();
-	synths.push_back(s);
+	s->bus = ~0u;
+	s->send = 1.f;
+
+	s->noiseSeed = HashSeed(0, ctx->synthSerial++);
+
+	s->rateDivider = 1;
+	s->resampler = nullptr;
+
+	s->profiledFrames = 0;
+	s->submittedAt = 0;
+	s->scheduleHead = 0;
+}
+
+SynthSlot* GetSlot(AudioContext* ctx, u32 index) {
+	auto chunk = ctx->slotChunks[index / SlotChunkSize].load(std::memory_order_acquire);
+	return &chunk[index % SlotChunkSize];
+}
+
+// Assigns s->id. Must hold registryMutex, or be the only thread using ctx
+bool RegisterSynth(AudioContext* ctx, Synth* s) {
+	u32 index;
+
+	if(!ctx->freeSlots.empty()) {
+		index = ctx->freeSlots.front();
+		ctx->freeSlots.pop_front();
+	}else{
+		index = ctx->slotCount.load(std::memory_order_relaxed);
+		if(index >= SlotChunkSize*MaxSlotChunks) {
+			printf("Too many synths\n");
+			return false;
+		}
+
+		if(index % SlotChunkSize == 0)
+			ctx->slotChunks[index / SlotChunkSize].store(new SynthSlot[SlotChunkSize]{}, std::memory_order_release);
+
+		ctx->slotCount.store(index+1, std::memory_order_release);
+	}
+
+	auto slot = GetSlot(ctx, index);
+
+	// Generation 0 is skipped so that 0 is never a valid handle
+	slot->generation = (slot->generation + 1) & ((1u<<(32-HandleIndexBits))-1);
+	if(slot->generation == 0)
+		slot->generation = 1;
+
+	s->id = slot->generation << HandleIndexBits | index;
+	slot->synth.store(s, std::memory_order_relaxed);
+	slot->handle.store(s->id, std::memory_order_release);
+	return true;
+}
+
+// Must hold registryMutex
+void UnregisterSynth(AudioContext* ctx, Synth* s) {
+	u32 index = s->id & ((1u<<HandleIndexBits)-1);
+	auto slot = GetSlot(ctx, index);
+	slot->handle.store(0, std::memory_order_release);
+	slot->synth.store(nullptr, std::memory_order_relaxed);
+	ctx->freeSlots.push_back(index);
+}
+
+// Swaps in a new render list and retires the old one. Returns the epoch anything
+//	removed along with the old list has to be retired at. Must hold registryMutex
+u64 PublishRenderList(AudioContext* ctx, SynthList* list) {
+	auto old = ctx->renderList.exchange(list);
+	u64 epoch = ctx->renderEpoch.load();
+	ctx->retired.push_back({epoch, old, nullptr});
+	return epoch;
+}
+
+Synth* CreateSynth(AudioContext* ctx) {
+	auto s = new Synth{};
+	InitSynth(ctx, s);
+
+	std::lock_guard<std::mutex> guard{ctx->registryMutex};
+	if(!RegisterSynth(ctx, s)) {
+		delete s;
+		return nullptr;
+	}
+
+	// Staged synths aren't rendered until the reload is committed
+	if(ctx->reloading) {
+		ctx->stagedSynths.push_back(s);
+		return s;
+	}
+
+	auto list = new SynthList{*ctx->renderList.load()};
+	list->push_back(s);
+	PublishRenderList(ctx, list);
 	return s;
 }
 
-Synth* GetSynth(u32 id) {
-	if(id >= synths.size())
+// Lock free. The synth is only destroyed by UpdateAudio, so the pointer stays
+//	valid on the thread calling UpdateAudio until its next call
+Synth* GetSynth(AudioContext* ctx, u32 handle) {
+	u32 index = handle & ((1u<<HandleIndexBits)-1);
+	if(handle == 0 || index >= ctx->slotCount.load(std::memory_order_acquire))
+		return nullptr;
+
+	auto slot = GetSlot(ctx, index);
+	if(slot->handle.load(std::memory_order_acquire) != handle)
+		return nullptr;
+
+	auto s = slot->synth.load(std::memory_order_acquire);
+
+	// The slot may have been freed and reused in between
+	if(slot->handle.load(std::memory_order_acquire) != handle)
+		return nullptr;
+
+	return s;
+}
+
+std::vector<u32> GetSynthHandles(AudioContext* ctx) {
+	std::lock_guard<std::mutex> guard{ctx->registryMutex};
+
+	std::vector<u32> handles;
+	for(auto s: *ctx->renderList.load())
+		handles.push_back(s->id);
+
+	return handles;
+}
+
+Synth* GetSharedSynth(AudioContext* ctx) {
+	return ctx->reloading? ctx->stagedShared : ctx->sharedSynth;
+}
+
+std::vector<u32> GetSharedNodes(AudioContext* ctx) {
+	auto shared = GetSharedSynth(ctx);
+	std::lock_guard<std::mutex> l(shared->mutex);
+	return ctx->reloading? ctx->stagedSharedNodes : ctx->sharedNodes;
+}
+
+u32 ExportSharedNode(AudioContext* ctx, u32 sharedNode) {
+	auto shared = GetSharedSynth(ctx);
+	auto& sharedNodes = ctx->reloading? ctx->stagedSharedNodes : ctx->sharedNodes;
+
+	std::lock_guard<std::mutex> l(shared->mutex);
+	auto it = std::find(sharedNodes.begin(), sharedNodes.end(), sharedNode);
+	u32 slot = it - sharedNodes.begin();
+	if(it == sharedNodes.end()) {
+		if(slot >= MaxSharedNodes) {
+			printf("Too many shared nodes, only %u can be read by other synths\n", (u32)MaxSharedNodes);
+			return ~0u;
+		}
+
+		sharedNodes.push_back(sharedNode);
+	}
+
+	return slot;
+}
+
+// Must hold registryMutex, or be the only thread using ctx
+Synth* NewSharedGraph(AudioContext* ctx) {
+	auto graph = new Synth{};
+	InitSynth(ctx, graph);
+	graph->flags = Synth::FlagPlaying;
+	RegisterSynth(ctx, graph);
+	return graph;
+}
+
+// Must hold registryMutex
+Synth* NewBusGraph(AudioContext* ctx) {
+	auto graph = new Synth{};
+	InitSynth(ctx, graph);
+	graph->flags = Synth::FlagBus;
+	if(!RegisterSynth(ctx, graph)) {
+		delete graph;
+		return nullptr;
+	}
+
+	return graph;
+}
+
+Synth* GetBus(AudioContext* ctx, const char* name) {
+	std::lock_guard<std::mutex> guard{ctx->registryMutex};
+
+	u32 count = ctx->busCount.load(std::memory_order_relaxed);
+	for(u32 i = 0; i < count; i++) {
+		auto bus = ctx->buses[i];
+		if(strcmp(bus->name, name)) continue;
+
+		// Buses from before a reload get their effects rebuilt off to the side
+		if(ctx->reloading && i < ctx->reloadBusCount) {
+			if(!bus->staged)
+				bus->staged = NewBusGraph(ctx);
+
+			return bus->staged;
+		}
+
+		return bus->graph;
+	}
+
+	if(count >= MaxBuses) {
+		printf("Too many buses, can't create '%s'\n", name);
+		return nullptr;
+	}
+
+	auto graph = NewBusGraph(ctx);
+	if(!graph) return nullptr;
+
+	auto bus = new Bus{};
+	bus->name = strdup(name);
+	bus->graph = graph;
+	bus->input.assign(ctx->blockLength, 0.f);
+
+	ctx->buses[count] = bus;
+	ctx->busCount.store(count+1, std::memory_order_release);
+
+	return bus->graph;
+}
+
+u32 GetBusIndex(AudioContext* ctx, Synth* graph) {
+	u32 count = ctx->busCount.load(std::memory_order_acquire);
+	for(u32 i = 0; i < count; i++)
+		if(ctx->buses[i]->graph == graph || ctx->buses[i]->staged == graph)
+			return i;
+
+	return ~0u;
+}
+
+const char* GetBusName(AudioContext* ctx, u32 bus) {
+	if(bus >= ctx->busCount.load(std::memory_order_acquire))
 		return nullptr;
 
-	return synths[id];
+	return ctx->buses[bus]->name;
+}
+
+void SetSynthSend(Synth* syn, const char* busName, f32 level) {
+	// Buses can't be chained
+	if(syn->flags & Synth::FlagBus)
+		return;
+
+	u32 busID = ~0u;
+	if(busName) {
+		auto graph = GetBus(syn->context, busName);
+		if(!graph) return;
+
+		busID = GetBusIndex(syn->context, graph);
+	}
+
+	std::lock_guard<std::mutex> l(syn->mutex);
+	syn->bus = busID;
+	syn->send = level;
+}
+
+// Empties a vector without touching its storage, which the arena is about to release
+template<class T>
+void ForgetStorage(ArenaVector<T>& v) {
+	ArenaVector<T>{v.get_allocator()}.swap(v);
+}
+
+// Synths that live as long as the audio context are cleared rather than destroyed
+void ClearSynthGraph(Synth* s) {
+	for(auto c: s->convolvers)
+		c->Deinit();
+
+	for(auto v: s->samplers)
+		v->Deinit();
+
+	ForgetStorage(s->nodes);
+	ForgetStorage(s->controls);
+	ForgetStorage(s->triggers);
+	ForgetStorage(s->convolvers);
+	ForgetStorage(s->samplers);
+	ForgetStorage(s->filters);
+	ForgetStorage(s->noises);
+	ForgetStorage(s->origins);
+	s->arena.Reset();
+
+	s->schedule.clear();
+	s->scheduleHead = 0;
 }
 
-void DestroyAllSynths() {
+void DestroyAllSynths(AudioContext* ctx) {
 	using Fl = Synth::Flags;
+	TraceScope trace {"DestroyAllSynths"};
 
-	for(auto s: synths) {
-		if(!s) continue;
+	std::lock_guard<std::mutex> registryGuard{ctx->registryMutex};
 
+	for(auto s: *ctx->renderList.load()) {
 		std::lock_guard<std::mutex> guard{s->mutex};
-		s->flags |= Fl::FlagDeletionRequested;
+		s->flags |= Fl::FlagDeletionRequested | Fl::FlagSharedDetached;
+	}
+
+	// Synths that are still fading out read silence from here on, whatever is
+	//	exported into the slots they bound next
+	std::lock_guard<std::mutex> guard{ctx->sharedSynth->mutex};
+	ClearSynthGraph(ctx->sharedSynth);
+	ctx->sharedNodes.clear();
+
+	// Bus effects will be rebuilt by whatever is reloaded, until then buses pass their input through
+	for(u32 i = 0; i < ctx->busCount; i++) {
+		auto bus = ctx->buses[i];
+		std::lock_guard<std::mutex> guard{bus->graph->mutex};
+		bus->graph->flags &= ~Fl::FlagPlaying;
+		ClearSynthGraph(bus->graph);
+	}
+}
+
+namespace {
+	enum { ReloadPairingWindow = 8 };
+
+	u64 MixKey(u64 key, u64 value) {
+		return key ^ (value + 0x9e3779b97f4a7c15ull + (key << 6) + (key >> 2));
+	}
+
+	u64 HashName(const char* name) {
+		u64 hash = 14695981039346656037ull;
+		for(; *name; name++)
+			hash = (hash ^ u8(*name)) * 1099511628211ull;
+		return hash;
+	}
+
+	u64 HashTrigger(Synth* s, u32 trigger) {
+		if(trigger == ~0u) return HashName(s->globalTrigger.name);
+		return trigger < s->triggers.size()? HashName(s->triggers[trigger].name) : 0;
+	}
+
+	// Inputs past these hold triggers, filters and the like rather than nodes or constants
+	u32 GetSignalInputCount(NodeType type) {
+		switch(type) {
+			case NodeType::SourceSqr:
+			case NodeType::SourceSampler:
+			case NodeType::EffectsBiquad:
+			case NodeType::EffectsStateVariable:
+				return 3;
+
+			case NodeType::SourceSin:
+			case NodeType::SourceTri:
+			case NodeType::SourceSaw:
+			case NodeType::MathAdd:
+			case NodeType::MathSubtract:
+			case NodeType::MathMultiply:
+			case NodeType::MathDivide:
+			case NodeType::MathPow:
+			case NodeType::EffectsLowPass:
+			case NodeType::EffectsHighPass:
+				return 2;
+
+			case NodeType::MathNegate:
+			case NodeType::EnvelopeFade:
+			case NodeType::EffectsConvolution:
+				return 1;
+
+			case NodeType::EnvelopeADSR: return 5;
+			default: return 0;
+		}
+	}
+
+	// What identifies each node of a graph across reloads
+	struct NodeKeys {
+		std::vector<u64> shallow; // Type and configuration, e.g., filter mode or control name
+		std::vector<u64> deep; // shallow and the deep keys of input nodes. Constants are left out
+		std::vector<u64> sorted; // deep, sorted, for comparing graphs
+	};
+
+	// sharedKeys: deep key of the shared node behind each shared slot
+	NodeKeys GetNodeKeys(Synth* s, const std::vector<u64>& sharedKeys) {
+		NodeKeys keys;
+		keys.shallow.resize(s->nodes.size());
+		keys.deep.resize(s->nodes.size());
+
+		for(u32 i = 0; i < s->nodes.size(); i++) {
+			auto& node = s->nodes[i];
+			u64 config = 0;
+
+			switch(node.type) {
+				case NodeType::SourceNoise: {
+					u32 noiseID = node.inputs[0].node;
+					config = u64(s->noises[noiseID]->color);
+				}	break;
+				case NodeType::SourceSampler: {
+					u32 voiceID = node.inputs[4].node;
+					config = HashTrigger(s, node.inputs[3].node);
+					if(voiceID < s->samplers.size())
+						config = MixKey(config, HashName(s->samplers[voiceID]->sample->path.c_str()));
+				}	break;
+				case NodeType::SourceShared: {
+					u32 slot = node.inputs[0].node;
+					config = slot < sharedKeys.size()? sharedKeys[slot] : 0;
+				}	break;
+				case NodeType::SourceBusInput:
+					config = node.inputs[0].node;
+					break;
+
+				case NodeType::EnvelopeFade:
+					config = HashTrigger(s, node.inputs[1].node);
+					break;
+				case NodeType::EnvelopeADSR:
+					config = HashTrigger(s, node.inputs[5].node);
+					break;
+
+				case NodeType::EffectsBiquad:
+				case NodeType::EffectsStateVariable: {
+					auto filter = s->filters[node.inputs[3].node];
+					config = u64(filter->mode) << 8 | filter->stages;
+				}	break;
+
+				case NodeType::InteractionValue:
+					config = HashName(s->controls[node.inputs[0].node].name);
+					break;
+
+				default: break;
+			}
+
+			u64 shallow = MixKey(u64(node.type) + 1, config);
+			u64 deep = shallow;
+
+			// Nodes only ever take earlier nodes as inputs
+			for(u32 input = 0; input < GetSignalInputCount(node.type); input++) {
+				u32 inputNode = node.inputs[input].node;
+				bool isNode = (node.inputTypes & (1<<input)) && inputNode < i;
+				deep = MixKey(deep, isNode? keys.deep[inputNode] : 0);
+			}
+
+			keys.shallow[i] = shallow;
+			keys.deep[i] = deep;
+		}
+
+		keys.sorted = keys.deep;
+		std::sort(keys.sorted.begin(), keys.sorted.end());
+		return keys;
+	}
+
+	u32 CountCommonKeys(const std::vector<u64>& a, const std::vector<u64>& b) {
+		u32 count = 0;
+		for(u32 i = 0, j = 0; i < a.size() && j < b.size();) {
+			if(a[i] < b[j]) i++;
+			else if(b[j] < a[i]) j++;
+			else { count++; i++; j++; }
+		}
+
+		return count;
+	}
+
+	// For each node of to, the node of from it takes over from, ~0u if none. Equal
+	//	deep keys pair up first, in order, then whatever's left by shallow key, so
+	//	e.g. a filter whose input was rewired still keeps its memory
+	std::vector<u32> MatchNodes(const NodeKeys& to, const NodeKeys& from) {
+		std::vector<u32> match(to.deep.size(), ~0u);
+		std::vector<bool> taken(from.deep.size(), false);
+
+		auto pair = [&](const std::vector<u64>& toKeys, const std::vector<u64>& fromKeys) {
+			std::unordered_map<u64, std::deque<u32>> available;
+			for(u32 i = 0; i < fromKeys.size(); i++)
+				if(!taken[i]) available[fromKeys[i]].push_back(i);
+
+			for(u32 i = 0; i < toKeys.size(); i++) {
+				if(match[i] != ~0u) continue;
+
+				auto it = available.find(toKeys[i]);
+				if(it == available.end() || it->second.empty()) continue;
+
+				match[i] = it->second.front();
+				taken[match[i]] = true;
+				it->second.pop_front();
+			}
+		};
+
+		pair(to.deep, from.deep);
+		pair(to.shallow, from.shallow);
+		return match;
+	}
+
+	u32 FindTrigger(Synth* s, const char* name) {
+		for(u32 i = 0; i < s->triggers.size(); i++)
+			if(!strcmp(s->triggers[i].name, name))
+				return i;
+		return ~0u;
+	}
+
+	u32 FindControl(Synth* s, const char* name) {
+		for(u32 i = 0; i < s->controls.size(); i++)
+			if(!strcmp(s->controls[i].name, name))
+				return i;
+		return ~0u;
+	}
+
+	// Continues from where from is in to, whose graph hasn't been rendered yet. Must
+	//	hold from's mutex, with the audio thread held off
+	void InheritSynthState(Synth* to, Synth* from, const std::vector<u32>& match) {
+		for(u32 i = 0; i < match.size(); i++) {
+			if(match[i] == ~0u) continue;
+
+			auto& n = to->nodes[i];
+			auto& o = from->nodes[match[i]];
+			n.phase = o.phase;
+			n.coefficientKey = o.coefficientKey;
+			n.coefficient = o.coefficient;
+			n.foutput = o.foutput;
+
+			switch(n.type) {
+				case NodeType::SourceNoise: {
+					auto noise = to->noises[n.inputs[0].node];
+					auto old = from->noises[o.inputs[0].node];
+					if(noise->seed == old->seed)
+						*noise = *old;
+				}	break;
+				case NodeType::SourceSampler: {
+					u32 voiceID = n.inputs[4].node;
+					u32 oldID = o.inputs[4].node;
+					if(voiceID >= to->samplers.size() || oldID >= from->samplers.size()) break;
+
+					auto voice = to->samplers[voiceID];
+					auto old = from->samplers[oldID];
+					if(!old->playing || voice->sample != old->sample) break;
+
+					// Streamed voices have to seek, mapped ones pick up exactly
+					voice->Start(old->position / old->sample->sampleRate);
+					if(!voice->stream)
+						voice->position = old->position;
+				}	break;
+				case NodeType::EffectsBiquad:
+				case NodeType::EffectsStateVariable:
+					*to->filters[n.inputs[3].node] = *from->filters[o.inputs[3].node];
+					break;
+				default: break;
+			}
+		}
+
+		for(auto& c: to->controls) {
+			u32 old = FindControl(from, c.name);
+			if(old == ~0u || from->controls[old].initial != c.initial) continue;
+
+			auto& o = from->controls[old];
+			c.value = o.value;
+			c.begin = o.begin;
+			c.target = o.target;
+			c.lerpTime = o.lerpTime;
+		}
+
+		// Pending events follow their trigger or control by name
+		for(u32 i = from->scheduleHead; i < from->schedule.size(); i++) {
+			auto e = from->schedule[i];
+			if(e.kind == ScheduledEvent::Trigger)
+				e.target = e.target < from->triggers.size()? FindTrigger(to, from->triggers[e.target].name) : ~0u;
+			else if(e.kind == ScheduledEvent::Control)
+				e.target = e.target < from->controls.size()? FindControl(to, from->controls[e.target].name) : ~0u;
+
+			if(e.target != ~0u || e.kind == ScheduledEvent::GlobalTrigger)
+				to->schedule.push_back(e);
+		}
+
+		std::stable_sort(to->schedule.begin() + to->scheduleHead, to->schedule.end(), [](const ScheduledEvent& a, const ScheduledEvent& b) {
+			return a.frame < b.frame;
+		});
+
+		to->globalTrigger.state = from->globalTrigger.state;
+		to->time = from->time;
+
+		// No fade in, the gain and panning ramp from wherever they were
+		to->gain = from->gain;
+		to->beginGain = from->beginGain;
+		to->panning = from->panning;
+		to->beginPan = from->beginPan;
+		to->submittedAt = 0;
+
+		if(to->rateDivider == from->rateDivider)
+			std::swap(to->resampler, from->resampler);
+	}
+
+	// Must hold registryMutex. Staged synths were never rendered, so they go right away
+	void DiscardStagedSynth(AudioContext* ctx, Synth* s) {
+		if(s->id) UnregisterSynth(ctx, s);
+		delete s;
+	}
+
+	// Must hold registryMutex
+	void RetireSynth(AudioContext* ctx, Synth* s, u64 epoch) {
+		if(s->id) UnregisterSynth(ctx, s);
+		ctx->retired.push_back({epoch, nullptr, s});
+	}
+
+	u32 CountMatches(const std::vector<u32>& match) {
+		return std::count_if(match.begin(), match.end(), [](u32 m) { return m != ~0u; });
+	}
+}
+
+void BeginSynthReload(AudioContext* ctx) {
+	std::lock_guard<std::mutex> guard{ctx->registryMutex};
+	if(ctx->reloading) return;
+
+	ctx->reloading = true;
+	ctx->reloadBusCount = ctx->busCount.load();
+
+	// Staged synths get the default noise seeds the live ones got, so unchanged noise carries on
+	ctx->synthSerial = 0;
+	ctx->stagedShared = NewSharedGraph(ctx);
+	ctx->stagedSharedNodes.reserve(MaxSharedNodes);
+}
+
+SynthReloadReport CommitSynthReload(AudioContext* ctx) {
+	using Fl = Synth::Flags;
+	SynthReloadReport report {};
+	if(!ctx->reloading) return report;
+
+	TraceScope trace {"commit reload"};
+	std::lock_guard<std::mutex> registryGuard{ctx->registryMutex};
+	ctx->reloading = false;
+
+	// Everything is matched while the audio thread carries on, it's only held off
+	//	while state is copied and the graphs are swapped
+	auto getSlotKeys = [](const NodeKeys& keys, const std::vector<u32>& nodes) {
+		std::vector<u64> slotKeys;
+		for(u32 node: nodes)
+			slotKeys.push_back(node < keys.deep.size()? keys.deep[node] : 0);
+		return slotKeys;
+	};
+
+	auto sharedKeys = GetNodeKeys(ctx->sharedSynth, {});
+	auto stagedSharedKeys = GetNodeKeys(ctx->stagedShared, {});
+	auto slotKeys = getSlotKeys(sharedKeys, ctx->sharedNodes);
+	auto stagedSlotKeys = getSlotKeys(stagedSharedKeys, ctx->stagedSharedNodes);
+	auto sharedMatch = MatchNodes(stagedSharedKeys, sharedKeys);
+
+	auto countNodes = [&report](const std::vector<u32>& match) {
+		u32 kept = CountMatches(match);
+		report.keptNodes += kept;
+		report.newNodes += match.size() - kept;
+	};
+
+	countNodes(sharedMatch);
+
+	std::vector<std::vector<u32>> busMatches(ctx->reloadBusCount);
+	for(u32 i = 0; i < ctx->reloadBusCount; i++) {
+		auto bus = ctx->buses[i];
+		if(!bus->staged) continue;
+
+		busMatches[i] = MatchNodes(GetNodeKeys(bus->staged, stagedSlotKeys), GetNodeKeys(bus->graph, slotKeys));
+		countNodes(busMatches[i]);
+	}
+
+	auto& current = *ctx->renderList.load();
+	std::vector<Synth*> live;
+	for(auto s: current) {
+		std::lock_guard<std::mutex> guard{s->mutex};
+		if(!(s->flags & (Fl::FlagDeletionRequested | Fl::FlagDeletionScheduled)))
+			live.push_back(s);
+	}
+
+	std::vector<NodeKeys> liveKeys;
+	for(auto s: live)
+		liveKeys.push_back(GetNodeKeys(s, slotKeys));
+
+	// Staged synths take over from live ones in order. Of the next few live synths,
+	//	the one with the most unchanged nodes is taken, if at least half of the larger
+	//	graph carries over, so removing or adding a synth doesn't shift the rest
+	std::vector<Synth*> replaces(ctx->stagedSynths.size(), nullptr);
+	std::vector<std::vector<u32>> matches(ctx->stagedSynths.size());
+	std::vector<bool> replaced(live.size(), false);
+	u32 next = 0;
+
+	for(u32 i = 0; i < ctx->stagedSynths.size(); i++) {
+		auto keys = GetNodeKeys(ctx->stagedSynths[i], stagedSlotKeys);
+		u32 end = std::min<u32>(next + ReloadPairingWindow, live.size());
+		u32 best = ~0u;
+		u32 bestCommon = 0;
+
+		for(u32 c = next; c < end; c++) {
+			auto match = MatchNodes(keys, liveKeys[c]);
+			u32 size = std::max(keys.deep.size(), liveKeys[c].deep.size());
+			if(size == 0 || CountMatches(match)*2 < size) continue;
+
+			u32 common = CountCommonKeys(keys.sorted, liveKeys[c].sorted);
+			if(best != ~0u && common <= bestCommon) continue;
+
+			best = c;
+			bestCommon = common;
+			matches[i] = std::move(match);
+		}
+
+		if(best != ~0u) {
+			replaces[i] = live[best];
+			replaced[best] = true;
+			next = best+1;
+		}
+
+		if(replaces[i]) {
+			report.keptSynths++;
+			countNodes(matches[i]);
+		}else{
+			report.newSynths++;
+			report.newNodes += ctx->stagedSynths[i]->nodes.size();
+		}
+	}
+
+	// Replacements render where the synths they replace did, new synths go last
+	auto list = new SynthList;
+	for(auto s: current) {
+		auto it = std::find(replaces.begin(), replaces.end(), s);
+		list->push_back(it != replaces.end()? ctx->stagedSynths[it - replaces.begin()] : s);
+	}
+
+	for(u32 i = 0; i < ctx->stagedSynths.size(); i++)
+		if(!replaces[i]) list->push_back(ctx->stagedSynths[i]);
+
+	// Between callbacks no block is being rendered, so everything below switches
+	//	over at the same sample
+	if(ctx->dev)
+		SDL_LockAudioDevice(ctx->dev);
+
+	{
+		std::lock_guard<std::mutex> guard{ctx->sharedSynth->mutex};
+		InheritSynthState(ctx->stagedShared, ctx->sharedSynth, sharedMatch);
+	}
+
+	std::swap(ctx->sharedSynth, ctx->stagedShared);
+	ctx->sharedNodes.swap(ctx->stagedSharedNodes);
+
+	for(u32 i = 0; i < ctx->reloadBusCount; i++) {
+		auto bus = ctx->buses[i];
+		std::lock_guard<std::mutex> guard{bus->graph->mutex};
+
+		// Buses that weren't rebuilt pass their input through, as after DestroyAllSynths
+		if(!bus->staged) {
+			bus->graph->flags &= ~Fl::FlagPlaying;
+			ClearSynthGraph(bus->graph);
+			continue;
+		}
+
+		InheritSynthState(bus->staged, bus->graph, busMatches[i]);
+		std::swap(bus->graph, bus->staged);
+	}
+
+	for(u32 i = 0; i < ctx->stagedSynths.size(); i++) {
+		if(!replaces[i]) continue;
+
+		std::lock_guard<std::mutex> guard{replaces[i]->mutex};
+		InheritSynthState(ctx->stagedSynths[i], replaces[i], matches[i]);
+	}
+
+	for(u32 i = 0; i < live.size(); i++) {
+		if(replaced[i]) continue;
+
+		// The shared slots it bound now hold whatever the new script exports
+		std::lock_guard<std::mutex> guard{live[i]->mutex};
+		live[i]->flags |= Fl::FlagDeletionRequested | Fl::FlagSharedDetached;
+		report.removedSynths++;
+	}
+
+	u64 epoch = PublishRenderList(ctx, list);
+
+	if(ctx->dev)
+		SDL_UnlockAudioDevice(ctx->dev);
+
+	// What was replaced is only referenced by the lists retired along with it
+	RetireSynth(ctx, ctx->stagedShared, epoch);
+	ctx->stagedShared = nullptr;
+	ctx->stagedSharedNodes.clear();
+
+	for(u32 i = 0; i < ctx->reloadBusCount; i++) {
+		auto bus = ctx->buses[i];
+		if(!bus->staged) continue;
+
+		RetireSynth(ctx, bus->staged, epoch);
+		bus->staged = nullptr;
+	}
+
+	for(auto s: replaces)
+		if(s) RetireSynth(ctx, s, epoch);
+
+	ctx->stagedSynths.clear();
+	return report;
+}
+
+void CancelSynthReload(AudioContext* ctx) {
+	std::lock_guard<std::mutex> guard{ctx->registryMutex};
+	if(!ctx->reloading) return;
+
+	ctx->reloading = false;
+
+	for(auto s: ctx->stagedSynths)
+		DiscardStagedSynth(ctx, s);
+	ctx->stagedSynths.clear();
+
+	DiscardStagedSynth(ctx, ctx->stagedShared);
+	ctx->stagedShared = nullptr;
+	ctx->stagedSharedNodes.clear();
+
+	for(u32 i = 0; i < ctx->reloadBusCount; i++) {
+		auto bus = ctx->buses[i];
+		if(!bus->staged) continue;
+
+		DiscardStagedSynth(ctx, bus->staged);
+		bus->staged = nullptr;
 	}
 }
 
@@ -146,6 +1064,8 @@ u32 CreateNode(Synth* syn, NodeType type, Args&&... vargs) {
 		default: break;
 	}
 
+	// The shared synth is evaluated while it's being built
+	std::lock_guard<std::mutex> l(syn->mutex);
 	syn->nodes.push_back(node);
 	return syn->nodes.size()-1u;
 }
@@ -162,12 +1082,52 @@ u32 NewSqrOscillator(Synth* syn, SynthParam freq, SynthParam phaseOffset, SynthP
 u32 NewSawOscillator(Synth* syn, SynthParam freq, SynthParam phaseOffset) {
 	return CreateNode(syn, NodeType::SourceSaw, freq, phaseOffset);
 }
-u32 NewNoiseSource(Synth* syn) {
-	return CreateNode(syn, NodeType::SourceNoise);
+u32 NewNoiseSource(Synth* syn, NoiseColor color, u32 seed) {
+	if(seed == ~0u)
+		seed = HashSeed(syn->noiseSeed, syn->noises.size());
+
+	auto noise = syn->arena.New<NoiseGenerator>();
+	noise->Init(color, seed);
+
+	u32 noiseID = 0;
+	{
+		std::lock_guard<std::mutex> l(syn->mutex);
+		syn->noises.push_back(noise);
+		noiseID = syn->noises.size()-1u;
+	}
+
+	return CreateNode(syn, NodeType::SourceNoise, noiseID);
 }
 u32 NewTimeSource(Synth* syn) {
 	return CreateNode(syn, NodeType::SourceTime);
 }
+u32 NewSamplerSource(Synth* syn, const char* sample, SynthParam rate, SynthParam start, SynthParam loop, u32 trigger) {
+	auto file = OpenSample(sample);
+	auto voice = syn->arena.New<SamplerVoice>();
+
+	if(!file || !voice->Init(std::move(file))) {
+		voice->Deinit();
+		return CreateNode(syn, NodeType::SourceSampler, rate, start, loop, trigger, ~0u);
+	}
+
+	u32 voiceID = 0;
+	{
+		std::lock_guard<std::mutex> l(syn->mutex);
+		syn->samplers.push_back(voice);
+		voiceID = syn->samplers.size()-1u;
+	}
+
+	return CreateNode(syn, NodeType::SourceSampler, rate, start, loop, trigger, voiceID);
+}
+u32 NewSharedSource(Synth* syn, u32 sharedNode) {
+	assert(syn != GetSharedSynth(syn->context));
+	return CreateNode(syn, NodeType::SourceShared, ExportSharedNode(syn->context, sharedNode));
+}
+u32 NewBusInput(Synth* syn) {
+	u32 busID = GetBusIndex(syn->context, syn);
+	assert(busID != ~0u);
+	return CreateNode(syn, NodeType::SourceBusInput, busID);
+}
 
 u32 NewFadeEnvelope(Synth* syn, SynthParam duration, u32 trigger) {
 	return CreateNode(syn, NodeType::EnvelopeFade, duration, trigger);
@@ -183,9 +1143,44 @@ u32 NewLowPassEffect(Synth* syn, SynthParam input, SynthParam freq) {
 u32 NewHighPassEffect(Synth* syn, SynthParam input, SynthParam freq) {
 	return CreateNode(syn, NodeType::EffectsHighPass, input, freq);
 }
-// u32 NewConvolutionEffect(Synth* syn, SynthParam duration, u32 trigger) {
-// 	return CreateNode(syn, NodeType::EffectsConvolution, duration, trigger);
-// }
+u32 NewFilterEffect(Synth* syn, NodeType type, Filter::Type filterType, SynthParam input, SynthParam freq, SynthParam q, FilterMode mode, u32 stages) {
+	auto filter = syn->arena.New<Filter>();
+	filter->Init(filterType, mode, stages);
+
+	u32 filterID = 0;
+	{
+		std::lock_guard<std::mutex> l(syn->mutex);
+		syn->filters.push_back(filter);
+		filterID = syn->filters.size()-1u;
+	}
+
+	return CreateNode(syn, type, input, freq, q, filterID);
+}
+u32 NewBiquadEffect(Synth* syn, SynthParam input, SynthParam freq, SynthParam q, FilterMode mode, u32 stages) {
+	return NewFilterEffect(syn, NodeType::EffectsBiquad, Filter::TypeBiquad, input, freq, q, mode, stages);
+}
+u32 NewStateVariableEffect(Synth* syn, SynthParam input, SynthParam freq, SynthParam q, FilterMode mode, u32 stages) {
+	return NewFilterEffect(syn, NodeType::EffectsStateVariable, Filter::TypeStateVariable, input, freq, q, mode, stages);
+}
+u32 NewConvolutionEffect(Synth* syn, SynthParam input, const char* impulse, bool async) {
+	auto ir = GetImpulseResponse(impulse);
+	if(!ir) {
+		printf("Impulse response '%s' doesn't exist\n", impulse);
+		return CreateNode(syn, NodeType::EffectsConvolution, input, ~0u);
+	}
+
+	auto convolver = syn->arena.New<Convolver>();
+	convolver->Init(std::move(ir), async? syn->context->config.deviceFrames + syn->context->config.blockFrames : 0);
+
+	u32 convolverID = 0;
+	{
+		std::lock_guard<std::mutex> l(syn->mutex);
+		syn->convolvers.push_back(convolver);
+		convolverID = syn->convolvers.size()-1u;
+	}
+
+	return CreateNode(syn, NodeType::EffectsConvolution, input, convolverID);
+}
 
 u32 NewAddOperation(Synth* syn, SynthParam left, SynthParam right) {
 	return CreateNode(syn, NodeType::MathAdd, left, right);
@@ -207,18 +1202,31 @@ u32 NewNegateOperation(Synth* syn, SynthParam arg) {
 }
 
 u32 NewSynthControl(Synth* syn, const char* name, f32 initialValue) {
-	std::lock_guard<std::mutex> l(syn->mutex);
-	syn->controls.push_back({strdup(name), initialValue, initialValue, initialValue, 0.f});
-	return CreateNode(syn, NodeType::InteractionValue, syn->controls.size()-1u);
+	u32 controlID = 0;
+	{
+		std::lock_guard<std::mutex> l(syn->mutex);
+		syn->controls.push_back({syn->arena.String(name), initialValue, initialValue, initialValue, 0.f, initialValue});
+		controlID = syn->controls.size()-1u;
+	}
+
+	return CreateNode(syn, NodeType::InteractionValue, controlID);
 }
 
 u32 NewSynthTrigger(Synth* syn, const char* name) {
 	std::lock_guard<std::mutex> l(syn->mutex);
-	syn->triggers.push_back({strdup(name), 0});
+	syn->triggers.push_back({syn->arena.String(name), 0});
 	return syn->triggers.size()-1u;
 }
 
+// Starts timing a change before waiting on the synth, see GetTriggerLatency. Changes
+//	made while a synth is still being built aren't waiting on anything
+void MarkSubmitted(Synth* syn, u64 submitted) {
+	if((syn->flags & Synth::FlagPlaying) && !syn->submittedAt)
+		syn->submittedAt = submitted;
+}
+
 void SetSynthControl(Synth* syn, const char* name, f32 val, f32 lerpTime) {
+	u64 submitted = SteadyNow();
 	std::lock_guard<std::mutex> l(syn->mutex);
 	auto it = std::find_if(syn->controls.begin(), syn->controls.end(), [name](const SynthControl& ctl){
 		return !strcmp(ctl.name, name);
@@ -228,9 +1236,11 @@ void SetSynthControl(Synth* syn, const char* name, f32 val, f32 lerpTime) {
 		it->begin = it->value;
 		it->target = val;
 		it->lerpTime = lerpTime;
+		MarkSubmitted(syn, submitted);
 	}
 }
 void TripSynthTrigger(Synth* syn, const char* name) {
+	u64 submitted = SteadyNow();
 	std::lock_guard<std::mutex> l(syn->mutex);
 	auto it = std::find_if(syn->triggers.begin(), syn->triggers.end(), [name](const SynthTrigger& ctl){
 		return !strcmp(ctl.name, name);
@@ -238,9 +1248,77 @@ void TripSynthTrigger(Synth* syn, const char* name) {
 
 	if(it != syn->triggers.end()) {
 		it->state = 1;
+		MarkSubmitted(syn, submitted);
 	}else if(!strcmp(name, "<global>")) {
 		syn->globalTrigger.state = 1;
+		MarkSubmitted(syn, submitted);
+	}
+}
+
+f64 GetAudioTime(AudioContext* ctx) {
+	return f64(ctx->renderedFrames.load(std::memory_order_relaxed)) / ctx->config.sampleRate;
+}
+
+void ScheduleSynthEvent(Synth* syn, const ScheduledEvent& e) {
+	std::lock_guard<std::mutex> l(syn->mutex);
+	auto& schedule = syn->schedule;
+
+	// Whatever the renderer has consumed can go, while it can't be looking
+	schedule.erase(schedule.begin(), schedule.begin() + syn->scheduleHead);
+	syn->scheduleHead = 0;
+
+	auto at = std::upper_bound(schedule.begin(), schedule.end(), e.frame, [](u64 frame, const ScheduledEvent& o) {
+		return frame < o.frame;
+	});
+
+	schedule.insert(at, e);
+}
+
+u64 GetScheduleFrame(Synth* syn, f64 time) {
+	return u64(std::max(time, 0.0) * syn->context->config.sampleRate + 0.5);
+}
+
+void ScheduleSynthControl(Synth* syn, const char* name, f64 time, f32 value, f32 lerpTime) {
+	for(u32 i = 0; i < syn->controls.size(); i++) {
+		if(strcmp(syn->controls[i].name, name)) continue;
+
+		ScheduleSynthEvent(syn, {GetScheduleFrame(syn, time), i, ScheduledEvent::Control, value, lerpTime});
+		return;
+	}
+}
+
+void ScheduleSynthTrigger(Synth* syn, const char* name, f64 time) {
+	u64 frame = GetScheduleFrame(syn, time);
+
+	for(u32 i = 0; i < syn->triggers.size(); i++) {
+		if(strcmp(syn->triggers[i].name, name)) continue;
+
+		ScheduleSynthEvent(syn, {frame, i, ScheduledEvent::Trigger, 0.f, 0.f});
+		return;
 	}
+
+	if(!strcmp(name, "<global>"))
+		ScheduleSynthEvent(syn, {frame, 0, ScheduledEvent::GlobalTrigger, 0.f, 0.f});
+}
+
+void SetSynthRateDivider(Synth* s, u32 divider) {
+	if(s->flags & Synth::FlagBus) return;
+
+	divider = std::max(divider, 1u);
+
+	Resampler* resampler = nullptr;
+	if(divider > 1) {
+		resampler = new Resampler;
+		resampler->Init(divider);
+
+		// The most a block can need is when it starts on an input
+		resampler->input.assign((s->context->blockLength - 1) / divider + 1, 0.f);
+	}
+
+	std::lock_guard<std::mutex> guard{s->mutex};
+	std::swap(s->resampler, resampler);
+	s->rateDivider = divider;
+	delete resampler;
 }
 
 void SetSynthPan(Synth* s, f32 v) {
@@ -274,12 +1352,22 @@ u32 EvaluateTrigger(Synth* syn, SynthNode* node, u8 input) {
 }
 
 void UpdateSynthNode(Synth* syn, u32 nodeID) {
+	auto ctx = syn->context;
 	auto node = &syn->nodes[nodeID];
 	if(node->frameID == syn->frameID) // Already updated
 		return;
 
 	node->frameID = syn->frameID;
 
+	// Inputs are evaluated from within, so their ticks are taken off this node's
+	u64 beginTicks = 0;
+	u64 outerInputTicks = 0;
+	if(ctx->profileNodes) {
+		outerInputTicks = ctx->profileInputTicks;
+		ctx->profileInputTicks = 0;
+		beginTicks = ReadCycleCounter();
+	}
+
 	switch(node->type) {
 		case NodeType::SourceSin: {
 			f32 freq = EvaluateSynthNodeInput(syn, node, 0);
@@ -309,13 +1397,40 @@ void UpdateSynthNode(Synth* syn, u32 nodeID) {
 			node->phase += freq * syn->dt;
 		}	break;
 		case NodeType::SourceNoise: {
-			f32 val = (std::rand() %100000) / 50000.f - 0.5f; // noiseTable(node->phase);
-			node->foutput = clamp(val, -1.f, 1.f);
-			// node->phase += 1.f / noiseTable.size;
+			u32 noiseID = node->inputs[0].node;
+			node->foutput = syn->noises[noiseID]->Next();
+		}	break;
+		case NodeType::SourceSampler: {
+			f32 rate = EvaluateSynthNodeInput(syn, node, 0);
+			f32 start = EvaluateSynthNodeInput(syn, node, 1);
+			f32 loop = EvaluateSynthNodeInput(syn, node, 2);
+
+			u32 voiceID = node->inputs[4].node;
+			if(voiceID >= syn->samplers.size()) {
+				node->foutput = 0.f;
+				break;
+			}
+
+			auto voice = syn->samplers[voiceID];
+			if(EvaluateTrigger(syn, node, 3))
+				voice->Start(start);
+
+			node->foutput = voice->Process(rate * voice->sample->sampleRate * syn->dt, loop > 0.5f);
 		}	break;
 		case NodeType::SourceTime: {
 			node->foutput = syn->time;
 		}	break;
+		case NodeType::SourceShared: {
+			u32 slot = node->inputs[0].node;
+			if(slot < ctx->sharedOutputCount && !(syn->flags & Synth::FlagSharedDetached))
+				node->foutput = ctx->sharedOutputs[slot*ctx->blockLength + ctx->blockPosition];
+			else
+				node->foutput = 0.f;
+		}	break;
+		case NodeType::SourceBusInput: {
+			u32 busID = node->inputs[0].node;
+			node->foutput = ctx->buses[busID]->input[ctx->blockPosition];
+		}	break;
 
 
 		case NodeType::EnvelopeFade: {
@@ -411,8 +1526,14 @@ void UpdateSynthNode(Synth* syn, u32 nodeID) {
 			f32 i = EvaluateSynthNodeInput(syn, node, 0);
 			f32 f = EvaluateSynthNodeInput(syn, node, 1);
 			if(f > 0.f) {
-				f32 a = syn->dt / (syn->dt + 1.f/(PI*2.f*f));
-				node->foutput = lerp(node->foutput, i, a);
+				// a = dt / (dt + 1/(2pi f)), only depends on f*dt
+				f32 key = f32(f * syn->dt);
+				if(key != node->coefficientKey || node->coefficient == 0.f) {
+					node->coefficientKey = key;
+					node->coefficient = 1.f / (1.f + 1.f/(PI*2.f*key));
+				}
+
+				node->foutput = FlushDenormal(lerp(node->foutput, i, node->coefficient));
 			}else{
 				node->foutput = 0.f;
 			}
@@ -421,16 +1542,36 @@ void UpdateSynthNode(Synth* syn, u32 nodeID) {
 		case NodeType::EffectsHighPass:{
 			f32 i = EvaluateSynthNodeInput(syn, node, 0);
 			f32 f = EvaluateSynthNodeInput(syn, node, 1);
-			f32 rc = 1.f/(PI*2.f*f);
-			f32 a = rc / (syn->dt + rc);
 
-			f32 result = a * (node->foutput + i - node->phase);
+			// a = rc / (dt + rc), rc = 1/(2pi f)
+			f32 key = f32(f * syn->dt);
+			if(key != node->coefficientKey || node->coefficient == 0.f) {
+				node->coefficientKey = key;
+				node->coefficient = 1.f / (1.f + PI*2.f*key);
+			}
+
+			f32 result = node->coefficient * (node->foutput + i - node->phase);
 			node->phase = i;
-			node->foutput = result;
+			node->foutput = FlushDenormal(result);
+		}	break;
+		case NodeType::EffectsBiquad:
+		case NodeType::EffectsStateVariable:{
+			f32 i = EvaluateSynthNodeInput(syn, node, 0);
+			f32 f = EvaluateSynthNodeInput(syn, node, 1);
+			f32 q = EvaluateSynthNodeInput(syn, node, 2);
+			u32 filterID = node->inputs[3].node;
+
+			node->foutput = syn->filters[filterID]->Process(i, f, q, syn->dt);
 		}	break;
 		case NodeType::EffectsConvolution:{
 			f32 a = EvaluateSynthNodeInput(syn, node, 0);
-			node->foutput = a;
+			u32 convolverID = node->inputs[1].node;
+
+			// Missing impulse responses pass the input through
+			if(convolverID < syn->convolvers.size())
+				node->foutput = syn->convolvers[convolverID]->Process(a);
+			else
+				node->foutput = a;
 		}	break;
 
 		case NodeType::InteractionValue: {
@@ -440,210 +1581,726 @@ void UpdateSynthNode(Synth* syn, u32 nodeID) {
 
 		default: break;
 	}
+
+	if(ctx->checkDenormals && IsSubnormal(node->foutput))
+		node->subnormals++;
+
+	if(ctx->profileNodes) {
+		u64 ticks = ReadCycleCounter() - beginTicks;
+		node->cycles += ticks - std::min(ticks, ctx->profileInputTicks);
+		ctx->profileInputTicks = outerInputTicks + ticks;
+	}
 }
 
-void audio_callback(void* ud, u8* stream, s32 length) {
-	static std::vector<f32> intermediate;
+// Applies whatever is due by frame, right before the sample at frame is evaluated
+inline void ApplyScheduledEvents(Synth* synth, u64 frame) {
+	auto& schedule = synth->schedule;
 
-	auto outbuffer = (f32*) stream;
-	u32 buflen = (u32)length/sizeof(f32);
+	for(; synth->scheduleHead < schedule.size(); synth->scheduleHead++) {
+		auto& e = schedule[synth->scheduleHead];
+		if(e.frame > frame) break;
 
-	std::memset(stream, 0, length);
+		switch(e.kind) {
+			case ScheduledEvent::Trigger:
+				if(e.target < synth->triggers.size())
+					synth->triggers[e.target].state = 1;
+				break;
 
-	intermediate.resize(buflen/2);
+			case ScheduledEvent::GlobalTrigger:
+				synth->globalTrigger.state = 1;
+				break;
 
-	std::lock_guard<std::mutex> guard{synthMutex};
-	using Fl = Synth::Flags;
+			case ScheduledEvent::Control:
+				if(e.target < synth->controls.size()) {
+					auto& c = synth->controls[e.target];
+					c.begin = c.value;
+					c.target = e.value;
+					c.lerpTime = e.lerpTime;
+
+					// Jumps land on this sample rather than after it
+					if(e.lerpTime <= 0.f)
+						c.value = e.value;
+				}
+				break;
+		}
+	}
+}
+
+// Advances time, resets triggers and steps lerping controls after a sample has been evaluated
+void AdvanceSynth(Synth* synth) {
+	synth->time += synth->dt;
+
+	for(auto& t: synth->triggers)
+		t.state = 0;
+
+	synth->globalTrigger.state = 0;
 
-	u32 synthID = 0;
-	while(auto synth = GetSynth(synthID++)) {
-		if(!synth || !(synth->flags & Fl::FlagPlaying)) {
+	for(auto& c: synth->controls){
+		f32 span = c.target-c.begin;
+		if(c.lerpTime < 1e-6 || std::abs(span) < 1e-6) {
+			c.value = c.target;
 			continue;
 		}
 
-		std::lock_guard<std::mutex> l(synth->mutex);
-		synth->dt = 1.0/sampleRate;
+		f32 a = (c.value-c.begin)/span;
+		if(a < 1.f) {
+			c.value += span/c.lerpTime*synth->dt;
+		}else if (a > 1.f) {
+			c.value = c.target;
+		}
+	}
+}
 
-		for(u32 i = 0; i < intermediate.size(); i++){
-			synth->frameID++;
-			UpdateSynthNode(synth, synth->outputNode);
-			intermediate[i] = synth->nodes[synth->outputNode].foutput;
-			synth->time += synth->dt;
+void UpdateSharedSynth(AudioContext* ctx) {
+	TraceScope trace {"render shared"};
+	AllowedRealtimeLock l(ctx->sharedSynth->mutex);
+	ctx->sharedSynth->dt = 1.0/ctx->config.sampleRate;
 
-			for(auto& t: synth->triggers)
-				t.state = 0;
+	ctx->sharedOutputCount = ctx->sharedNodes.size();
 
-			synth->globalTrigger.state = 0;
+	if(ctx->profileNodes)
+		ctx->sharedSynth->profiledFrames += ctx->blockLength;
 
-			for(auto& c: synth->controls){
-				f32 span = c.target-c.begin;
-				if(c.lerpTime < 1e-6 || std::abs(span) < 1e-6) {
-					c.value = c.target;
-					continue;
-				}
+	for(u32 i = 0; i < ctx->blockLength; i++) {
+		ctx->sharedSynth->frameID++;
+		ApplyScheduledEvents(ctx->sharedSynth, ctx->blockFrame + i);
 
-				f32 a = (c.value-c.begin)/span;
-				if(a < 1.f) {
-					c.value += span/c.lerpTime*synth->dt;
-				}else if (a > 1.f) {
-					c.value = c.target;
-				}
+		for(u32 s = 0; s < ctx->sharedOutputCount; s++) {
+			u32 nodeID = ctx->sharedNodes[s];
+			f32 value = 0.f;
+
+			if(nodeID < ctx->sharedSynth->nodes.size()) {
+				UpdateSynthNode(ctx->sharedSynth, nodeID);
+				value = ctx->sharedSynth->nodes[nodeID].foutput;
 			}
+
+			ctx->sharedOutputs[s*ctx->blockLength + i] = value;
+		}
+
+		AdvanceSynth(ctx->sharedSynth);
+	}
+}
+
+void RenderSynth(Synth* synth, f32* buffer, u32 count) {
+	auto ctx = synth->context;
+	synth->dt = 1.0/ctx->config.sampleRate;
+
+	if(ctx->profileNodes)
+		synth->profiledFrames += count;
+
+	if(auto resampler = synth->resampler) {
+		synth->dt *= synth->rateDivider;
+
+		u32 inputs = resampler->InputsNeeded(count);
+		u32 first = resampler->FirstInput();
+		assert(inputs <= resampler->input.size());
+
+		for(u32 i = 0; i < inputs; i++){
+			synth->frameID++;
+			ctx->blockPosition = first + i*synth->rateDivider; // Shared sources are read at the output rate
+			ApplyScheduledEvents(synth, ctx->blockFrame + ctx->blockPosition);
+			UpdateSynthNode(synth, synth->outputNode);
+			resampler->input[i] = synth->nodes[synth->outputNode].foutput;
+			AdvanceSynth(synth);
 		}
 
-		f32 stereoCoefficients[2] {1.f, 1.f};
+		resampler->Process(resampler->input.data(), buffer, count);
+		return;
+	}
 
-		if(synth->chunkPostProcess)
-			synth->chunkPostProcess(synth, intermediate.data(), intermediate.size(), stereoCoefficients);
+	for(u32 i = 0; i < count; i++){
+		synth->frameID++;
+		ctx->blockPosition = i;
+		ApplyScheduledEvents(synth, ctx->blockFrame + i);
+		UpdateSynthNode(synth, synth->outputNode);
+		buffer[i] = synth->nodes[synth->outputNode].foutput;
+		AdvanceSynth(synth);
+	}
+}
 
-		if(synthPostProcessHook)
-			synthPostProcessHook(synth, intermediate.data(), intermediate.size(), stereoCoefficients);
+// Applies gain and panning ramps and mixes a rendered synth into either the 
+//	output buffer or the input of the bus it's sent to
+void MixSynth(Synth* synth, f32* buffer, u32 count, f32* outbuffer) {
+	auto ctx = synth->context;
+	using Fl = Synth::Flags;
 
-		f32 panning = synth->panning;
-		f32 panStep = (synth->targetPan - synth->beginPan) / intermediate.size();
+	f32 stereoCoefficients[2] {1.f, 1.f};
 
-		f32 gain = synth->gain;
-		f32 gainTarget = synth->targetGain;
-		if(synth->flags & Fl::FlagDeletionRequested)
-			gainTarget = -0.1f;
+	if(synth->chunkPostProcess)
+		synth->chunkPostProcess(synth, buffer, count, stereoCoefficients);
 
-		f32 gainStep = (gainTarget - synth->beginGain) / intermediate.size();
+	if(ctx->synthPostProcessHook)
+		ctx->synthPostProcessHook(synth, buffer, count, stereoCoefficients);
 
-		u32 i = 0;
-		for(auto v: intermediate) {
-			outbuffer[i++] += v * stereoCoefficients[0] * clamp(1-panning, 0, 1) * clamp(gain, 0, 1);
-			outbuffer[i++] += v * stereoCoefficients[1] * clamp(1+panning, 0, 1) * clamp(gain, 0, 1);
+	f32 panning = synth->panning;
+	f32 panStep = (synth->targetPan - synth->beginPan) / count;
 
-			panning += panStep;
-			gain += gainStep;
+	f32 gain = synth->gain;
+	f32 gainTarget = synth->targetGain;
+	if(synth->flags & Fl::FlagDeletionRequested)
+		gainTarget = -0.1f;
+
+	f32 gainStep = (gainTarget - synth->beginGain) / count;
+
+	if(synth->bus < ctx->busCount.load(std::memory_order_relaxed)) {
+		// Buses are mono, so panning is left to the bus
+		MixMono(ctx->buses[synth->bus]->input.data(), buffer, count, gain, gainStep, synth->send);
+	}else{
+		MixStereo(outbuffer, buffer, count, panning, panStep, gain, gainStep, stereoCoefficients);
+	}
+
+	panning += panStep * count;
+	gain += gainStep * count;
+
+	synth->panning = panning;
+	synth->gain = gain;
+
+	// Stop playing
+	if(gain < 0.f && gainTarget < 0.f)
+		synth->flags = Fl::FlagDeletionScheduled;
+	
+	synth->beginPan = synth->targetPan;
+	synth->beginGain = synth->targetGain;
+}
+
+// A change to synth is about to be rendered, at the start of this block
+void RecordLatency(AudioContext* ctx, Synth* synth) {
+	u64 now = SteadyNow();
+	u64 submitted = synth->submittedAt;
+	synth->submittedAt = 0;
+
+	// The callback's buffer plays once the one queued before it has
+	u64 aheadFrames = ctx->callbackFrames + ctx->config.deviceFrames;
+	u64 played = ctx->callbackBegin + aheadFrames * 1000000000ull / ctx->config.sampleRate;
+
+	ctx->pickupLatency.Record(now > submitted? now - submitted : 0);
+	ctx->outputLatency.Record(played > submitted? played - submitted : 0);
+}
+
+// Renders one stereo block of blockLength frames into outbuffer
+void RenderBlock(AudioContext* ctx, f32* outbuffer) {
+	std::memset(outbuffer, 0, ctx->blockLength * 2 * sizeof(f32));
+
+	using Fl = Synth::Flags;
+
+	ctx->renderEpoch.fetch_add(1);
+	auto& synths = *ctx->renderList.load();
+	ctx->blockFrame = ctx->renderedFrames.load(std::memory_order_relaxed);
+	u32 busCount = ctx->busCount.load(std::memory_order_acquire);
+
+	u32 lookahead = ctx->limiterLookahead.load(std::memory_order_relaxed);
+	if(lookahead != ctx->limiter.lookahead)
+		ctx->limiter.SetLookahead(lookahead);
+
+	UpdateSharedSynth(ctx);
+
+	for(u32 i = 0; i < busCount; i++)
+		std::fill(ctx->buses[i]->input.begin(), ctx->buses[i]->input.end(), 0.f);
+
+	u32 active = 0;
+	u32 fading = 0;
+
+	for(auto synth: synths) {
+		if(!(synth->flags & Fl::FlagPlaying)) {
+			continue;
 		}
 
-		synth->panning = panning;
-		synth->gain = gain;
+		active++;
+		if(synth->flags & Fl::FlagDeletionRequested)
+			fading++;
 
-		// Stop playing
-		if(gain < 0.f && gainTarget < 0.f)
-			synth->flags = Fl::FlagDeletionScheduled;
-		
-		synth->beginPan = synth->targetPan;
-		synth->beginGain = synth->targetGain;
+		TraceScope trace {"render synth", synth->id};
+		// Scripts only hold synth mutexes for control changes and building graphs
+		AllowedRealtimeLock l(synth->mutex);
+
+		if(synth->submittedAt)
+			RecordLatency(ctx, synth);
+		RenderSynth(synth, ctx->intermediate.data(), ctx->blockLength);
+		MixSynth(synth, ctx->intermediate.data(), ctx->blockLength, outbuffer);
 	}
 
-	if(bufferPostProcessHook)
-		bufferPostProcessHook(outbuffer, buflen);
+	// Buses run their effects once on the sum of everything sent to them
+	for(u32 i = 0; i < busCount; i++) {
+		auto bus = ctx->buses[i];
+		auto graph = bus->graph;
+		TraceScope trace {"render bus", i};
+		AllowedRealtimeLock l(graph->mutex);
+
+		if(graph->flags & Fl::FlagPlaying)
+			RenderSynth(graph, ctx->intermediate.data(), ctx->blockLength);
+		else
+			std::copy(bus->input.begin(), bus->input.end(), ctx->intermediate.begin());
+
+		MixSynth(graph, ctx->intermediate.data(), ctx->blockLength, outbuffer);
+	}
+
+	u32 buflen = ctx->blockLength * 2;
+
+	if(ctx->bufferPostProcessHook)
+		ctx->bufferPostProcessHook(outbuffer, buflen);
+
+	ctx->limiter.Process(outbuffer, ctx->blockLength);
+
+	ctx->activeSynths.store(active, std::memory_order_relaxed);
+	ctx->idleSynths.store(synths.size() - active, std::memory_order_relaxed);
+	ctx->fadingSynths.store(fading, std::memory_order_relaxed);
+	ctx->renderedFrames.store(ctx->blockFrame + ctx->blockLength, std::memory_order_relaxed);
+
+	ctx->renderEpoch.fetch_add(1);
+
+	if(ctx->bufferReadHook)
+		ctx->bufferReadHook(outbuffer, buflen);
+}
+
+// The device buffer is filled from fixed size blocks, so a callback may render
+//	several blocks or none, and a block may be split across callbacks
+// Timing of a callback that rendered period seconds of audio in seconds
+void RecordCallbackMetrics(AudioContext* ctx, f64 seconds, f64 period) {
+	f32 load = period > 0.0? seconds / period : 0.f;
+
+	ctx->callbacks.fetch_add(1, std::memory_order_relaxed);
+	if(load > 1.f)
+		ctx->xruns.fetch_add(1, std::memory_order_relaxed);
+
+	ctx->lastCallbackSeconds.store(seconds, std::memory_order_relaxed);
+	ctx->lastPeriodSeconds.store(period, std::memory_order_relaxed);
+	ctx->lastLoad.store(load, std::memory_order_relaxed);
+
+	// Only the audio thread writes these, so plain read-modify-writes do
+	f32 smoothing = std::min<f32>(period, 1.f);
+	f32 average = ctx->averageLoad.load(std::memory_order_relaxed);
+	ctx->averageLoad.store(average + (load - average) * smoothing, std::memory_order_relaxed);
+
+	f32 peak = ctx->peakLoad.load(std::memory_order_relaxed);
+	while(load > peak && !ctx->peakLoad.compare_exchange_weak(peak, load, std::memory_order_relaxed));
+
+	u32 bucket = 0;
+	for(u64 us = seconds * 1e6; us > 1 && bucket < MetricsHistogramBuckets-1; us >>= 1)
+		bucket++;
+
+	ctx->durationHistogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void audio_callback(void* ud, u8* stream, s32 length) {
+	RealtimeSection realtime {"audio callback"};
+	TraceScope trace {"audio callback"};
+
+	auto ctx = (AudioContext*) ud;
+	ctx->callbackBegin = SteadyNow();
 
-	constexpr f32 attackTime  = 5.f / 1000.f;
-	constexpr f32 releaseTime = 200.f / 1000.f;
+	// Offline, this is whichever thread called RenderAudio
+	if(ctx->dev)
+		SetTraceThreadName("audio");
 
-	const f32 attack  = std::exp(-1.f / (attackTime * sampleRate));
-	const f32 release = std::exp(-1.f / (releaseTime * sampleRate));
+	auto outbuffer = (f32*) stream;
+	u32 channels = ctx->config.channels;
+	u32 totalFrames = (u32)length / (sizeof(f32) * channels);
+	u32 frames = totalFrames;
+	f64 period = f64(frames) / ctx->config.sampleRate;
+
+	// The device thread isn't ours, so set this every callback rather than once. While
+	//	checking, subnormals are left alone, or there would be none to count
+	ctx->checkDenormals = ctx->denormalCheck.load(std::memory_order_relaxed);
+	if(ctx->checkDenormals)
+		DisableFlushToZero();
+	else
+		EnableFlushToZero();
+
+	ctx->profileNodes = ctx->nodeProfiling.load(std::memory_order_relaxed);
+
+	while(frames > 0) {
+		if(ctx->blockRead == ctx->blockLength) {
+			ctx->callbackFrames = totalFrames - frames;
+			RenderBlock(ctx, ctx->blockBuffer.data());
+			ctx->blockRead = 0;
+		}
 
-	for(u32 i = 0; i < (u32)buflen; i++){
-		f32 sample = outbuffer[i];
-		signalDC = lerp(signalDC, sample, 0.5f/sampleRate);
-		sample -= signalDC;
-		f32 absSignal = std::abs(sample);
+		u32 count = std::min(frames, ctx->blockLength - ctx->blockRead);
+		const f32* block = &ctx->blockBuffer[ctx->blockRead * 2];
 
-		if(absSignal > envelope) {
-			envelope = lerp(envelope, absSignal, 1-attack);
+		if(channels == 2) {
+			std::copy(block, block + count*2, outbuffer);
+		}else if(channels == 1) {
+			for(u32 i = 0; i < count; i++)
+				outbuffer[i] = (block[i*2] + block[i*2+1]) * 0.5f;
 		}else{
-			envelope = lerp(envelope, absSignal, 1-release);
+			std::memset(outbuffer, 0, count * channels * sizeof(f32));
+			for(u32 i = 0; i < count; i++) {
+				outbuffer[i*channels+0] = block[i*2+0];
+				outbuffer[i*channels+1] = block[i*2+1];
+			}
 		}
-		envelope = std::max(envelope, 1.f);
 
-		f32 gain = 0.7f/envelope;
-		outbuffer[i] = clamp(sample*gain, -1.f, 1.f);
+		outbuffer += count * channels;
+		ctx->blockRead += count;
+		frames -= count;
 	}
 
-	if(bufferReadHook)
-		bufferReadHook(outbuffer, buflen);
+	f64 seconds = (SteadyNow() - ctx->callbackBegin) / 1e9;
+	RecordCallbackMetrics(ctx, seconds, period);
 }
 
-bool InitAudio(){
+bool OpenDevice(AudioContext* ctx, const AudioConfig& requested) {
 	SDL_AudioSpec want, have;
 
 	std::memset(&want, 0, sizeof(want));
-	want.freq = 22050;
+	want.freq = requested.sampleRate;
 	want.format = AUDIO_F32SYS;
-	want.channels = 2;
-	want.samples = 256;
+	want.channels = std::max(requested.channels, 1u);
+	want.samples = requested.deviceFrames;
 	want.callback = audio_callback;
+	want.userdata = ctx;
 
-	dev = SDL_OpenAudioDevice(nullptr, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
-	if(!dev) {
+	ctx->dev = SDL_OpenAudioDevice(nullptr, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE|SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+	if(!ctx->dev) {
 		printf("Failed to open audio: %s\n", SDL_GetError());
 		return false;
 	}
 
-	if(have.channels != 2) {
-		printf("Failed to get stereo output\n");
-		return false;		
+	ctx->config = requested;
+	ctx->config.sampleRate = have.freq;
+	ctx->config.deviceFrames = have.samples;
+	ctx->config.blockFrames = requested.blockFrames? requested.blockFrames : have.samples;
+	ctx->config.channels = have.channels;
+	return true;
+}
+
+AudioContext* InitAudio(const AudioConfig& requested){
+	auto ctx = new AudioContext{};
+
+	if(requested.backend == AudioBackend::Device) {
+		if(!OpenDevice(ctx, requested)) {
+			delete ctx;
+			return nullptr;
+		}
+	}else{
+		// deviceFrames still bounds how much is rendered in one go, for async convolvers
+		ctx->config = requested;
+		ctx->config.deviceFrames = std::max(requested.deviceFrames, 1u);
+		ctx->config.blockFrames = requested.blockFrames? requested.blockFrames : ctx->config.deviceFrames;
+		ctx->config.channels = std::max(requested.channels, 1u);
 	}
 
-	sampleRate = have.freq;
-	envelope = 1.0f;
-	signalDC = 0.f;
+	ctx->blockLength = ctx->config.blockFrames;
+	ctx->blockRead = ctx->blockLength;
+	ctx->blockBuffer.assign(ctx->blockLength*2, 0.f);
+	ctx->intermediate.assign(ctx->blockLength, 0.f);
+	ctx->sharedNodes.reserve(MaxSharedNodes);
+	ctx->sharedOutputs.assign(MaxSharedNodes * ctx->blockLength, 0.f);
+
+	ctx->limiter.Init(ctx->config.sampleRate, maxLimiterLookahead);
+	ctx->limiterLookahead = 0;
+
+	ctx->renderList = new SynthList;
+
+	ctx->sharedSynth = NewSharedGraph(ctx);
+
+	std::call_once(wavetablesInitialised, []{
+		sinTable.Init(wavetableSize);
+		sawTable.Init(wavetableSize);
+		triangleTable.Init(wavetableSize);
+
+		f64 step = 1.0 / wavetableSize;
+
+		for(u32 i = 0; i < wavetableSize; i++) {
+			sinTable.data[i] = std::sin(i * 2.0 * PI * step);
+
+			auto nph = i * step;
+			triangleTable.data[i] = (nph <= 0.5f)
+				?(nph-0.25f)*4.f
+				:(0.75f-nph)*4.f;
 
-	sinTable.Init(sampleRate);
-	sawTable.Init(sampleRate);
-	noiseTable.Init(sampleRate);
-	triangleTable.Init(sampleRate);
+			sawTable.data[i] = std::fmod(i*step*2.f, 2.f)-1.f;
+		}
+	});
+
+	if(ctx->dev)
+		SDL_PauseAudioDevice(ctx->dev, 0); // start audio playing.
+
+	return ctx;
+}
+
+void DeinitAudio(AudioContext* ctx) {
+	if(ctx->dev)
+		SDL_CloseAudioDevice(ctx->dev);
 
-	f64 sampleDT = 1.f / sampleRate;
+	CancelSynthReload(ctx);
+
+	for(auto& r: ctx->retired) {
+		delete r.list;
+		delete r.synth;
+	}
 
-	for(u32 i = 0; i < sinTable.size; i++) {
-		sinTable.data[i] = std::sin(i * 2.0 * PI * sampleDT);
+	auto synths = ctx->renderList.load();
+	for(auto s: *synths)
+		delete s;
 
-		auto nph = std::fmod(i * sampleDT, 1.f);
-		triangleTable.data[i] = (nph <= 0.5f)
-			?(nph-0.25f)*4.f
-			:(0.75f-nph)*4.f;
+	delete synths;
+	delete ctx->sharedSynth;
 
-		sawTable.data[i] = std::fmod(i*sampleDT*2.f, 2.f)-1.f;
+	for(u32 i = 0; i < ctx->busCount; i++) {
+		auto bus = ctx->buses[i];
+		free((void*)bus->name);
+		delete bus->graph;
+		delete bus;
 	}
 
-	for(u32 i = 0; i < noiseTable.size; i++)
-		noiseTable.data[i] = (std::rand() %100000) / 50000.f - 0.5f;
+	for(auto& chunk: ctx->slotChunks)
+		delete[] chunk.load();
 
-	SDL_PauseAudioDevice(dev, 0); // start audio playing.
+	delete ctx;
+}
+
+void UpdateAudio(AudioContext* ctx) {
+	using Fl = Synth::Flags;
+	TraceScope trace {"UpdateAudio"};
+
+	std::lock_guard<std::mutex> guard{ctx->registryMutex};
+
+	auto current = ctx->renderList.load();
+	SynthList removed;
+
+	for(auto s: *current) {
+		std::lock_guard<std::mutex> l(s->mutex);
+		if(s->flags & Fl::FlagDeletionScheduled)
+			removed.push_back(s);
+	}
+
+	if(!removed.empty()) {
+		auto list = new SynthList;
+		for(auto s: *current)
+			if(std::find(removed.begin(), removed.end(), s) == removed.end())
+				list->push_back(s);
+
+		u64 epoch = PublishRenderList(ctx, list);
+
+		for(auto s: removed) {
+			UnregisterSynth(ctx, s);
+			ctx->retired.push_back({epoch, nullptr, s});
+		}
+	}
+
+	// Anything retired while no block was being rendered, or before the block
+	//	being rendered at the time finished, can't be referenced anymore
+	u64 now = ctx->renderEpoch.load();
+	auto it = std::remove_if(ctx->retired.begin(), ctx->retired.end(), [now](const Retired& r) {
+		if((r.epoch & 1) && now <= r.epoch)
+			return false;
+
+		delete r.list;
+		delete r.synth;
+		return true;
+	});
+
+	ctx->retired.erase(it, ctx->retired.end());
+
+	u32 retiredSynths = std::count_if(ctx->retired.begin(), ctx->retired.end(), [](const Retired& r) {
+		return r.synth != nullptr;
+	});
+
+	ctx->retiredSynths.store(retiredSynths, std::memory_order_relaxed);
+}
+
+AudioConfig GetAudioConfig(AudioContext* ctx) {
+	return ctx->config;
+}
+
+bool RenderAudio(AudioContext* ctx, f32* buffer, u32 frames) {
+	if(ctx->config.backend != AudioBackend::Offline)
+		return false;
+
+	// Chunked so the byte count fits the callback's length
+	u32 channels = ctx->config.channels;
+	while(frames > 0) {
+		u32 count = std::min(frames, 1u<<16);
+		audio_callback(ctx, (u8*)buffer, count * channels * sizeof(f32));
+		buffer += count * channels;
+		frames -= count;
+	}
 
 	return true;
 }
 
-void DeinitAudio() {
-	SDL_CloseAudioDevice(dev);
+void SetAudioPostNormalizeHook(AudioContext* ctx, AudioPostNormalizeHook* hook) {
+	ctx->bufferReadHook = hook;
 }
 
-void UpdateAudio() {
-	using Fl = Synth::Flags;
+void SetAudioPostProcessHook(AudioContext* ctx, AudioPostProcessHook* hook) {
+	ctx->bufferPostProcessHook = hook;
+}
 
-	bool synthsDirty = false;
+void SetSynthPostProcessHook(AudioContext* ctx, SynthPostProcessHook* hook) {
+	ctx->synthPostProcessHook = hook;
+}
 
-	for(auto& s: synths) {
-		if(s->flags & Fl::FlagDeletionScheduled) {
-			delete s;
-			s = nullptr;
-			synthsDirty = true;
+void SetLimiterLookahead(AudioContext* ctx, f32 seconds) {
+	u32 frames = std::max(seconds, 0.f) * ctx->config.sampleRate;
+	ctx->limiterLookahead = std::min(frames, ctx->limiter.maxLookahead);
+}
+
+void SetDenormalCheck(AudioContext* ctx, bool enabled) {
+	ctx->denormalCheck = enabled;
+}
+
+void PrintDenormalReport(AudioContext* ctx) {
+	auto report = [](Synth* s, const char* kind) {
+		std::lock_guard<std::mutex> guard{s->mutex};
+
+		for(u32 i = 0; i < s->nodes.size(); i++) {
+			auto& node = s->nodes[i];
+			if(node.subnormals == 0) continue;
+
+			printf("%s %u node %u (%s): %u subnormal outputs\n", kind, s->id, i, GetNodeTypeName(node.type), node.subnormals);
+			node.subnormals = 0;
 		}
+	};
+
+	std::lock_guard<std::mutex> guard{ctx->registryMutex};
+	report(ctx->sharedSynth, "shared");
+
+	for(auto s: *ctx->renderList.load())
+		report(s, "synth");
+
+	for(u32 i = 0; i < ctx->busCount; i++)
+		report(ctx->buses[i]->graph, "bus");
+}
+
+void SetNodeProfiling(AudioContext* ctx, bool enabled) {
+	if(enabled && !ctx->nodeProfiling) {
+		ctx->profileBeginTicks = ReadCycleCounter();
+		ctx->profileBeginTime = std::chrono::steady_clock::now();
 	}
 
-	if(synthsDirty) {
-		std::lock_guard<std::mutex> guard{synthMutex};
-		auto it = std::remove(synths.begin(), synths.end(), nullptr);
-		synths.erase(it, synths.end());
+	ctx->nodeProfiling = enabled;
+}
+
+SynthProfile GetSynthProfile(Synth* s) {
+	auto ctx = s->context;
+	SynthProfile profile {};
+
+	// Calibrated over all the time profiling has been enabled, which is at least a window
+	f64 ticksPerSecond = TicksPerSecond(ctx->profileBeginTicks, ctx->profileBeginTime);
+	f64 nsPerTick = ticksPerSecond > 0.0? 1e9 / ticksPerSecond : 0.0;
+
+	std::lock_guard<std::mutex> guard{s->mutex};
+
+	profile.frames = s->profiledFrames;
+	profile.seconds = f64(profile.frames) / ctx->config.sampleRate;
+	f64 frames = std::max<f64>(profile.frames, 1.0);
+
+	for(u32 i = 0; i < s->nodes.size(); i++) {
+		auto& node = s->nodes[i];
+		if(node.cycles == 0) continue;
+
+		NodeProfile n {i, node.type, {nullptr, 0}, node.cycles * nsPerTick / frames};
+		if(i < s->origins.size())
+			n.origin = s->origins[i];
+
+		profile.nsPerFrame += n.nsPerFrame;
+		profile.typeNsPerFrame[u32(node.type)] += n.nsPerFrame;
+		profile.nodes.push_back(n);
+		node.cycles = 0;
 	}
+
+	s->profiledFrames = 0;
+
+	std::sort(profile.nodes.begin(), profile.nodes.end(), [](const NodeProfile& a, const NodeProfile& b) {
+		return a.nsPerFrame > b.nsPerFrame;
+	});
+
+	profile.load = profile.nsPerFrame * ctx->config.sampleRate / 1e9;
+	return profile;
+}
+
+void SetNodeOrigin(Synth* s, u32 node, const char* source, u32 line) {
+	if(node >= s->nodes.size()) return;
+
+	// Graphs are mostly built from one file, so consecutive nodes share the string
+	if(s->origins.empty() || !s->origins.back().source || strcmp(s->origins.back().source, source))
+		source = s->arena.String(source);
+	else
+		source = s->origins.back().source;
+
+	if(s->origins.size() <= node)
+		s->origins.resize(node+1, NodeOrigin{nullptr, 0});
+
+	s->origins[node] = {source, line};
+}
+
+AudioMetrics GetAudioMetrics(AudioContext* ctx) {
+	AudioMetrics m {};
+	m.callbacks = ctx->callbacks.load(std::memory_order_relaxed);
+	m.xruns = ctx->xruns.load(std::memory_order_relaxed);
+	m.lastCallbackSeconds = ctx->lastCallbackSeconds.load(std::memory_order_relaxed);
+	m.lastPeriodSeconds = ctx->lastPeriodSeconds.load(std::memory_order_relaxed);
+	m.lastLoad = ctx->lastLoad.load(std::memory_order_relaxed);
+	m.averageLoad = ctx->averageLoad.load(std::memory_order_relaxed);
+	m.peakLoad = ctx->peakLoad.exchange(0.f, std::memory_order_relaxed);
+
+	m.activeSynths = ctx->activeSynths.load(std::memory_order_relaxed);
+	m.idleSynths = ctx->idleSynths.load(std::memory_order_relaxed);
+	m.fadingSynths = ctx->fadingSynths.load(std::memory_order_relaxed);
+	m.retiredSynths = ctx->retiredSynths.load(std::memory_order_relaxed);
+
+	for(u32 i = 0; i < MetricsHistogramBuckets; i++)
+		m.durationHistogram[i] = ctx->durationHistogram[i].load(std::memory_order_relaxed);
+
+	return m;
 }
 
-void SetAudioPostNormalizeHook(AudioPostNormalizeHook* hook) {
-	bufferReadHook = hook;
+TriggerLatency GetTriggerLatency(AudioContext* ctx) {
+	TriggerLatency latency;
+	ctx->pickupLatency.Load(&latency.pickup);
+	ctx->outputLatency.Load(&latency.output);
+	return latency;
 }
 
-void SetAudioPostProcessHook(AudioPostProcessHook* hook) {
-	bufferPostProcessHook = hook;
+f64 GetLatencyPercentile(const LatencyHistogram& h, f64 fraction) {
+	if(h.count == 0) return 0.0;
+
+	u64 rank = std::max<u64>(std::ceil(fraction * h.count), 1);
+	u64 seen = 0;
+	for(u32 i = 0; i < LatencyBuckets-1; i++) {
+		seen += h.buckets[i];
+		if(seen >= rank)
+			return std::min((i+1) * LatencyBucketSeconds, h.maxSeconds);
+	}
+
+	return h.maxSeconds;
 }
 
-void SetSynthPostProcessHook(SynthPostProcessHook* hook) {
-	synthPostProcessHook = hook;
+const char* GetNodeTypeName(NodeType type) {
+	switch(type) {
+		case NodeType::SourceSin: return "sin";
+		case NodeType::SourceTri: return "tri";
+		case NodeType::SourceSqr: return "sqr";
+		case NodeType::SourceSaw: return "saw";
+		case NodeType::SourceNoise: return "noise";
+		case NodeType::SourceSampler: return "sampler";
+		case NodeType::SourceTime: return "time";
+		case NodeType::SourceShared: return "shared";
+		case NodeType::SourceBusInput: return "input";
+
+		case NodeType::MathAdd: return "add";
+		case NodeType::MathSubtract: return "subtract";
+		case NodeType::MathMultiply: return "multiply";
+		case NodeType::MathDivide: return "divide";
+		case NodeType::MathPow: return "pow";
+		case NodeType::MathNegate: return "negate";
+
+		case NodeType::EnvelopeFade: return "fade";
+		case NodeType::EnvelopeADSR: return "adsr";
+
+		case NodeType::EffectsConvolution: return "convolve";
+		case NodeType::EffectsLowPass: return "lowpass";
+		case NodeType::EffectsHighPass: return "highpass";
+		case NodeType::EffectsBiquad: return "biquad";
+		case NodeType::EffectsStateVariable: return "svf";
+
+		case NodeType::InteractionValue: return "value";
+	}
+
+	return "unknown";
 }
 
 } // namespace synth
\ No newline at end of file
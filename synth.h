@@ -2,6 +2,7 @@
 #define AUDIO_H
 
 #include "common.h"
+#include "arena.h"
 #include <vector>
 #include <mutex>
 
@@ -16,8 +17,10 @@ enum class NodeType : u8 {
 	SourceSqr,
 	SourceSaw,
 	SourceNoise,
-	SourceSampler, // TODO
+	SourceSampler,
 	SourceTime,
+	SourceShared,
+	SourceBusInput,
 
 	MathAdd,
 	MathSubtract,
@@ -32,11 +35,15 @@ enum class NodeType : u8 {
 	EffectsConvolution,
 	EffectsLowPass,
 	EffectsHighPass,
+	EffectsBiquad,
+	EffectsStateVariable,
 
 	InteractionValue,
 	// InteractionTrigger,
 };
 
+constexpr u32 NodeTypeCount = u32(NodeType::InteractionValue) + 1;
+
 union SynthInput {
 	f32 value;
 	u32 node;
@@ -58,6 +65,13 @@ struct SynthNode {
 
 	f64 phase;
 
+	// One-pole filters only redesign when freq*dt changes
+	f32 coefficientKey;
+	f32 coefficient;
+
+	u32 subnormals; // Subnormal outputs, only counted while denormal checks are enabled
+	u64 cycles; // Ticks spent on this node alone, only counted while profiling
+
 	union {
 		f32 foutput;
 		u32 uoutput;
@@ -66,6 +80,12 @@ struct SynthNode {
 	SynthNode() {memset(this, 0, sizeof(SynthNode));}
 };
 
+// Where a node was created, for attributing its cost
+struct NodeOrigin {
+	const char* source;
+	u32 line;
+};
+
 struct SynthControl {
 	const char* name;
 	f32 value;
@@ -73,6 +93,8 @@ struct SynthControl {
 	f32 begin;
 	f32 target;
 	f32 lerpTime;
+
+	f32 initial; // As created, reloads only keep the value if this is unchanged
 };
 
 struct SynthTrigger {
@@ -80,7 +102,37 @@ struct SynthTrigger {
 	u32 state;
 };
 
+// A trigger or control change applied at an exact frame, see ScheduleSynthTrigger
+struct ScheduledEvent {
+	enum Kind : u8 { Trigger, GlobalTrigger, Control };
+
+	u64 frame;
+	u32 target; // Trigger or control index
+	Kind kind;
+	f32 value;
+	f32 lerpTime;
+};
+
 struct Synth;
+struct AudioContext;
+struct Convolver;
+struct SamplerVoice;
+struct Filter;
+struct NoiseGenerator;
+struct Resampler;
+
+enum class NoiseColor : u8 {
+	White,
+	Pink,
+	Brown,
+};
+
+enum class FilterMode : u8 {
+	LowPass,
+	HighPass,
+	BandPass,
+	Notch,
+};
 
 using AudioPostNormalizeHook = void(const f32* buffer, u32 length);
 using AudioPostProcessHook = void(f32* buffer, u32 length);
@@ -91,19 +143,39 @@ struct Synth {
 		FlagPlaying = 1<<0,
 		FlagDeletionRequested = 1<<1,
 		FlagDeletionScheduled = 1<<2,
+		FlagBus = 1<<3,
+		FlagSharedDetached = 1<<4, // Shared slots were cleared or reassigned, shared sources read silence
 	};
 
-	u32 id;
+	AudioContext* context;
+	u32 id; // Handle, see GetSynth
 	u32 flags;
 
 	SynthPostProcessHook* chunkPostProcess;
 
+	u32 bus; // ~0u when mixed directly into the output
+	f32 send;
+
 	std::mutex mutex;
-	std::vector<SynthNode> nodes;
-	std::vector<SynthControl> controls;
-	std::vector<SynthTrigger> triggers;
+
+	// Holds the graph below, control and trigger names included, and releases it
+	//	in one go. Nothing is allocated while rendering
+	Arena arena;
+	ArenaVector<SynthNode> nodes {&arena};
+	ArenaVector<SynthControl> controls {&arena};
+	ArenaVector<SynthTrigger> triggers {&arena};
+	ArenaVector<Convolver*> convolvers {&arena};
+	ArenaVector<SamplerVoice*> samplers {&arena};
+	ArenaVector<Filter*> filters {&arena};
+	ArenaVector<NoiseGenerator*> noises {&arena};
+	ArenaVector<NodeOrigin> origins {&arena}; // Indexed by node, nodes past the end have none
 
 	SynthTrigger globalTrigger;
+
+	// Sorted by frame. Added to under mutex, consumed from scheduleHead while rendering,
+	//	so the audio thread never changes the vector itself
+	std::vector<ScheduledEvent> schedule;
+	u32 scheduleHead;
 	u32 outputNode;
 	u32 frameID;
 
@@ -112,6 +184,16 @@ struct Synth {
 
 	f64 dt;
 	f32 time;
+
+	u32 rateDivider; // Renders at sampleRate/rateDivider, upsampled by resampler
+	Resampler* resampler;
+
+	u32 noiseSeed; // Noise nodes created without a seed derive theirs from this
+
+	u64 profiledFrames; // Output frames rendered while profiling, since the last profile
+	u64 submittedAt; // Steady clock ns of the oldest trigger or control change not rendered yet, 0 if none
+
+	~Synth();
 };
 
 struct SynthParam {
@@ -128,35 +210,204 @@ struct SynthParam {
 	SynthParam(u64 x) : isNode{true}, node{u32(x)} {}
 };
 
-bool InitAudio();
-void DeinitAudio();
-void UpdateAudio();
-void SetAudioPostNormalizeHook(AudioPostNormalizeHook*);
-void SetAudioPostProcessHook(AudioPostProcessHook*);
-void SetSynthPostProcessHook(SynthPostProcessHook*);
+enum class AudioBackend : u8 {
+	Device,  // Plays through SDL, rendering whenever the device wants more
+	Offline, // No device, output is pulled with RenderAudio as fast as it renders
+};
+
+struct AudioConfig {
+	AudioBackend backend = AudioBackend::Device;
+	u32 sampleRate = 22050;
+	u32 deviceFrames = 256; // Requested device buffer size, the device may choose another
+	u32 blockFrames = 256;  // Frames rendered at a time, independent of the device buffer size
+	u32 channels = 2;       // Mono outputs the sum of both channels, channels past two are silent
+};
+
+// Every context has its own device, synths, buses and shared synth, and contexts
+//	can be used from different threads. Synths belong to the context that created
+//	them. Impulse responses and samples are registered process wide.
+AudioContext* InitAudio(const AudioConfig& = {}); // nullptr on failure
+void DeinitAudio(AudioContext*);
+void UpdateAudio(AudioContext*);
+AudioConfig GetAudioConfig(AudioContext*); // The values in use, after the device has had its say
+
+// Offline contexts only. Renders frames of output, interleaved with the context's
+//	channel count, on the calling thread, which is switched to flush-to-zero.
+//	UpdateAudio can be called between renders from the same thread
+bool RenderAudio(AudioContext*, f32* buffer, u32 frames);
+void SetAudioPostNormalizeHook(AudioContext*, AudioPostNormalizeHook*);
+void SetAudioPostProcessHook(AudioContext*, AudioPostProcessHook*);
+void SetSynthPostProcessHook(AudioContext*, SynthPostProcessHook*);
+
+// Enables the look-ahead limiter, which delays output by the look-ahead time (at most
+//	maxLimiterLookahead). 0 switches back to the zero latency envelope limiter.
+constexpr f32 maxLimiterLookahead = 0.05f;
+void SetLimiterLookahead(AudioContext*, f32 seconds);
+
+// Counts subnormal node outputs per node, to find the nodes responsible for CPU
+//	spikes in quiet passages. The report lists and resets the counts of every synth.
+//	The audio thread doesn't flush to zero while checking, so the counts are what the
+//	graphs produce, along with the spikes. Nodes built to flush their own state under
+//	SYNTH_DENORMAL_SAFE still do
+void SetDenormalCheck(AudioContext*, bool enabled);
+void PrintDenormalReport(AudioContext*);
+const char* GetNodeTypeName(NodeType);
+
+// Bucket i counts callbacks that took [2^i, 2^(i+1)) microseconds, the first and last
+//	buckets also take anything shorter and longer
+constexpr u32 MetricsHistogramBuckets = 20;
+
+struct AudioMetrics {
+	u64 callbacks;
+	u64 xruns; // Callbacks that took longer to render than the audio they produced lasts
+	f64 lastCallbackSeconds;
+	f64 lastPeriodSeconds; // Duration of the audio produced by the last callback
+
+	// Render time over period, > 1 means falling behind
+	f32 lastLoad;
+	f32 averageLoad; // Smoothed over roughly the last second
+	f32 peakLoad; // Since the previous GetAudioMetrics
+
+	u32 activeSynths; // Playing
+	u32 idleSynths; // Registered but not playing, e.g., without an output yet
+	u32 fadingSynths; // Fading out after being destroyed, included in activeSynths
+	u32 retiredSynths; // Removed, waiting for the audio thread to move past them
+
+	u64 durationHistogram[MetricsHistogramBuckets]; // Since InitAudio
+};
+
+// Updated by the audio thread every callback and readable from any thread without
+//	locking or disturbing it. Resets peakLoad, so there should only be one reader
+AudioMetrics GetAudioMetrics(AudioContext*);
+
+constexpr u32 LatencyBuckets = 400;
+constexpr f64 LatencyBucketSeconds = 0.00025; // The last bucket takes anything longer
+
+struct LatencyHistogram {
+	u64 count;
+	f64 totalSeconds;
+	f64 maxSeconds;
+	u64 buckets[LatencyBuckets];
+};
+
+// How long triggers and control changes take to be heard. Timing starts when
+//	TripSynthTrigger or SetSynthControl is called, lock waits included, and changes
+//	made to a synth between two renders count once, from the earliest. pickup ends
+//	when the block with the change starts rendering, output when its first sample
+//	is expected to be played, i.e., once the device buffer ahead of it has played
+struct TriggerLatency {
+	LatencyHistogram pickup;
+	LatencyHistogram output;
+};
+
+TriggerLatency GetTriggerLatency(AudioContext*); // Since InitAudio, lock free
+f64 GetLatencyPercentile(const LatencyHistogram&, f64 fraction); // Upper bucket edge, seconds
+
+struct NodeProfile {
+	u32 node;
+	NodeType type;
+	NodeOrigin origin; // source is nullptr for nodes not created from lua
+	f64 nsPerFrame;
+};
+
+struct SynthProfile {
+	u64 frames; // Output frames rendered in the window
+	f64 seconds; // Audio time covered by the window
+	f64 nsPerFrame; // The whole graph, i.e., the sum over nodes
+	f64 load; // Fraction of one core the graph needs to keep up in realtime
+	f64 typeNsPerFrame[NodeTypeCount];
+	std::vector<NodeProfile> nodes; // Every node that ran, most expensive first
+};
+
+// Counts the time each node spends evaluating itself, excluding its inputs, with a
+//	cycle counter read around every node. A profile covers the window since the
+//	synth's last profile (or since profiling was enabled) and starts the next one
+void SetNodeProfiling(AudioContext*, bool enabled);
+SynthProfile GetSynthProfile(Synth*);
+void SetNodeOrigin(Synth*, u32 node, const char* source, u32 line);
 
-bool InitLuaLib(lua_State*);
+// Each lua state drives a single context
+bool InitLuaLib(lua_State*, AudioContext*);
+AudioContext* GetAudioContextLua(lua_State*);
 Synth* GetSynthLua(lua_State*, u32);
-void ExtendTriggerLib(const luaL_Reg[]);
-void ExtendSynthLib(const luaL_Reg[]);
+void ExtendTriggerLib(lua_State*, const luaL_Reg[]);
+void ExtendSynthLib(lua_State*, const luaL_Reg[]);
+
+// Synths are identified by generational handles (Synth::id), which never refer to
+//	another synth once theirs has been destroyed, so a stale handle just fails to
+//	resolve. Synths are only freed by UpdateAudio, so a pointer from GetSynth is
+//	valid until the next UpdateAudio. The audio thread never waits on any of these.
+Synth* CreateSynth(AudioContext*); // nullptr if there are too many synths
+Synth* GetSynth(AudioContext*, u32 handle); // nullptr if the synth no longer exists
+std::vector<u32> GetSynthHandles(AudioContext*); // Every synth that hasn't been destroyed yet
+void DestroyAllSynths(AudioContext*);
+
+// Hot reload. Between BeginSynthReload and CommitSynthReload, synths, the shared synth
+//	and bus graphs are staged: CreateSynth, GetSharedSynth and GetBus (for buses that
+//	already exist) return synths that are built but not heard, while the live ones
+//	keep playing. Committing diffs each staged graph against the live one it replaces
+//	and swaps it in between two blocks. Nodes with the same type, configuration and
+//	inputs (constants aside) carry over their oscillator phase, filter memory,
+//	envelope position, sampler position and so on, so only what changed restarts.
+//	Staged synths replace live ones in creation order, skipping live synths whose
+//	graphs have too little in common, and live synths left over fade out like with
+//	DestroyAllSynths. Controls keep their value unless their initial value changed,
+//	scheduled events carry over, convolution tails restart. Offline contexts must not
+//	be rendered from another thread while committing
+struct SynthReloadReport {
+	u32 keptSynths; // Live synths replaced by a staged one, state carried over
+	u32 newSynths; // Staged synths that start from scratch
+	u32 removedSynths; // Live synths faded out
+	u32 keptNodes; // Nodes of staged graphs that carried over state, buses and the shared synth included
+	u32 newNodes;
+};
 
-Synth* CreateSynth();
-Synth* GetSynth(u32);
-void DestroyAllSynths();
+void BeginSynthReload(AudioContext*);
+SynthReloadReport CommitSynthReload(AudioContext*);
+void CancelSynthReload(AudioContext*); // Drops everything staged, the live synths play on
+
+// The shared synth is a context level graph whose exported nodes are evaluated
+//	once per block, before any other synth. Other synths read them through
+//	NewSharedSource, so e.g., global LFOs and clocks are only computed once and
+//	stay phase-locked across synths. It plays while it's built, so nodes can be added
+//	to it at any time. It is cleared by DestroyAllSynths, and the synths that
+//	destroys read silence from it while they fade out.
+Synth* GetSharedSynth(AudioContext*);
+
+// Shared nodes readable by other synths, by the slot SourceShared nodes refer to.
+//	ExportSharedNode makes a node readable without creating a reader, and returns
+//	its slot, ~0u if there are too many
+std::vector<u32> GetSharedNodes(AudioContext*);
+u32 ExportSharedNode(AudioContext*, u32 sharedNode);
+
+// Buses are mono submixes. Synths sent to a bus are summed into it instead of
+//	the output, and the bus graph (built like any synth, reading the sum through
+//	NewBusInput) is evaluated once per block before being panned into the output.
+//	Without an output node a bus passes its input through.
+Synth* GetBus(AudioContext*, const char* name); // Creates the bus if it doesn't exist yet, nullptr if there are too many
+void SetSynthSend(Synth*, const char* bus, f32 level = 1.f); // bus: nullptr sends to the output
+const char* GetBusName(AudioContext*, u32 bus); // bus: index, e.g., Synth::bus. nullptr past the last bus
 
 u32 NewSinOscillator(Synth*, SynthParam freq, SynthParam phaseOffset = {0.f});
 u32 NewTriOscillator(Synth*, SynthParam freq, SynthParam phaseOffset = {0.f});
 u32 NewSqrOscillator(Synth*, SynthParam freq, SynthParam phaseOffset = {0.f}, SynthParam duty = {1.f}); // duty: [0, 1] -> [0%, 50%]
 u32 NewSawOscillator(Synth*, SynthParam freq, SynthParam phaseOffset = {0.f});
-u32 NewNoiseSource(Synth*);
+u32 NewNoiseSource(Synth*, NoiseColor = NoiseColor::White, u32 seed = ~0u); // ~0u: derived from Synth::noiseSeed
 u32 NewTimeSource(Synth*);
+u32 NewSamplerSource(Synth*, const char* sample, SynthParam rate = {1.f}, SynthParam start = {0.f}, SynthParam loop = {0.f}, u32 trigger = ~0u);
+u32 NewSharedSource(Synth*, u32 sharedNode); // sharedNode: node in GetSharedSynth()
+u32 NewBusInput(Synth*); // Synth must be a bus graph
 
 u32 NewFadeEnvelope(Synth*, SynthParam duration, u32 trigger = ~0u);
 u32 NewADSREnvelope(Synth*, SynthParam attack, SynthParam decay, SynthParam sustain, SynthParam sustainlvl, SynthParam release, u32 trigger = ~0u);
 
 u32 NewLowPassEffect(Synth*, SynthParam input, SynthParam freq);
 u32 NewHighPassEffect(Synth*, SynthParam input, SynthParam freq);
-// u32 NewConvolutionEffect(Synth*, SynthParam freq);
+// Cascades of 1-4 identical 12dB/oct sections, so e.g. a 48dB/oct lowpass is one node.
+//	Coefficients are redesigned at most every 32 samples, and only when freq or q change
+u32 NewBiquadEffect(Synth*, SynthParam input, SynthParam freq, SynthParam q = {0.7071f}, FilterMode = FilterMode::LowPass, u32 stages = 1);
+u32 NewStateVariableEffect(Synth*, SynthParam input, SynthParam freq, SynthParam q = {0.7071f}, FilterMode = FilterMode::LowPass, u32 stages = 1);
+u32 NewConvolutionEffect(Synth*, SynthParam input, const char* impulse, bool async = false); // async: far partitions run on a worker thread
 
 u32 NewAddOperation(Synth*, SynthParam left, SynthParam right);
 u32 NewSubtractOperation(Synth*, SynthParam left, SynthParam right);
@@ -171,21 +422,50 @@ u32 NewSynthTrigger(Synth*, const char*);
 void SetSynthControl(Synth*, const char*, f32, f32 = 0.f);
 void TripSynthTrigger(Synth*, const char*);
 
+// Sample accurate scheduling. Times are in seconds on the context's clock, which
+//	counts the audio rendered so far, so events before GetAudioTime are already late
+//	and are applied at the start of the next block. Events at the same time apply in
+//	the order they were scheduled. Unknown names are ignored, like above
+f64 GetAudioTime(AudioContext*);
+void ScheduleSynthControl(Synth*, const char*, f64 time, f32 value, f32 lerpTime = 0.f);
+void ScheduleSynthTrigger(Synth*, const char*, f64 time);
+
+// Renders a synth at 1/divider of the output rate and upsamples it before mixing,
+//	for layers with little high frequency content. Not supported for buses
+void SetSynthRateDivider(Synth*, u32 divider);
+
 void SetSynthPan(Synth*, f32);
 void SetSynthGain(Synth*, f32);
 
+// Registers (or replaces) a named impulse response for convolution effects. Spectra are
+//	computed here once and shared by every synth using it
+bool CreateImpulseResponse(const char* name, const f32* samples, u32 length, u32 partitionSize = 64);
+
+// Makes a sample file available to samplers by name. Files are opened the first time
+//	they're used, uncompressed WAVs are memory mapped and everything else is streamed
+//	from disk. The first preloadTime seconds are read when the file is opened
+void RegisterSample(const char* name, const char* path, f32 preloadTime = 0.25f);
+
 // Sources
 // 	- Oscillators (Sin, saw, sqr, tri)
 // 		- input: frequency, phase offset, duty
 //		- output: value
 // 	- Noise
+// 		- invariant: color (white, pink, brown), seed
 // 		- output: value
-//  - Sampler?
-// 		- invariant: filename
-//		- input: position/phase, loop, ...
+//  - Sampler
+// 		- invariant: sample
+//		- input: rate, start position (seconds), loop (> 0.5)
+//		- triggers: restart from start position
 // 		- output: value
 //	- Time
 // 		- output: value
+//	- Shared
+// 		- invariant: shared node
+// 		- output: value of shared node for the current sample
+//	- Bus input
+// 		- invariant: bus
+// 		- output: sum of synths sent to bus
 
 // Envelopes
 // 	- FadeIn, FadeOut
@@ -196,7 +476,16 @@ void SetSynthGain(Synth*, f32);
 
 // Effects
 // 	- Convolution
-// 	- LowPass, HighPass, BandPass
+// 		- input: signal
+// 		- invariant: impulse response
+// 		- output: value
+// 	- LowPass, HighPass
+// 		- input: signal, frequency
+// 		- output: value
+// 	- Biquad, StateVariable
+// 		- input: signal, frequency, q
+// 		- invariant: mode (lowpass, highpass, bandpass, notch), stages
+// 		- output: value
 
 // Interaction
 // 	- Triggers
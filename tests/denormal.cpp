@@ -0,0 +1,60 @@
+#include "common.h"
+
+#include "synth.h"
+
+#include <SDL2/SDL.h>
+#include <chrono>
+#include <thread>
+
+using namespace synth;
+
+// A one-pole lowpass whose input drops to zero decays through the subnormal range,
+//	which the subnormal counter has to see even though the audio thread otherwise
+//	flushes to zero. See `make test`
+s32 main() {
+#ifdef SYNTH_DENORMAL_SAFE
+	puts("denormal: the one-pole flushes its own state in this build, nothing to count");
+	return 0;
+#endif
+
+	// No sound card needed, but a real device can still be picked through the environment
+	SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+	if(SDL_Init(SDL_INIT_AUDIO) != 0) {
+		printf("SDL init failed: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	auto audio = InitAudio();
+	if(!audio) {
+		puts("Audio init failed!");
+		return 1;
+	}
+
+	SetDenormalCheck(audio, true);
+
+	auto syn = CreateSynth(audio);
+	u32 input = NewSynthControl(syn, "input", 1.f);
+	u32 lowpass = NewLowPassEffect(syn, input, 2000.f);
+
+	{
+		std::lock_guard<std::mutex> l(syn->mutex);
+		syn->outputNode = lowpass;
+		syn->flags |= Synth::FlagPlaying;
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	SetSynthControl(syn, "input", 0.f);
+	std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+	u32 subnormals = 0;
+	{
+		std::lock_guard<std::mutex> l(syn->mutex);
+		subnormals = syn->nodes[lowpass].subnormals;
+	}
+
+	DeinitAudio(audio);
+	SDL_Quit();
+
+	printf("denormal: %u subnormal outputs from a decaying one-pole\n", subnormals);
+	return subnormals > 0? 0 : 1;
+}
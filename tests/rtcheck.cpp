@@ -0,0 +1,115 @@
+#include "common.h"
+
+#include "synth.h"
+#include "rtcheck.h"
+#include <lua.hpp>
+
+#include <SDL2/SDL.h>
+#include <chrono>
+#include <thread>
+
+using namespace synth;
+
+// Plays each script for a while, calling its update function like the demo does,
+//	and fails if the audio callback or a worker thread did anything it shouldn't.
+//	Needs a build with SYNTH_RT_CHECK, see `make test`
+s32 main(s32 argc, char** argv) {
+	if(argc < 2) {
+		puts("Usage: rtcheck [-t seconds] script...");
+		return 1;
+	}
+
+#ifndef SYNTH_RT_CHECK
+	puts("rtcheck has to be built with SYNTH_RT_CHECK defined");
+	return 1;
+#endif
+
+	// No sound card needed, but a real device can still be picked through the environment
+	SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+	if(SDL_Init(SDL_INIT_AUDIO) != 0) {
+		printf("SDL init failed: %s\n", SDL_GetError());
+		return 1;
+	}
+
+	f32 seconds = 4.f;
+	u32 failures = 0;
+
+	for(s32 i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-t") && i+1 < argc) {
+			seconds = atof(argv[++i]);
+			continue;
+		}
+
+		const char* script = argv[i];
+		auto before = GetRealtimeViolations();
+
+		auto l = luaL_newstate();
+		luaL_openlibs(l);
+
+		auto audio = InitAudio();
+		if(!audio || !InitLuaLib(l, audio)) {
+			puts("Audio init failed!");
+			return 1;
+		}
+
+		if(luaL_dofile(l, script)) {
+			printf("%s: %s\n", script, lua_tostring(l, -1));
+			failures++;
+		}
+
+		u32 updateRef = 0;
+		lua_getglobal(l, "update");
+		if(lua_isfunction(l, -1))
+			updateRef = luaL_ref(l, LUA_REGISTRYINDEX);
+
+		using clock = std::chrono::steady_clock;
+		auto begin = clock::now();
+		auto last = begin;
+		f32 elapsed = 0.f;
+
+		while(elapsed < seconds) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(16));
+
+			auto now = clock::now();
+			f32 dt = std::chrono::duration<f32>(now - last).count();
+			elapsed = std::chrono::duration<f32>(now - begin).count();
+			last = now;
+
+			UpdateAudio(audio);
+
+			if(updateRef) {
+				lua_rawgeti(l, LUA_REGISTRYINDEX, updateRef);
+				lua_pushnumber(l, elapsed);
+				lua_pushnumber(l, dt);
+				if(lua_pcall(l, 2, 0, 0)) {
+					puts(lua_tostring(l, -1));
+					lua_pop(l, 1);
+				}
+			}
+		}
+
+		// Let everything fade out and get collected, like a reload would
+		DestroyAllSynths(audio);
+		for(u32 f = 0; f < 30; f++) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(16));
+			UpdateAudio(audio);
+		}
+
+		DeinitAudio(audio);
+		lua_close(l);
+
+		auto after = GetRealtimeViolations();
+		u64 failed = after.failedSections - before.failedSections;
+
+		printf("%s: %llu realtime sections, %llu with violations (%llu allocations, %llu frees, %llu locks, %llu I/O)\n",
+			script, (unsigned long long)(after.sections - before.sections), (unsigned long long)failed,
+			(unsigned long long)(after.allocations - before.allocations), (unsigned long long)(after.frees - before.frees),
+			(unsigned long long)(after.locks - before.locks), (unsigned long long)(after.io - before.io));
+
+		if(failed > 0 || after.sections == before.sections)
+			failures++;
+	}
+
+	SDL_Quit();
+	return failures > 0? 1 : 0;
+}
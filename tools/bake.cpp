@@ -0,0 +1,284 @@
+#include "common.h"
+
+#include "recording.h"
+#include "synth.h"
+#include <lua.hpp>
+
+#include <sndfile.h>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace synth;
+
+// Renders many scripts offline at once, each job with its own lua state and audio
+//	context, spread over a worker thread per core.
+//
+//	Usage: bake [-j threads] [-r sampleRate] joblist
+//
+//	Every non-empty line of the job list that doesn't start with # is a job:
+//		script seconds output [automation...]
+//	where automation is any number of
+//		control=value@time[:lerp]  sets a control on every synth that has it
+//		!trigger@time              trips a trigger on every synth that has it
+//	e.g.
+//		scripts/drone.lua 30 baked/drone.ogg freq=110@0 freq=165@10:4 !env@12
+//
+//	Automation is scheduled on the audio clock, so it lands on exactly its frame
+
+namespace {
+	struct Event {
+		f32 time;
+		std::string name;
+		bool trigger;
+		f32 value;
+		f32 lerp;
+	};
+
+	struct Job {
+		std::string script;
+		std::string output;
+		f32 seconds;
+		std::vector<Event> events; // Sorted by time
+
+		bool failed;
+		f32 renderTime;
+	};
+
+	std::mutex printMutex;
+
+	bool ParseEvent(const std::string& token, Event* e) {
+		e->trigger = token[0] == '!';
+		e->value = 0.f;
+		e->lerp = 0.f;
+
+		size_t at = token.find('@');
+		if(at == std::string::npos) return false;
+
+		if(e->trigger) {
+			e->name = token.substr(1, at-1);
+			return sscanf(token.c_str() + at + 1, "%f", &e->time) == 1;
+		}
+
+		size_t equals = token.find('=');
+		if(equals == std::string::npos || equals > at) return false;
+
+		e->name = token.substr(0, equals);
+		e->value = atof(token.substr(equals+1, at-equals-1).c_str());
+		return sscanf(token.c_str() + at + 1, "%f:%f", &e->time, &e->lerp) >= 1;
+	}
+
+	bool ParseJobs(const char* path, std::vector<Job>& jobs) {
+		std::ifstream file{path};
+		if(!file) {
+			printf("Can't open job list '%s'\n", path);
+			return false;
+		}
+
+		std::string line;
+		u32 lineNumber = 0;
+		while(std::getline(file, line)) {
+			lineNumber++;
+
+			std::istringstream tokens{line};
+			Job job {};
+			if(!(tokens >> job.script) || job.script[0] == '#') continue;
+
+			if(!(tokens >> job.seconds >> job.output)) {
+				printf("%s:%u: expected 'script seconds output'\n", path, lineNumber);
+				return false;
+			}
+
+			std::string token;
+			while(tokens >> token) {
+				Event e;
+				if(!ParseEvent(token, &e)) {
+					printf("%s:%u: can't parse automation '%s'\n", path, lineNumber, token.c_str());
+					return false;
+				}
+
+				job.events.push_back(e);
+			}
+
+			std::stable_sort(job.events.begin(), job.events.end(), [](const Event& a, const Event& b) {
+				return a.time < b.time;
+			});
+
+			jobs.push_back(std::move(job));
+		}
+
+		return true;
+	}
+
+	void ScheduleEvent(AudioContext* audio, const Event& e) {
+		for(u32 handle: GetSynthHandles(audio)) {
+			auto synth = GetSynth(audio, handle);
+			if(!synth) continue;
+
+			if(e.trigger)
+				ScheduleSynthTrigger(synth, e.name.c_str(), e.time);
+			else
+				ScheduleSynthControl(synth, e.name.c_str(), e.time, e.value, e.lerp);
+		}
+	}
+
+	bool RenderJob(Job& job, u32 sampleRate) {
+		AudioConfig config;
+		config.backend = AudioBackend::Offline;
+		config.sampleRate = sampleRate;
+
+		auto audio = InitAudio(config);
+		config = GetAudioConfig(audio);
+
+		auto l = luaL_newstate();
+		luaL_openlibs(l);
+
+		SNDFILE* sndfile = nullptr;
+		bool ok = InitLuaLib(l, audio);
+
+		if(ok && luaL_dofile(l, job.script.c_str())) {
+			std::lock_guard<std::mutex> guard{printMutex};
+			printf("%s: %s\n", job.script.c_str(), lua_tostring(l, -1));
+			ok = false;
+		}
+
+		if(ok) {
+			SF_INFO info {};
+			info.samplerate = config.sampleRate;
+			info.channels = config.channels;
+			info.format = GetRecordingFormat(job.output.c_str());
+
+			sndfile = info.format? sf_open(job.output.c_str(), SFM_WRITE, &info) : nullptr;
+			if(!sndfile) {
+				std::lock_guard<std::mutex> guard{printMutex};
+				printf("%s: can't write '%s', expected a .wav, .flac or .ogg file\n", job.script.c_str(), job.output.c_str());
+				ok = false;
+			}
+		}
+
+		if(ok) {
+			u32 updateRef = 0;
+			lua_getglobal(l, "update");
+			if(lua_isfunction(l, -1))
+				updateRef = luaL_ref(l, LUA_REGISTRYINDEX);
+
+			u32 updateFrames = config.sampleRate / 60;
+			u64 totalFrames = u64(job.seconds * config.sampleRate);
+			std::vector<f32> buffer(updateFrames * config.channels);
+
+			u32 nextEvent = 0;
+			u64 nextUpdate = updateFrames;
+			f32 lastUpdate = 0.f;
+
+			for(u64 frame = 0; frame < totalFrames;) {
+				// Updates run every 1/60s. Events are only scheduled for the stretch about
+				//	to be rendered, so they also reach synths update creates before then
+				u64 end = std::min(totalFrames, nextUpdate);
+				while(nextEvent < job.events.size() && job.events[nextEvent].time * config.sampleRate < end)
+					ScheduleEvent(audio, job.events[nextEvent++]);
+
+				u32 count = end - frame;
+				RenderAudio(audio, buffer.data(), count);
+				sf_writef_float(sndfile, buffer.data(), count);
+				frame = end;
+
+				if(frame == nextUpdate) {
+					f32 elapsed = f32(frame) / config.sampleRate;
+					UpdateAudio(audio);
+
+					if(updateRef) {
+						lua_rawgeti(l, LUA_REGISTRYINDEX, updateRef);
+						lua_pushnumber(l, elapsed);
+						lua_pushnumber(l, elapsed - lastUpdate);
+						if(lua_pcall(l, 2, 0, 0)) {
+							std::lock_guard<std::mutex> guard{printMutex};
+							printf("%s: %s\n", job.script.c_str(), lua_tostring(l, -1));
+							lua_pop(l, 1);
+						}
+					}
+
+					lastUpdate = elapsed;
+					nextUpdate += updateFrames;
+				}
+			}
+
+			sf_close(sndfile);
+		}
+
+		lua_close(l);
+		DeinitAudio(audio);
+		return ok;
+	}
+}
+
+s32 main(s32 argc, char** argv) {
+	u32 threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+	u32 sampleRate = AudioConfig{}.sampleRate;
+	const char* jobList = nullptr;
+
+	for(s32 i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-j") && i+1 < argc) {
+			threadCount = std::max(atoi(argv[++i]), 1);
+		}else if(!strcmp(argv[i], "-r") && i+1 < argc) {
+			sampleRate = atoi(argv[++i]);
+		}else{
+			jobList = argv[i];
+		}
+	}
+
+	if(!jobList) {
+		puts("Usage: bake [-j threads] [-r sampleRate] joblist");
+		return 1;
+	}
+
+	std::vector<Job> jobs;
+	if(!ParseJobs(jobList, jobs))
+		return 1;
+
+	using clock = std::chrono::steady_clock;
+	auto begin = clock::now();
+
+	std::atomic<u32> nextJob {0};
+	auto worker = [&] {
+		for(u32 i; (i = nextJob++) < jobs.size();) {
+			auto& job = jobs[i];
+			auto jobBegin = clock::now();
+
+			job.failed = !RenderJob(job, sampleRate);
+			job.renderTime = std::chrono::duration<f32>(clock::now() - jobBegin).count();
+
+			if(!job.failed) {
+				std::lock_guard<std::mutex> guard{printMutex};
+				printf("%s -> %s: %.1fs in %.2fs (%.1fx realtime)\n", job.script.c_str(), job.output.c_str(),
+					job.seconds, job.renderTime, job.seconds / job.renderTime);
+			}
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threadCount = std::min<u32>(threadCount, jobs.size());
+	for(u32 i = 0; i < threadCount; i++)
+		threads.emplace_back(worker);
+
+	for(auto& t: threads)
+		t.join();
+
+	f32 wallTime = std::chrono::duration<f32>(clock::now() - begin).count();
+
+	f32 audioTime = 0.f;
+	u32 failures = 0;
+	for(auto& job: jobs) {
+		if(job.failed) failures++;
+		else audioTime += job.seconds;
+	}
+
+	printf("Baked %u of %zu jobs on %u threads: %.1fs of audio in %.2fs (%.1fx realtime)\n",
+		u32(jobs.size() - failures), jobs.size(), threadCount, audioTime, wallTime, audioTime / wallTime);
+
+	return failures > 0? 1 : 0;
+}
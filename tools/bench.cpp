@@ -0,0 +1,337 @@
+#include "common.h"
+
+#include "synth.h"
+#include <lua.hpp>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace synth;
+
+// Benchmarks the engine offline and prints one JSON object per line on stdout, so
+//	results can be collected and compared across versions. Progress goes to stderr.
+//
+//	Usage: bench [-t seconds] [-r rates] [-b blocks] [-s sample] [--no-nodes] [script...]
+//
+//	node:      ns per sample of each node type, with constant and audio rate inputs.
+//	           The cost of otherwise identical synths without the node is subtracted
+//	script:    ns per sample and realtime factor of whole scripts
+//	polyphony: most voices of a reference patch that render in realtime, i.e., with
+//	           the 99th percentile block taking no longer than the block plays for,
+//	           for every combination of sample rates and block sizes (-r 44100,48000)
+
+namespace {
+	using clock = std::chrono::steady_clock;
+
+	// Synths per node benchmark, so the node stands out from per synth overhead
+	constexpr u32 NodeCopies = 16;
+
+	struct Setup {
+		u32 sampleRate;
+		u32 blockFrames;
+	};
+
+	struct Timing {
+		f64 nsPerSample;
+		f64 percentile99; // Block render time in seconds
+	};
+
+	using GraphBuilder = std::function<void(AudioContext*)>;
+
+	// Renders seconds of whatever build creates, one block per RenderAudio so every
+	//	block can be timed. The best of a few runs counts, to keep noise out
+	Timing Measure(const Setup& setup, f32 seconds, const GraphBuilder& build, u32 runs = 3) {
+		AudioConfig config;
+		config.backend = AudioBackend::Offline;
+		config.sampleRate = setup.sampleRate;
+		config.deviceFrames = setup.blockFrames;
+		config.blockFrames = setup.blockFrames;
+
+		auto audio = InitAudio(config);
+		build(audio);
+
+		std::vector<f32> buffer(setup.blockFrames * 2);
+		u32 blocks = std::max<u32>(seconds * setup.sampleRate / setup.blockFrames, 1);
+		std::vector<f64> blockTimes(blocks);
+
+		// Warm up caches and workers
+		for(u32 i = 0; i < blocks/8 + 1; i++)
+			RenderAudio(audio, buffer.data(), setup.blockFrames);
+
+		Timing best {1e30, 1e30};
+		for(u32 run = 0; run < runs; run++) {
+			f64 total = 0.0;
+			for(u32 i = 0; i < blocks; i++) {
+				auto begin = clock::now();
+				RenderAudio(audio, buffer.data(), setup.blockFrames);
+				blockTimes[i] = std::chrono::duration<f64>(clock::now() - begin).count();
+				total += blockTimes[i];
+			}
+
+			std::sort(blockTimes.begin(), blockTimes.end());
+			best.nsPerSample = std::min(best.nsPerSample, total * 1e9 / (f64(blocks) * setup.blockFrames));
+			best.percentile99 = std::min(best.percentile99, blockTimes[blocks * 99 / 100]);
+		}
+
+		DeinitAudio(audio);
+		return best;
+	}
+
+	Synth* NewPlayingSynth(AudioContext* audio) {
+		auto s = CreateSynth(audio);
+		s->flags |= Synth::FlagPlaying;
+		return s;
+	}
+
+	// Audio rate input in [0.5, 1.5], so every input stays in a sensible range
+	u32 NewDriver(Synth* s) {
+		return NewAddOperation(s, NewMultiplyOperation(s, NewSinOscillator(s, 3.f), 0.5f), 1.f);
+	}
+
+	// A node of the type with every input set to in, ~0u if it can't be benchmarked
+	u32 NewBenchNode(Synth* s, NodeType type, SynthParam in, const char* sample) {
+		switch(type) {
+			case NodeType::SourceSin: return NewSinOscillator(s, in);
+			case NodeType::SourceTri: return NewTriOscillator(s, in);
+			case NodeType::SourceSqr: return NewSqrOscillator(s, in, 0.f, in);
+			case NodeType::SourceSaw: return NewSawOscillator(s, in);
+			case NodeType::SourceNoise: return NewNoiseSource(s);
+			case NodeType::SourceSampler:
+				if(!sample) return ~0u;
+				return NewSamplerSource(s, sample, in, 0.f, 1.f);
+			case NodeType::SourceTime: return NewTimeSource(s);
+			case NodeType::SourceShared: {
+				auto shared = GetSharedSynth(s->context);
+				return NewSharedSource(s, NewSinOscillator(shared, 1.f));
+			}
+			case NodeType::SourceBusInput: return ~0u; // Only exists in bus graphs
+
+			case NodeType::MathAdd: return NewAddOperation(s, in, in);
+			case NodeType::MathSubtract: return NewSubtractOperation(s, in, in);
+			case NodeType::MathMultiply: return NewMultiplyOperation(s, in, in);
+			case NodeType::MathDivide: return NewDivideOperation(s, in, in);
+			case NodeType::MathPow: return NewPowOperation(s, in, in);
+			case NodeType::MathNegate: return NewNegateOperation(s, in);
+
+			case NodeType::EnvelopeFade: return NewFadeEnvelope(s, in);
+			case NodeType::EnvelopeADSR: return NewADSREnvelope(s, in, in, in, in, in);
+
+			case NodeType::EffectsConvolution: return NewConvolutionEffect(s, in, "bench");
+			case NodeType::EffectsLowPass: return NewLowPassEffect(s, in, in);
+			case NodeType::EffectsHighPass: return NewHighPassEffect(s, in, in);
+			case NodeType::EffectsBiquad: return NewBiquadEffect(s, in, in, in);
+			case NodeType::EffectsStateVariable: return NewStateVariableEffect(s, in, in, in);
+
+			case NodeType::InteractionValue: return NewSynthControl(s, "value", 1.f);
+		}
+
+		return ~0u;
+	}
+
+	bool HasInputs(NodeType type) {
+		switch(type) {
+			case NodeType::SourceNoise:
+			case NodeType::SourceTime:
+			case NodeType::SourceShared:
+			case NodeType::InteractionValue:
+				return false;
+			default: return true;
+		}
+	}
+
+	void BenchmarkNodes(const Setup& setup, f32 seconds, const char* sample) {
+		// Two seconds of decaying noise, partitioned like the lua default
+		std::vector<f32> impulse(setup.sampleRate * 2);
+		u32 state = 1;
+		for(u32 i = 0; i < impulse.size(); i++) {
+			state = state * 1664525u + 1013904223u;
+			impulse[i] = (f32(state >> 8) / (1<<24) * 2.f - 1.f) * std::exp(-3.f * i / impulse.size());
+		}
+
+		CreateImpulseResponse("bench", impulse.data(), impulse.size());
+
+		// The baselines hold everything but the node being measured
+		auto constantBaseline = Measure(setup, seconds, [](AudioContext* audio) {
+			for(u32 i = 0; i < NodeCopies; i++) {
+				auto s = NewPlayingSynth(audio);
+				s->outputNode = NewSynthControl(s, "baseline", 1.f);
+			}
+		});
+
+		auto audioBaseline = Measure(setup, seconds, [](AudioContext* audio) {
+			for(u32 i = 0; i < NodeCopies; i++) {
+				auto s = NewPlayingSynth(audio);
+				s->outputNode = NewDriver(s);
+			}
+		});
+
+		for(u32 t = 0; t <= u32(NodeType::InteractionValue); t++) {
+			auto type = NodeType(t);
+
+			for(bool audioRate: {false, true}) {
+				if(audioRate && !HasInputs(type)) continue;
+
+				bool supported = true;
+				auto timing = Measure(setup, seconds, [&](AudioContext* audio) {
+					for(u32 i = 0; i < NodeCopies; i++) {
+						auto s = NewPlayingSynth(audio);
+						SynthParam in = audioRate? SynthParam{NewDriver(s)} : SynthParam{1.f};
+
+						u32 node = NewBenchNode(s, type, in, sample);
+						supported = node != ~0u;
+						s->outputNode = supported? node : NewSynthControl(s, "unsupported", 0.f);
+					}
+				});
+
+				if(!supported) {
+					fprintf(stderr, "Skipping %s, %s\n", GetNodeTypeName(type),
+						type == NodeType::SourceSampler? "no sample given (-s)" : "only available in bus graphs");
+					break;
+				}
+
+				auto& baseline = audioRate? audioBaseline : constantBaseline;
+				printf("{\"benchmark\": \"node\", \"node\": \"%s\", \"inputs\": \"%s\", \"sample_rate\": %u, \"ns_per_sample\": %.3f}\n",
+					GetNodeTypeName(type), HasInputs(type)? (audioRate? "audio" : "constant") : "none",
+					setup.sampleRate, std::max(timing.nsPerSample - baseline.nsPerSample, 0.0) / NodeCopies);
+			}
+		}
+	}
+
+	void BenchmarkScript(const Setup& setup, f32 seconds, const char* script) {
+		bool loaded = true;
+		u32 synthCount = 0;
+		u32 nodeCount = 0;
+
+		auto timing = Measure(setup, seconds, [&](AudioContext* audio) {
+			auto l = luaL_newstate();
+			luaL_openlibs(l);
+			InitLuaLib(l, audio);
+
+			if(luaL_dofile(l, script)) {
+				fprintf(stderr, "%s: %s\n", script, lua_tostring(l, -1));
+				loaded = false;
+			}
+
+			// Synths outlive the lua state, which only holds handles
+			lua_close(l);
+
+			auto handles = GetSynthHandles(audio);
+			synthCount = handles.size();
+			nodeCount = 0;
+			for(u32 h: handles)
+				if(auto s = GetSynth(audio, h))
+					nodeCount += s->nodes.size();
+		}, 1);
+
+		if(!loaded) return;
+
+		f64 realtime = 1e9 / (timing.nsPerSample * setup.sampleRate);
+		printf("{\"benchmark\": \"script\", \"script\": \"%s\", \"sample_rate\": %u, \"block_frames\": %u, \"synths\": %u, \"nodes\": %u, \"ns_per_sample\": %.3f, \"realtime\": %.2f}\n",
+			script, setup.sampleRate, setup.blockFrames, synthCount, nodeCount, timing.nsPerSample, realtime);
+	}
+
+	// Subtractive voice: two detuned oscillators through an enveloped lowpass
+	void NewReferenceVoice(AudioContext* audio, u32 index) {
+		auto s = NewPlayingSynth(audio);
+		f32 freq = 110.f * std::pow(2.f, (index % 24) / 12.f);
+
+		u32 osc = NewAddOperation(s, NewSawOscillator(s, freq), NewSqrOscillator(s, freq * 1.005f));
+		u32 env = NewADSREnvelope(s, 0.01f, 0.2f, 1000.f, 0.6f, 0.5f);
+		u32 cutoff = NewAddOperation(s, NewMultiplyOperation(s, env, 3000.f), 200.f);
+		u32 filtered = NewBiquadEffect(s, osc, cutoff, 2.f);
+		s->outputNode = NewMultiplyOperation(s, NewMultiplyOperation(s, filtered, env), 0.01f);
+	}
+
+	bool Realtime(const Setup& setup, u32 voices) {
+		auto timing = Measure(setup, 0.5f, [voices](AudioContext* audio) {
+			for(u32 i = 0; i < voices; i++)
+				NewReferenceVoice(audio, i);
+		}, 1);
+
+		return timing.percentile99 <= f64(setup.blockFrames) / setup.sampleRate;
+	}
+
+	void BenchmarkPolyphony(const Setup& setup) {
+		u32 low = 0;
+		u32 high = 8;
+
+		// Double until it stops keeping up, then bisect down to a couple of percent
+		while(high < 1<<16 && Realtime(setup, high)) {
+			low = high;
+			high *= 2;
+		}
+
+		while(high - low > std::max(low / 50, 1u)) {
+			u32 mid = (low + high) / 2;
+			if(Realtime(setup, mid)) low = mid;
+			else high = mid;
+		}
+
+		printf("{\"benchmark\": \"polyphony\", \"sample_rate\": %u, \"block_frames\": %u, \"voices\": %u}\n",
+			setup.sampleRate, setup.blockFrames, low);
+	}
+
+	std::vector<u32> ParseList(const char* list) {
+		std::vector<u32> values;
+		for(const char* c = list; *c;) {
+			values.push_back(strtoul(c, (char**)&c, 10));
+			if(*c == ',') c++;
+			else break;
+		}
+
+		return values;
+	}
+}
+
+s32 main(s32 argc, char** argv) {
+	f32 seconds = 2.f;
+	std::vector<u32> rates {44100, 48000};
+	std::vector<u32> blocks {64, 256, 1024};
+	const char* sample = nullptr;
+	bool nodes = true;
+	std::vector<const char*> scripts;
+
+	for(s32 i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-t") && i+1 < argc) {
+			seconds = atof(argv[++i]);
+		}else if(!strcmp(argv[i], "-r") && i+1 < argc) {
+			rates = ParseList(argv[++i]);
+		}else if(!strcmp(argv[i], "-b") && i+1 < argc) {
+			blocks = ParseList(argv[++i]);
+		}else if(!strcmp(argv[i], "-s") && i+1 < argc) {
+			sample = argv[++i];
+		}else if(!strcmp(argv[i], "--no-nodes")) {
+			nodes = false;
+		}else{
+			scripts.push_back(argv[i]);
+		}
+	}
+
+	if(rates.empty() || blocks.empty()) {
+		puts("Usage: bench [-t seconds] [-r rates] [-b blocks] [-s sample] [--no-nodes] [script...]");
+		return 1;
+	}
+
+	Setup reference {rates[0], 256};
+
+	if(nodes) {
+		fprintf(stderr, "Benchmarking nodes\n");
+		BenchmarkNodes(reference, seconds, sample);
+	}
+
+	for(auto script: scripts) {
+		fprintf(stderr, "Benchmarking %s\n", script);
+		BenchmarkScript(reference, seconds, script);
+	}
+
+	for(u32 rate: rates) {
+		for(u32 block: blocks) {
+			fprintf(stderr, "Finding polyphony at %uHz, %u frame blocks\n", rate, block);
+			BenchmarkPolyphony({rate, block});
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,248 @@
+#include "common.h"
+
+#include "synth.h"
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace synth;
+
+// Measures trigger-to-sound latency end to end without an audio device, for every
+//	combination of block size and device buffer size (how far ahead of playback
+//	audio is rendered), and picks the fastest configuration that never glitched.
+//
+//	Usage: latency [-r sampleRate] [-b blocks] [-d deviceFrames] [-v voices] [-n events] [-p pollMs]
+//
+//	A thread stands in for the device, rendering a buffer each period on a
+//	realtime schedule. Another stands in for the main loop, polling for input
+//	every pollMs like main.cpp does, and flipping a control on a probe synth when
+//	an input event is due. An event counts as heard at the first sample of the
+//	probe's step, at the time that buffer would be played. voices reference
+//	synths render silently alongside to load the engine.
+//	Prints one JSON object per configuration and one for the best.
+
+namespace {
+	using clock = std::chrono::steady_clock;
+
+	struct Config {
+		u32 sampleRate;
+		u32 blockFrames;
+		u32 deviceFrames;
+	};
+
+	struct Percentiles {
+		f64 p50, p90, p99, max;
+	};
+
+	Percentiles GetPercentiles(std::vector<f64> values) {
+		if(values.empty()) return {};
+
+		std::sort(values.begin(), values.end());
+		auto at = [&](f64 f) { return values[std::min<size_t>(f * values.size(), values.size()-1)]; };
+		return {at(0.5), at(0.9), at(0.99), values.back()};
+	}
+
+	Percentiles GetPercentiles(const LatencyHistogram& h) {
+		return {GetLatencyPercentile(h, 0.5), GetLatencyPercentile(h, 0.9),
+			GetLatencyPercentile(h, 0.99), h.maxSeconds};
+	}
+
+	void PrintPercentiles(const char* name, const Percentiles& p) {
+		printf(", \"%s\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}", name,
+			p.p50 * 1e3, p.p90 * 1e3, p.p99 * 1e3, p.max * 1e3);
+	}
+
+	// Same subtractive voice as the benchmark, but silent
+	void NewLoadVoice(AudioContext* audio, u32 index) {
+		auto s = CreateSynth(audio);
+		f32 freq = 110.f * std::pow(2.f, (index % 24) / 12.f);
+
+		u32 osc = NewAddOperation(s, NewSawOscillator(s, freq), NewSqrOscillator(s, freq * 1.005f));
+		u32 cutoff = NewAddOperation(s, NewMultiplyOperation(s, NewSinOscillator(s, 0.3f), 1000.f), 1500.f);
+		s->outputNode = NewBiquadEffect(s, osc, cutoff, 2.f);
+		s->flags |= Synth::FlagPlaying;
+		SetSynthGain(s, 0.f);
+	}
+
+	struct Result {
+		Config config;
+		u32 events;
+		u64 xruns;
+		Percentiles endToEnd;
+	};
+
+	Result Measure(const Config& config, u32 voices, u32 eventCount, f64 pollSeconds) {
+		AudioConfig audioConfig;
+		audioConfig.backend = AudioBackend::Offline;
+		audioConfig.sampleRate = config.sampleRate;
+		audioConfig.blockFrames = config.blockFrames;
+		audioConfig.deviceFrames = config.deviceFrames;
+
+		auto audio = InitAudio(audioConfig);
+		audioConfig = GetAudioConfig(audio);
+
+		for(u32 i = 0; i < voices; i++)
+			NewLoadVoice(audio, i);
+
+		auto probe = CreateSynth(audio);
+		probe->outputNode = NewSynthControl(probe, "gate", 0.f);
+		probe->flags |= Synth::FlagPlaying;
+
+		// The device publishes when it hears the probe, the main loop when an event happened
+		std::atomic<bool> running {true};
+		std::atomic<s64> eventTime {0};
+		std::atomic<s64> heardTime {0};
+		std::atomic<bool> silent {true};
+
+		auto origin = clock::now();
+		auto since = [origin](clock::time_point t) {
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(t - origin).count();
+		};
+
+		std::thread device([&] {
+			std::vector<f32> buffer(audioConfig.deviceFrames * audioConfig.channels);
+			auto period = std::chrono::nanoseconds(u64(1e9 * audioConfig.deviceFrames / audioConfig.sampleRate));
+			auto deadline = clock::now();
+
+			while(running) {
+				std::this_thread::sleep_until(deadline);
+				auto callback = clock::now();
+				RenderAudio(audio, buffer.data(), audioConfig.deviceFrames);
+
+				// The gate steps by 1, and the output's DC blocker only moves a little
+				//	between events, so anything much smaller is the gate being off
+				u32 open = ~0u;
+				for(u32 i = 0; i < audioConfig.deviceFrames && open == ~0u; i++)
+					if(std::abs(buffer[i * audioConfig.channels]) > 0.5f)
+						open = i;
+
+				// This buffer plays once the one before it has
+				if(open != ~0u && eventTime.load() && !heardTime.load()) {
+					u64 frames = audioConfig.deviceFrames + open;
+					heardTime = since(callback) + s64(frames * 1000000000ull / audioConfig.sampleRate);
+				}
+
+				silent = open == ~0u;
+
+				// A late device doesn't catch up by rendering faster
+				deadline += period;
+				if(deadline < clock::now())
+					deadline = clock::now();
+			}
+		});
+
+		std::mt19937 random {1234};
+		std::uniform_real_distribution<f64> gap {0.02, 0.06};
+		std::vector<f64> latencies;
+
+		auto nextEvent = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<f64>(0.1));
+
+		// The main loop
+		while(latencies.size() < eventCount) {
+			std::this_thread::sleep_for(std::chrono::duration<f64>(pollSeconds));
+			auto now = clock::now();
+
+			if(!eventTime && now >= nextEvent) {
+				eventTime = since(nextEvent);
+				SetSynthControl(probe, "gate", 1.f);
+			}
+
+			if(eventTime && heardTime) {
+				latencies.push_back((heardTime - eventTime) / 1e9);
+				SetSynthControl(probe, "gate", 0.f);
+
+				// Wait for silence before the next event
+				while(!silent)
+					std::this_thread::sleep_for(std::chrono::duration<f64>(pollSeconds));
+
+				heardTime = 0;
+				eventTime = 0;
+				nextEvent = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<f64>(gap(random)));
+			}
+
+			UpdateAudio(audio);
+		}
+
+		running = false;
+		device.join();
+
+		Result result {config, eventCount, GetAudioMetrics(audio).xruns, GetPercentiles(latencies)};
+		auto engine = GetTriggerLatency(audio);
+
+		printf("{\"benchmark\": \"latency\", \"sample_rate\": %u, \"block_frames\": %u, \"device_frames\": %u, \"voices\": %u, \"events\": %u, \"xruns\": %llu",
+			config.sampleRate, config.blockFrames, config.deviceFrames, voices, eventCount, (unsigned long long)result.xruns);
+		PrintPercentiles("end_to_end_ms", result.endToEnd);
+		PrintPercentiles("engine_pickup_ms", GetPercentiles(engine.pickup));
+		PrintPercentiles("engine_output_ms", GetPercentiles(engine.output));
+		printf("}\n");
+		fflush(stdout);
+
+		DeinitAudio(audio);
+		return result;
+	}
+
+	std::vector<u32> ParseList(const char* list) {
+		std::vector<u32> values;
+		for(const char* c = list; *c;) {
+			values.push_back(strtoul(c, (char**)&c, 10));
+			if(*c == ',') c++;
+			else break;
+		}
+
+		return values;
+	}
+}
+
+s32 main(s32 argc, char** argv) {
+	u32 sampleRate = AudioConfig{}.sampleRate;
+	std::vector<u32> blocks {64, 128, 256, 512};
+	std::vector<u32> deviceFrames {64, 128, 256, 512, 1024};
+	u32 voices = 32;
+	u32 events = 40;
+	f64 pollSeconds = 0.001;
+
+	for(s32 i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-r") && i+1 < argc) {
+			sampleRate = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-b") && i+1 < argc) {
+			blocks = ParseList(argv[++i]);
+		}else if(!strcmp(argv[i], "-d") && i+1 < argc) {
+			deviceFrames = ParseList(argv[++i]);
+		}else if(!strcmp(argv[i], "-v") && i+1 < argc) {
+			voices = atoi(argv[++i]);
+		}else if(!strcmp(argv[i], "-n") && i+1 < argc) {
+			events = std::max(atoi(argv[++i]), 1);
+		}else if(!strcmp(argv[i], "-p") && i+1 < argc) {
+			pollSeconds = atof(argv[++i]) / 1000.0;
+		}else{
+			puts("Usage: latency [-r sampleRate] [-b blocks] [-d deviceFrames] [-v voices] [-n events] [-p pollMs]");
+			return 1;
+		}
+	}
+
+	std::vector<Result> results;
+	for(u32 block: blocks) {
+		for(u32 device: deviceFrames) {
+			fprintf(stderr, "Measuring %u frame blocks, %u frame device buffers\n", block, device);
+			results.push_back(Measure({sampleRate, block, device}, voices, events, pollSeconds));
+		}
+	}
+
+	// Glitching configurations don't count, however fast
+	const Result* best = nullptr;
+	for(auto& r: results)
+		if(r.xruns == 0 && (!best || r.endToEnd.p99 < best->endToEnd.p99))
+			best = &r;
+
+	if(!best) {
+		fprintf(stderr, "Every configuration had xruns\n");
+		return 1;
+	}
+
+	printf("{\"benchmark\": \"latency_best\", \"sample_rate\": %u, \"block_frames\": %u, \"device_frames\": %u, \"p99_ms\": %.3f}\n",
+		best->config.sampleRate, best->config.blockFrames, best->config.deviceFrames, best->endToEnd.p99 * 1e3);
+	return 0;
+}
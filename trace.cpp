@@ -0,0 +1,166 @@
+#include "trace.h"
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace synth {
+
+std::atomic<bool> tracingEnabled {false};
+
+namespace {
+	enum { RingSize = 1<<15 };
+
+	struct TraceEvent {
+		const char* name;
+		u32 arg;
+		u64 begin;
+		u64 end;
+	};
+
+	// Single producer. Readers copy events and then discard whatever the producer
+	//	may have overwritten in the meantime, so neither side waits
+	struct ThreadTrace {
+		std::atomic<const char*> name;
+		std::atomic<u64> written;
+		TraceEvent events[RingSize];
+	};
+
+	// Rings are never freed, so events of finished threads can still be written.
+	//	Ring i belongs to the i-th thread that recorded an event, and is its tid
+	std::mutex ringsMutex;
+	std::atomic<ThreadTrace*> rings {nullptr};
+	std::atomic<u32> claimedRings {0}; // Keeps counting past MaxTraceThreads
+
+	thread_local ThreadTrace* threadTrace = nullptr;
+	thread_local bool threadClaimed = false;
+	thread_local const char* threadName = nullptr;
+
+	std::atomic<u64> traceEpoch {0};
+
+	// nullptr if every ring is taken
+	ThreadTrace* GetThreadTrace() {
+		if(threadClaimed) return threadTrace;
+
+		auto pool = rings.load(std::memory_order_acquire);
+		if(!pool) return nullptr;
+
+		threadClaimed = true;
+		u32 index = claimedRings.fetch_add(1);
+		if(index >= MaxTraceThreads)
+			return nullptr;
+
+		threadTrace = &pool[index];
+		threadTrace->name = threadName;
+		return threadTrace;
+	}
+
+	void WriteString(FILE* file, const char* s) {
+		fputc('"', file);
+		for(; *s; s++) {
+			if(*s == '"' || *s == '\\') fputc('\\', file);
+			if(u8(*s) >= 0x20) fputc(*s, file);
+		}
+		fputc('"', file);
+	}
+}
+
+void SetTracing(bool enabled) {
+	u64 expected = 0;
+	if(enabled)
+		traceEpoch.compare_exchange_strong(expected, GetTraceTime());
+
+	// Before enabling, so that no thread records before there's a ring to claim
+	if(enabled) {
+		std::lock_guard<std::mutex> guard{ringsMutex};
+		if(!rings.load())
+			rings.store(new ThreadTrace[MaxTraceThreads]{}, std::memory_order_release);
+	}
+
+	tracingEnabled = enabled;
+}
+
+void SetTraceThreadName(const char* name) {
+	threadName = name;
+	if(threadTrace)
+		threadTrace->name = name;
+}
+
+u64 GetTraceTime() {
+	u64 ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	return std::max<u64>(ns, 1);
+}
+
+void RecordTraceEvent(const char* name, u32 arg, u64 begin, u64 end) {
+	auto t = GetThreadTrace();
+	if(!t) return;
+
+	u64 index = t->written.load(std::memory_order_relaxed);
+	t->events[index % RingSize] = {name, arg, begin, end};
+	t->written.store(index + 1, std::memory_order_release);
+}
+
+bool WriteTrace(const char* path) {
+	auto file = fopen(path, "w");
+	if(!file) {
+		printf("Can't write trace to '%s'\n", path);
+		return false;
+	}
+
+	auto pool = rings.load(std::memory_order_acquire);
+	u32 claimed = claimedRings.load();
+	u32 ringCount = pool? std::min(claimed, MaxTraceThreads) : 0;
+	if(claimed > MaxTraceThreads)
+		printf("%u threads weren't traced, only %u can be\n", claimed - MaxTraceThreads, MaxTraceThreads);
+
+	u64 epoch = traceEpoch.load();
+	bool first = true;
+	auto separate = [&] {
+		fputs(first? "\n" : ",\n", file);
+		first = false;
+	};
+
+	fputs("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", file);
+
+	std::vector<TraceEvent> events(RingSize);
+	for(u32 r = 0; r < ringCount; r++) {
+		auto t = &pool[r];
+		u32 id = r + 1;
+		u64 end = t->written.load(std::memory_order_acquire);
+		u64 begin = end > RingSize? end - RingSize : 0;
+
+		for(u64 i = begin; i < end; i++)
+			events[i - begin] = t->events[i % RingSize];
+
+		// Anything the thread wrote since may have replaced the oldest events copied
+		u64 now = t->written.load(std::memory_order_acquire);
+		u64 valid = now > RingSize? now - RingSize : 0;
+
+		if(auto name = t->name.load()) {
+			separate();
+			fprintf(file, "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": ", id);
+			WriteString(file, name);
+			fputs("}}", file);
+		}
+
+		for(u64 i = std::max(begin, valid); i < end; i++) {
+			auto& e = events[i - begin];
+			separate();
+			fputs("{\"ph\": \"X\", \"name\": ", file);
+			WriteString(file, e.name);
+			fprintf(file, ", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f", id,
+				(s64(e.begin) - s64(epoch)) / 1e3, (e.end - e.begin) / 1e3);
+
+			if(e.arg != ~0u)
+				fprintf(file, ", \"args\": {\"id\": %u}", e.arg);
+
+			fputs("}", file);
+		}
+	}
+
+	fputs("\n]}\n", file);
+	fclose(file);
+	return true;
+}
+
+}
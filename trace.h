@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "common.h"
+#include <atomic>
+
+namespace synth {
+
+// Timeline tracing, for seeing how the main loop and the audio thread interleave.
+//	Scoped events go into a fixed size ring per thread, written only by that thread,
+//	and WriteTrace dumps what the rings hold as Chrome trace JSON, which Perfetto
+//	(ui.perfetto.dev) and chrome://tracing open. While tracing is disabled a scope
+//	costs an atomic load. Rings for MaxTraceThreads threads are allocated the first
+//	time tracing is enabled, and a thread's first event claims one with an atomic
+//	increment, so recording never allocates or locks. Threads past that many record
+//	nothing.
+constexpr u32 MaxTraceThreads = 16;
+
+void SetTracing(bool enabled);
+void SetTraceThreadName(const char* name); // name must outlive the trace, e.g., a literal
+bool WriteTrace(const char* path); // Events of every thread, rings keep the most recent
+
+extern std::atomic<bool> tracingEnabled;
+
+u64 GetTraceTime(); // ns, never 0
+void RecordTraceEvent(const char* name, u32 arg, u64 begin, u64 end);
+
+// Records the scope as one event. name must outlive the trace, arg (e.g., a synth
+//	handle) is shown with the event unless ~0u
+struct TraceScope {
+	const char* name;
+	u32 arg;
+	u64 begin;
+
+	TraceScope(const char* name, u32 arg = ~0u) : name{name}, arg{arg}, begin{0} {
+		if(tracingEnabled.load(std::memory_order_relaxed))
+			begin = GetTraceTime();
+	}
+
+	~TraceScope() {
+		if(begin) RecordTraceEvent(name, arg, begin, GetTraceTime());
+	}
+};
+
+}
+
+#endif